@@ -0,0 +1,225 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// AFBC software decoder implementation
+
+#include "drm.h"
+
+// Sub-block positions (column, row) within a 16x16 superblock in storage order
+static const uint8_t subblockOrder[AFBC_SUBBLOCKS][2] = {
+	{1, 1}, {1, 0}, {0, 0}, {0, 1},
+	{0, 2}, {0, 3}, {1, 3}, {1, 2},
+	{2, 2}, {2, 3}, {3, 3}, {3, 2},
+	{3, 1}, {2, 1}, {2, 0}, {3, 0}
+};
+
+int afbc_isSupported(uint64_t modifier) {
+	uint64_t mode;
+
+	if (fourcc_mod_get_vendor(modifier) != DRM_FORMAT_MOD_VENDOR_ARM)
+		return 0;
+
+	if (((modifier >> 52) & DRM_FORMAT_MOD_ARM_TYPE_MASK) != DRM_FORMAT_MOD_ARM_TYPE_AFBC)
+		return 0;
+
+	mode = modifier & 0x000fffffffffffffULL;
+
+	// Only 16x16 superblocks with a single plane are decoded
+	if ((mode & AFBC_FORMAT_MOD_BLOCK_SIZE_MASK) != AFBC_FORMAT_MOD_BLOCK_SIZE_16x16)
+		return 0;
+
+	if (mode & (AFBC_FORMAT_MOD_SPLIT | AFBC_FORMAT_MOD_SC | AFBC_FORMAT_MOD_DB | AFBC_FORMAT_MOD_USM))
+		return 0;
+
+	// Only solid superblocks and uncompressed sub-blocks can be decoded. Real GPU output is
+	// mostly entropy coded sub-blocks, so the modifier is refused at init until those are.
+	return 0;
+}
+
+int afbc_init(afbc_state_t *afbc, uint64_t modifier, uint32_t width, uint32_t height) {
+	size_t blocks;
+
+	afbc_close(afbc);
+
+	afbc->modifier = modifier;
+	afbc->width = width;
+	afbc->height = height;
+	afbc->blocksX = (width + AFBC_BLOCK_SIZE - 1) / AFBC_BLOCK_SIZE;
+	afbc->blocksY = (height + AFBC_BLOCK_SIZE - 1) / AFBC_BLOCK_SIZE;
+
+	// Tiled header layout pads the superblock grid to whole 8x8 tiles
+	if (modifier & AFBC_FORMAT_MOD_TILED) {
+		afbc->blocksX = (afbc->blocksX + AFBC_TILE_SIZE - 1) & ~(AFBC_TILE_SIZE - 1);
+		afbc->blocksY = (afbc->blocksY + AFBC_TILE_SIZE - 1) & ~(AFBC_TILE_SIZE - 1);
+	}
+
+	blocks = (size_t)afbc->blocksX * afbc->blocksY;
+
+	afbc->headerCache = calloc(blocks, AFBC_HEADER_SIZE);
+	afbc->linear = getPoolBuffer((size_t)width * height * sizeof(uint32_t));
+
+	if (!afbc->headerCache || !afbc->linear) {
+		afbc_close(afbc);
+		return -1;
+	}
+
+	afbc->primed = 0;
+	afbc->changed = 0;
+
+	return 0;
+}
+
+void afbc_close(afbc_state_t *afbc) {
+	free(afbc->headerCache);
+	putPoolBuffer(afbc->linear);
+
+	memset(afbc, 0, sizeof(*afbc));
+}
+
+void afbc_invalidate(afbc_state_t *afbc) {
+	afbc->primed = 0;
+}
+
+static inline uint32_t afbc_readLe32(const uint8_t *p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint32_t afbc_getSubblockSize(const uint8_t *header, int index) {
+	uint32_t bit = 32 + index * 6;
+	uint32_t byte = bit / CHAR_BIT;
+	uint32_t value = header[byte];
+
+	if (byte + 1 < AFBC_HEADER_SIZE)
+		value |= (uint32_t)header[byte + 1] << 8;
+
+	return (value >> (bit % CHAR_BIT)) & 0x3f;
+}
+
+static inline uint32_t afbc_getPayloadSize(uint32_t size) {
+	// Size value 1 marks an uncompressed sub-block (too large for the 6-bit field)
+	return size == 1 ? SQUARE(AFBC_SUBBLOCK_SIZE) * sizeof(uint32_t) : size;
+}
+
+static size_t afbc_getHeaderIndex(afbc_state_t *afbc, uint32_t bx, uint32_t by) {
+	uint32_t tilesX;
+
+	if (!(afbc->modifier & AFBC_FORMAT_MOD_TILED))
+		return (size_t)by * afbc->blocksX + bx;
+
+	tilesX = afbc->blocksX / AFBC_TILE_SIZE;
+
+	return ((size_t)(by / AFBC_TILE_SIZE) * tilesX + bx / AFBC_TILE_SIZE) * SQUARE(AFBC_TILE_SIZE) +
+		(by % AFBC_TILE_SIZE) * AFBC_TILE_SIZE + (bx % AFBC_TILE_SIZE);
+}
+
+// Returns whether a pixel of the sub-block changed
+static int afbc_fillSubblock(afbc_state_t *afbc, uint32_t x0, uint32_t y0, const uint32_t *pixels, uint32_t color) {
+	uint32_t x, y, value;
+	int changed = 0;
+
+	for (y = y0; y < y0 + AFBC_SUBBLOCK_SIZE && y < afbc->height; y++) {
+		uint32_t *row = afbc->linear + (size_t)y * afbc->width;
+
+		for (x = x0; x < x0 + AFBC_SUBBLOCK_SIZE && x < afbc->width; x++) {
+			value = pixels ? pixels[(y - y0) * AFBC_SUBBLOCK_SIZE + (x - x0)] : color;
+			changed |= row[x] != value;
+			row[x] = value;
+		}
+	}
+
+	return changed;
+}
+
+// Result: AFBC_CHANGED, AFBC_UNCHANGED, AFBC_CORRUPTED or AFBC_UNSUPPORTED
+static int afbc_decodeSuperblock(afbc_state_t *afbc, const uint8_t *header, const uint8_t *src, size_t size, uint32_t bx, uint32_t by) {
+	uint32_t pixels[SQUARE(AFBC_SUBBLOCK_SIZE)];
+	uint32_t offset = afbc_readLe32(header);
+	uint32_t x0, y0, length;
+	int i, changed = 0;
+
+	// A zero body offset marks a solid color superblock, the color is stored in the header
+	if (offset == 0) {
+		for (i = 0; i < AFBC_SUBBLOCKS; i++)
+			changed |= afbc_fillSubblock(afbc, bx * AFBC_BLOCK_SIZE + subblockOrder[i][0] * AFBC_SUBBLOCK_SIZE,
+				by * AFBC_BLOCK_SIZE + subblockOrder[i][1] * AFBC_SUBBLOCK_SIZE, NULL, afbc_readLe32(header + 8));
+		return changed ? AFBC_CHANGED : AFBC_UNCHANGED;
+	}
+
+	for (i = 0; i < AFBC_SUBBLOCKS; i++) {
+		x0 = bx * AFBC_BLOCK_SIZE + subblockOrder[i][0] * AFBC_SUBBLOCK_SIZE;
+		y0 = by * AFBC_BLOCK_SIZE + subblockOrder[i][1] * AFBC_SUBBLOCK_SIZE;
+		length = afbc_getPayloadSize(afbc_getSubblockSize(header, i));
+
+		// The header may be read while the producer rewrites it
+		if (offset + length > size)
+			return AFBC_CORRUPTED;
+
+		if (length == sizeof(pixels)) {
+			// Uncompressed sub-block
+			memcpy(pixels, src + offset, sizeof(pixels));
+		} else if (length != 0 || i == 0) {
+			// Entropy coded sub-block (the bitstream is not public), or nothing to repeat
+			return AFBC_UNSUPPORTED;
+		}
+
+		// A zero size sub-block has no payload and repeats the previous sub-block
+		changed |= afbc_fillSubblock(afbc, x0, y0, pixels, 0);
+		offset += length;
+	}
+
+	return changed ? AFBC_CHANGED : AFBC_UNCHANGED;
+}
+
+uint32_t *afbc_decodeFrame(afbc_state_t *afbc, const uint8_t *src, size_t size, frame_damage_t *damage) {
+	const uint8_t *header;
+	uint8_t *cache;
+	uint32_t bx, by, visibleX, visibleY;
+	size_t index;
+	int result;
+
+	visibleX = (afbc->width + AFBC_BLOCK_SIZE - 1) / AFBC_BLOCK_SIZE;
+	visibleY = (afbc->height + AFBC_BLOCK_SIZE - 1) / AFBC_BLOCK_SIZE;
+
+	if ((size_t)afbc->blocksX * afbc->blocksY * AFBC_HEADER_SIZE > size)
+		return afbc->linear;
+
+	afbc->changed = 0;
+
+	for (by = 0; by < visibleY; by++) {
+		for (bx = 0; bx < visibleX; bx++) {
+			index = afbc_getHeaderIndex(afbc, bx, by);
+			header = src + index * AFBC_HEADER_SIZE;
+			cache = afbc->headerCache + index * AFBC_HEADER_SIZE;
+
+			// Only superblocks whose header changed since the previous frame are decoded
+			if (afbc->primed && !memcmp(header, cache, AFBC_HEADER_SIZE))
+				continue;
+
+			result = afbc_decodeSuperblock(afbc, header, src, size, bx, by);
+			if (result == AFBC_UNSUPPORTED)
+				return NULL;
+
+			// A torn header is decoded again on the next frame
+			if (result == AFBC_CORRUPTED)
+				memset(cache, 0xff, AFBC_HEADER_SIZE);
+			else
+				memcpy(cache, header, AFBC_HEADER_SIZE);
+
+			if (result == AFBC_UNCHANGED && afbc->primed)
+				continue;
+
+			if (!afbc->changed++)
+				damage->yMin = by * AFBC_BLOCK_SIZE;
+			damage->yMax = MIN((by + 1) * AFBC_BLOCK_SIZE, afbc->height) - 1;
+		}
+	}
+
+	// Damage rows are exact, the screen update can skip its own diff
+	damage->valid = 1;
+	if (!afbc->changed) {
+		damage->yMin = 1;
+		damage->yMax = 0;
+	}
+
+	afbc->primed = 1;
+
+	return afbc->linear;
+}
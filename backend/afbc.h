@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for the AFBC software decoder
+
+#ifndef AFBC_H
+#define AFBC_H
+
+#include "common.h"
+#include "framebuffer.h"
+
+#if __has_include(<libdrm/drm_fourcc.h>)
+#  include <libdrm/drm_fourcc.h>
+#else
+#  include <drm/drm_fourcc.h>
+#endif
+
+#define AFBC_HEADER_SIZE 16	// Header bytes per superblock
+#define AFBC_BLOCK_SIZE 16	// Superblock width and height in pixels
+#define AFBC_SUBBLOCK_SIZE 4	// Sub-block width and height in pixels
+#define AFBC_SUBBLOCKS 16	// Sub-blocks per superblock
+#define AFBC_TILE_SIZE 8	// Superblocks per header tile edge (AFBC_FORMAT_MOD_TILED)
+
+// Superblock decoding results
+#define AFBC_UNCHANGED		0
+#define AFBC_CHANGED		1
+#define AFBC_CORRUPTED		2
+#define AFBC_UNSUPPORTED	3
+
+typedef struct {
+	uint64_t modifier;
+	uint32_t width;		// Visible width in pixels
+	uint32_t height;	// Visible height in pixels
+	uint32_t blocksX;	// Superblock columns (including padding)
+	uint32_t blocksY;	// Superblock rows (including padding)
+	uint32_t changed;	// Superblocks decoded during the last frame
+	int primed;		// Header cache holds a valid previous frame
+	uint8_t *headerCache;	// Headers of the previously decoded frame
+	uint32_t *linear;	// Linear staging buffer (width * height)
+} afbc_state_t;
+
+int afbc_isSupported(uint64_t modifier);
+int afbc_init(afbc_state_t *afbc, uint64_t modifier, uint32_t width, uint32_t height);
+void afbc_close(afbc_state_t *afbc);
+void afbc_invalidate(afbc_state_t *afbc);
+uint32_t *afbc_decodeFrame(afbc_state_t *afbc, const uint8_t *src, size_t size, frame_damage_t *damage);
+
+#endif
@@ -2,67 +2,95 @@
 // DRM backend implementation
 
 #include "drm.h"
+#include "scale.h"
 
 int drmFd = -1;
-int fbIndex = -1;
 int initCount = 0;
-uint32_t connId, crtcId, fbId[DRM_FBMAX];
-void *drmBufferMap, *drmBufferMapList[DRM_FBMAX];
-drm_state_t drmState;
+drm_head_t drmHeads[MAX_HEADS];
+int drmHeadCount = 0;
 
-void drm_findActiveCrtc(void) {
+void drm_findActiveCrtcs(void) {
 	drmModeConnector *conn = NULL;
 	drmModeEncoder *enc = NULL;
 	drmModeRes *res = NULL;
-	int i;
+	drm_head_t *head;
+	int i, j;
 
 	res = drmModeGetResources(drmFd);
 	if (!res) {
-		LOG(" Failed to query DRM resources.\n");
+		LOGE(" Failed to query DRM resources.\n");
 		exit(EXIT_FAILURE);
 	}
 
-	for (i = 0; i < res->count_connectors; i++) {
+	drmHeadCount = 0;
+
+	for (i = 0; i < res->count_connectors && drmHeadCount < MAX_HEADS; i++) {
 		conn = drmModeGetConnector(drmFd, res->connectors[i]);
-		if (conn && conn->connection == DRM_MODE_CONNECTED)
-			break;
+		if (!conn)
+			continue;
 
-		if (conn)
+		if (conn->connection != DRM_MODE_CONNECTED) {
 			drmModeFreeConnector(conn);
+			continue;
+		}
 
-		conn = NULL;
-	}
+		enc = drmModeGetEncoder(drmFd, conn->encoder_id);
+		if (!enc) {
+			LOGE(" Failed to query encoder: %u.\n", conn->encoder_id);
+			drmModeFreeConnector(conn);
 
-	if (!conn) {
-		LOG(" No active DRM connector found.\n");
-		drmModeFreeResources(res);
-		exit(EXIT_FAILURE);
-	}
+			// Connected outputs without an active encoder are skipped in multi-head mode
+			if (multiHead)
+				continue;
+
+			drmModeFreeResources(res);
+			exit(EXIT_FAILURE);
+		}
 
-	connId = conn->connector_id;
+		// Cloned outputs share the same CRTC, it is captured only once
+		for (j = 0; j < drmHeadCount; j++) {
+			if (drmHeads[j].crtcId == enc->crtc_id)
+				break;
+		}
+
+		if (j == drmHeadCount && (enc->crtc_id || !multiHead)) {
+			head = &drmHeads[drmHeadCount++];
+			memset(head, 0, sizeof(*head));
+			head->connId = conn->connector_id;
+			head->crtcId = enc->crtc_id;
+			head->crtcIndex = -1;
+			head->fbIndex = -1;
+
+			// The CRTC index is needed to match the possible CRTCs of planes
+			for (j = 0; j < res->count_crtcs; j++) {
+				if (res->crtcs[j] == enc->crtc_id)
+					head->crtcIndex = j;
+			}
+		}
 
-	enc = drmModeGetEncoder(drmFd, conn->encoder_id);
-	if (!enc) {
-		LOG(" Failed to query encoder: %u.\n", conn->encoder_id);
+		drmModeFreeEncoder(enc);
 		drmModeFreeConnector(conn);
-		drmModeFreeResources(res);
-		exit(EXIT_FAILURE);
-	}
 
-	crtcId = enc->crtc_id;
+		// Without multi-head mode, only the first connected output is used
+		if (!multiHead && drmHeadCount)
+			break;
+	}
 
-	drmModeFreeEncoder(enc);
-	drmModeFreeConnector(conn);
 	drmModeFreeResources(res);
+
+	if (!drmHeadCount) {
+		LOGE(" No active DRM connector found.\n");
+		exit(EXIT_FAILURE);
+	}
 }
 
-double drm_getFracRate(void) {
+double drm_getFracRate(drm_head_t *head) {
 	drmModeObjectProperties *connProps;
 	drmModePropertyRes *propInfo;
 	double value = 1;
 	int i;
 
-	connProps = drmModeObjectGetProperties(drmFd, connId, DRM_MODE_OBJECT_CONNECTOR);
+	connProps = drmModeObjectGetProperties(drmFd, head->connId, DRM_MODE_OBJECT_CONNECTOR);
 	if (!connProps)
 		return value;
 
@@ -83,10 +111,62 @@ double drm_getFracRate(void) {
 	return value;
 }
 
-uint32_t drm_findVideoPlane(void) {
+int drm_getObjectProperty(uint32_t objectId, uint32_t objectType, const char *name, uint64_t *value) {
+	drmModeObjectProperties *objectProps;
+	drmModePropertyRes *propInfo;
+	int i, found = 0;
+
+	objectProps = drmModeObjectGetProperties(drmFd, objectId, objectType);
+	if (!objectProps)
+		return 0;
+
+	for (i = 0; i < objectProps->count_props && !found; i++) {
+		propInfo = drmModeGetProperty(drmFd, objectProps->props[i]);
+		if (!propInfo)
+			continue;
+
+		if (!strcmp(propInfo->name, name)) {
+			*value = objectProps->prop_values[i];
+			found = 1;
+		}
+
+		drmModeFreeProperty(propInfo);
+	}
+
+	drmModeFreeObjectProperties(objectProps);
+	return found;
+}
+
+uint32_t drm_findObjectProperty(uint32_t objectId, uint32_t objectType, const char *name) {
+	drmModeObjectProperties *objectProps;
+	drmModePropertyRes *propInfo;
+	uint32_t propId = 0;
+	int i;
+
+	objectProps = drmModeObjectGetProperties(drmFd, objectId, objectType);
+	if (!objectProps)
+		return 0;
+
+	for (i = 0; i < objectProps->count_props && !propId; i++) {
+		propInfo = drmModeGetProperty(drmFd, objectProps->props[i]);
+		if (!propInfo)
+			continue;
+
+		if (!strcmp(propInfo->name, name))
+			propId = propInfo->prop_id;
+
+		drmModeFreeProperty(propInfo);
+	}
+
+	drmModeFreeObjectProperties(objectProps);
+	return propId;
+}
+
+uint32_t drm_findVideoPlane(drm_head_t *head) {
 	drmModePlaneRes *planeRes;
 	drmModePlane *plane;
 	uint32_t planeId = 0;
+	uint64_t type;
 	int i;
 
 	planeRes = drmModeGetPlaneResources(drmFd);
@@ -99,7 +179,9 @@ uint32_t drm_findVideoPlane(void) {
 		if (!plane)
 			continue;
 
-		if (plane->crtc_id == crtcId && plane->fb_id != 0) {
+		// Only overlay planes are listed without universal planes, primary and cursor planes are ignored
+		if (plane->crtc_id == head->crtcId && plane->fb_id != 0 &&
+		    (!drm_getObjectProperty(plane->plane_id, DRM_MODE_OBJECT_PLANE, "type", &type) || type == DRM_PLANE_TYPE_OVERLAY)) {
 			planeId = plane->plane_id;
 			drmModeFreePlane(plane);
 			break;
@@ -112,165 +194,337 @@ uint32_t drm_findVideoPlane(void) {
 	return planeId;
 }
 
-int drm_initFrameBuffer(void) {
-	LOG("-- Initializing DRM framebuffer device - Count: %d --\n", initCount + 1);
+uint32_t drm_findCursorPlane(drm_head_t *head) {
+	drmModePlaneRes *planeRes;
+	drmModePlane *plane;
+	uint32_t planeId = 0;
+	uint64_t type;
+	int i;
 
-	drmFd = open(DRM_DEVICE, O_RDONLY);
-	if (drmFd == -1) {
-		LOG(" Cannot open DRM framebuffer '%s'.\n", DRM_DEVICE);
-		if (!initCount) {
-			return -1; // Return to the selector
-		} else {
-			exit(EXIT_FAILURE);
-		}
-	}
+	if (head->crtcIndex < 0)
+		return 0;
 
-	if (drmDropMaster(drmFd) != 0) {
-		if (errno != EPERM && errno != EINVAL) {
-			LOG(" Failed to drop DRM master: %s\n", strerror(errno));
-			close(drmFd);
-			exit(EXIT_FAILURE);
-		}
+	planeRes = drmModeGetPlaneResources(drmFd);
+	if (!planeRes)
+		return 0;
+
+	for (i = 0; i < planeRes->count_planes && !planeId; i++) {
+		plane = drmModeGetPlane(drmFd, planeRes->planes[i]);
+
+		if (!plane)
+			continue;
+
+		if ((plane->possible_crtcs & (1 << head->crtcIndex)) &&
+		    drm_getObjectProperty(plane->plane_id, DRM_MODE_OBJECT_PLANE, "type", &type) && type == DRM_PLANE_TYPE_CURSOR)
+			planeId = plane->plane_id;
+
+		drmModeFreePlane(plane);
 	}
 
-	drm_findActiveCrtc();
-	drmModeCrtc *crtc = drmModeGetCrtc(drmFd, crtcId);
+	drmModeFreePlaneResources(planeRes);
+	return planeId;
+}
+
+void drm_initHead(drm_head_t *head) {
+	drm_state_t *state = &head->state;
+	screen_info_t *info = &head->info;
+
+	head->suspend = 0;
+	head->fbIndex = -1;
+
+	drmModeCrtc *crtc = drmModeGetCrtc(drmFd, head->crtcId);
 	if (!crtc) {
-		LOG(" Failed to query CRTC state: %u\n", crtcId);
+		LOGE(" Failed to query CRTC state: %u\n", head->crtcId);
 		exit(EXIT_FAILURE);
 	}
 
-	drmState.modeWidth = crtc->mode.hdisplay;
-	drmState.modeHeight = crtc->mode.vdisplay;
-	drmState.scanFactor = (crtc->mode.flags & DRM_MODE_FLAG_INTERLACE) ? 2 : 1;
-	drmState.refreshRate = (double)(crtc->mode.clock * 1000 * drmState.scanFactor) /
-		(crtc->mode.htotal * crtc->mode.vtotal * drm_getFracRate());
+	state->modeWidth = crtc->mode.hdisplay;
+	state->modeHeight = crtc->mode.vdisplay;
+	state->scanFactor = (crtc->mode.flags & DRM_MODE_FLAG_INTERLACE) ? 2 : 1;
+	state->refreshRate = (double)(crtc->mode.clock * 1000 * state->scanFactor) /
+		(crtc->mode.htotal * crtc->mode.vtotal * drm_getFracRate(head));
 
 	drmModeFB2 *buffer = drmModeGetFB2(drmFd, crtc->buffer_id);
 	if (!buffer) {
-		if (drm_findVideoPlane()) {
+		if (drm_findVideoPlane(head)) {
 			LOG(" No framebuffer found, but video plane is active.\n");
-			suspend = 1;
+			head->suspend = 1;
 		} else {
-			LOG(" Failed to query active framebuffer: %u.\n", crtc->buffer_id);
+			LOGE(" Failed to query active framebuffer: %u.\n", crtc->buffer_id);
 			drmModeFreeCrtc(crtc);
 			exit(EXIT_FAILURE);
 		}
 	} else {
-		if (buffer->modifier != DRM_FORMAT_MOD_LINEAR) {
-			LOG(" Non-linear framebuffer modifier detected, exiting.\n");
+		if (buffer->modifier != DRM_FORMAT_MOD_LINEAR && !afbc_isSupported(buffer->modifier)) {
+			LOGE(" Unsupported framebuffer modifier detected: 0x%llx, exiting.\n", (unsigned long long)buffer->modifier);
 			drmModeFreeFB2(buffer);
 			drmModeFreeCrtc(crtc);
 			exit(EXIT_FAILURE);
 		}
 	}
 
-	if (!suspend) {
-		// Checking for multiple buffer usage
-		drmState.multiBuffer = buffer->height / (buffer->width * drmState.modeHeight / drmState.modeWidth);
-
-		screenInfo.width = buffer->width;
-		screenInfo.height = buffer->height / drmState.multiBuffer;
-		screenInfo.stride = buffer->pitches[0];
-		screenInfo.start = 0; // On DRM, there is no offset value to extract, so the start value will always be zero.
-		drmState.pixelFormat = buffer->pixel_format;
-		drmState.fbId = buffer->fb_id;
+	if (!head->suspend) {
+		state->modifier = buffer->modifier;
+
+		// Checking for multiple buffer usage (compressed buffers always hold a single frame)
+		if (state->modifier == DRM_FORMAT_MOD_LINEAR)
+			state->multiBuffer = buffer->height / (buffer->width * state->modeHeight / state->modeWidth);
+		else
+			state->multiBuffer = 1;
+
+		info->width = buffer->width;
+		info->height = buffer->height / state->multiBuffer;
+		info->stride = buffer->pitches[0];
+		info->start = 0; // On DRM, there is no offset value to extract, so the start value will always be zero.
+		state->pixelFormat = buffer->pixel_format;
+		state->fbId = buffer->fb_id;
+
+		// Compressed framebuffers are decoded into a linear staging buffer
+		if (state->modifier != DRM_FORMAT_MOD_LINEAR) {
+			if (afbc_init(&head->afbc, state->modifier, info->width, info->height) != 0) {
+				LOGE(" Failed to allocate AFBC staging buffer.\n");
+				drmModeFreeFB2(buffer);
+				drmModeFreeCrtc(crtc);
+				exit(EXIT_FAILURE);
+			}
+			info->stride = info->width * (BPP / CHAR_BIT);
+		}
 
 		// Init first DRM framebuffer
-		fbIndex = 0;
-		fbId[fbIndex] = drmState.fbId;
+		head->fbIndex = 0;
+		head->fbId[head->fbIndex] = state->fbId;
 	} else {
-		// Assuming scaling with a height limit of 1080 pixels
-		if (drmState.modeHeight > 1080) {
-			screenInfo.width = 1920;
-			screenInfo.height = 1080;
-		} else {
-			screenInfo.width = drmState.modeWidth;
-			screenInfo.height = drmState.modeHeight;
+		// The blank head has the mode size, the scale setting decides the served size (without one,
+		// a framebuffer with a height limit of 1080 pixels is assumed)
+		info->width = state->modeWidth;
+		info->height = state->modeHeight;
+		if (scaleDivisor == 1 && !scaleWidth && state->modeHeight > 1080) {
+			info->width = 1920;
+			info->height = 1080;
 		}
 
 		// Set default values, because there are no values to query
-		screenInfo.stride = screenInfo.width * (BPP / CHAR_BIT);
-		screenInfo.start = 0;
-		drmState.multiBuffer = 1;
-		drmState.pixelFormat = DRM_FORMAT_ARGB8888;
-		drmState.fbId = 0;
+		info->stride = info->width * (BPP / CHAR_BIT);
+		info->start = 0;
+		state->multiBuffer = 1;
+		state->pixelFormat = DRM_FORMAT_ARGB8888;
+		state->modifier = DRM_FORMAT_MOD_LINEAR;
+		state->fbId = 0;
 	}
 
-	drmState.colorGroup = drm_updateScreenFormat(drmState.pixelFormat);
-	if (!drmState.colorGroup) {
-		LOG(" Unsupported pixel format: 0x%x, exiting.\n", drmState.pixelFormat);
-		if (!suspend)
+	state->colorGroup = drm_updateScreenFormat(state->pixelFormat, info);
+	if (state->modifier != DRM_FORMAT_MOD_LINEAR && (info->pixelBytes != 4 || info->convert != CONVERT_NONE))
+		state->colorGroup = 0; // The AFBC decoder only handles 8-bit components in 32-bit pixels
+
+	if (!state->colorGroup) {
+		LOGE(" Unsupported pixel format: 0x%x, exiting.\n", state->pixelFormat);
+		if (!head->suspend)
 			drmModeFreeFB2(buffer);
 		drmModeFreeCrtc(crtc);
 		exit(EXIT_FAILURE);
 	}
 
 	// DRM debug information
-	LOG(" Real screen mode: %ux%u%c @ %.2f Hz.\n", drmState.modeWidth,
-		drmState.modeHeight, drmState.scanFactor == 2 ? 'i' : 'p', drmState.refreshRate);
-	LOG(" Used framebuffer width: %d px, height: %d px.\n", screenInfo.width, screenInfo.height);
-	LOG(" Stride: %d bytes, FourCC format: %.4s.\n", screenInfo.stride, (char *)&drmState.pixelFormat);
-
-	if (!suspend) {
-		LOG(" Initial DRM framebuffer detected (#%d): %u.\n", fbIndex + 1, fbId[fbIndex]);
-		LOG(" Ratio of framebuffer size to actual screen size: %d:1.\n", drmState.multiBuffer);
+	LOG(" Real screen mode: %ux%u%c @ %.2f Hz.\n", state->modeWidth,
+		state->modeHeight, state->scanFactor == 2 ? 'i' : 'p', state->refreshRate);
+	LOG(" Used framebuffer width: %d px, height: %d px.\n", info->width, info->height);
+	LOG(" Stride: %d bytes, FourCC format: %.4s.\n", info->stride, (char *)&state->pixelFormat);
+	if (state->modifier != DRM_FORMAT_MOD_LINEAR)
+		LOG(" AFBC compressed framebuffer, modifier: 0x%llx.\n", (unsigned long long)state->modifier);
+
+	if (!head->suspend) {
+		LOG(" Initial DRM framebuffer detected (#%d): %u.\n", head->fbIndex + 1, head->fbId[head->fbIndex]);
+		LOG(" Ratio of framebuffer size to actual screen size: %d:1.\n", state->multiBuffer);
 	}
 
-	if (!suspend) {
-		drmBufferMapList[fbIndex] = drm_mapFrameBuffer(buffer);
+	if (!head->suspend) {
+		head->bufferMapList[head->fbIndex] = drm_mapFrameBuffer(head, buffer);
 
-		if (drmBufferMapList[fbIndex] == MAP_FAILED) {
-			LOG(" Failed to map primary DRM framebuffer memory into userspace.\n");
+		if (head->bufferMapList[head->fbIndex] == MAP_FAILED) {
+			LOGE(" Failed to map primary DRM framebuffer memory into userspace.\n");
 			drmModeFreeFB2(buffer);
 			drmModeFreeCrtc(crtc);
 			exit(EXIT_FAILURE);
 		}
 
 		// Set first framebuffer as active
-		drmBufferMap = drmBufferMapList[fbIndex];
+		head->bufferMap = head->bufferMapList[head->fbIndex];
 		drmModeFreeFB2(buffer);
 	}
 
 	drmModeFreeCrtc(crtc);
 
+	// The pointer is published separately if it is drawn on a cursor plane
+	head->cursorPlane = drm_findCursorPlane(head);
+	if (head->cursorPlane) {
+		// The position is read every frame, the property IDs are looked up once
+		head->cursorPropX = drm_findObjectProperty(head->cursorPlane, DRM_MODE_OBJECT_PLANE, "CRTC_X");
+		head->cursorPropY = drm_findObjectProperty(head->cursorPlane, DRM_MODE_OBJECT_PLANE, "CRTC_Y");
+		head->cursorPropHotX = drm_findObjectProperty(head->cursorPlane, DRM_MODE_OBJECT_PLANE, "HOTSPOT_X");
+		head->cursorPropHotY = drm_findObjectProperty(head->cursorPlane, DRM_MODE_OBJECT_PLANE, "HOTSPOT_Y");
+
+		if (!head->cursorPropX || !head->cursorPropY) {
+			LOG(" Hardware cursor plane %u has no position properties, it is not published.\n", head->cursorPlane);
+			head->cursorPlane = 0;
+		} else {
+			LOG(" Hardware cursor plane detected: %u%s.\n", head->cursorPlane,
+				head->cursorPropHotX && head->cursorPropHotY ? " (with hotspot)" : "");
+		}
+	}
+}
+
+int drm_initFrameBuffer(void) {
+	int i, bytesPerPixel;
+
+	LOG("-- Initializing DRM framebuffer device - Count: %d --\n", initCount + 1);
+
+	drmFd = open(DRM_DEVICE, O_RDONLY);
+	if (drmFd == -1) {
+		LOGE(" Cannot open DRM framebuffer '%s'.\n", DRM_DEVICE);
+		if (!initCount) {
+			return -1; // Return to the selector
+		} else {
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (drmDropMaster(drmFd) != 0) {
+		if (errno != EPERM && errno != EINVAL) {
+			LOGE(" Failed to drop DRM master: %s\n", strerror(errno));
+			close(drmFd);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Cursor planes are only listed with universal planes enabled, their position properties only to atomic clients
+	drmSetClientCap(drmFd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+	drmSetClientCap(drmFd, DRM_CLIENT_CAP_ATOMIC, 1);
+#ifdef DRM_CLIENT_CAP_CURSOR_PLANE_HOTSPOT
+	// Virtual drivers hide the cursor plane from atomic clients without hotspot support
+	drmSetClientCap(drmFd, DRM_CLIENT_CAP_CURSOR_PLANE_HOTSPOT, 1);
+#endif
+
+	drm_findActiveCrtcs();
+
+	if (drmHeadCount > 1)
+		LOG(" Active outputs: %d, combined side by side into one desktop.\n", drmHeadCount);
+
+	// Heads are placed next to each other from left to right
+	screenInfo.width = 0;
+	screenInfo.height = 0;
+
+	for (i = 0; i < drmHeadCount; i++) {
+		if (drmHeadCount > 1)
+			LOGR(" Output #%d: connector %u, CRTC %u.\n", i + 1, drmHeads[i].connId, drmHeads[i].crtcId);
+
+		drm_initHead(&drmHeads[i]);
+
+		// libvncserver serves a single pixel format, all heads must map to it
+		if (drmHeads[i].state.colorGroup != drmHeads[0].state.colorGroup) {
+			LOGE(" Output #%d uses a different color group (%d) than output #1 (%d), exiting.\n",
+				i + 1, drmHeads[i].state.colorGroup, drmHeads[0].state.colorGroup);
+			exit(EXIT_FAILURE);
+		}
+
+		screenHeads[i].x = screenInfo.width;
+		screenHeads[i].info = drmHeads[i].info;
+		screenHeads[i].buffer = NULL;
+		screenHeads[i].blank = 0;
+
+		screenInfo.width += drmHeads[i].info.width;
+		screenInfo.height = MAX(screenInfo.height, drmHeads[i].info.height);
+	}
+
+	screenHeadCount = drmHeadCount;
+
+	if (drmHeadCount == 1) {
+		screenInfo = drmHeads[0].info;
+	} else {
+		bytesPerPixel = screenFormat.bitsPerPixel / CHAR_BIT;
+		screenInfo.stride = screenInfo.width * bytesPerPixel;
+		screenInfo.start = 0;
+		screenInfo.pixelBytes = bytesPerPixel;
+		screenInfo.convert = CONVERT_NONE;
+		LOG(" Combined desktop width: %d px, height: %d px.\n", screenInfo.width, screenInfo.height);
+	}
+
+	screenFormat.width = screenInfo.width;
+	screenFormat.height = screenInfo.height;
+	screenFormat.size = screenInfo.width * screenInfo.height * (screenFormat.bitsPerPixel / CHAR_BIT);
+
+	// The suspended state is only global if there is nothing to capture at all
+	suspend = 1;
+	for (i = 0; i < drmHeadCount; i++) {
+		if (!drmHeads[i].suspend)
+			suspend = 0;
+	}
+
 	// Increase init counter
 	initCount++;
 
 	return 0;
 }
 
-void *drm_mapFrameBuffer(drmModeFB2 *buffer) {
+void *drm_mapFrameBuffer(drm_head_t *head, drmModeFB2 *buffer) {
 	int primeFd;
 	void *bufferMap = MAP_FAILED;
 
 	if (drmPrimeHandleToFD(drmFd, buffer->handles[0], DRM_CLOEXEC | DRM_RDWR, &primeFd) != 0) {
-		LOG(" Failed to create PRIME fd from GEM handle: %u.\n", buffer->handles[0]);
+		LOGE(" Failed to create PRIME fd from GEM handle: %u.\n", buffer->handles[0]);
 		exit(EXIT_FAILURE);
 	}
 
-	bufferMap = mmap(NULL, buffer->pitches[0] * buffer->height, PROT_READ, MAP_SHARED, primeFd, 0);
+	// The size of a compressed buffer is only known by the exporter
+	if (buffer->modifier != DRM_FORMAT_MOD_LINEAR) {
+		off_t size = lseek(primeFd, 0, SEEK_END);
+		if (size <= 0) {
+			LOGE(" Failed to query PRIME buffer size: %u.\n", buffer->handles[0]);
+			close(primeFd);
+			return MAP_FAILED;
+		}
+		head->state.mapSize = size;
+	} else {
+		head->state.mapSize = buffer->pitches[0] * buffer->height;
+	}
+
+	bufferMap = mmap(NULL, head->state.mapSize, PROT_READ, MAP_SHARED, primeFd, 0);
 	close(primeFd);
 
 	return bufferMap;
 }
 
 void drm_closeFrameBuffer(void) {
-	int i;
+	drm_head_t *head;
+	int i, j;
+
+	for (j = 0; j < drmHeadCount; j++) {
+		head = &drmHeads[j];
+
+		for (i = 0; i <= head->fbIndex && i < DRM_FBMAX; i++) {
+			if (head->bufferMapList[i] != MAP_FAILED)
+				munmap(head->bufferMapList[i], head->state.mapSize);
+		}
+
+		afbc_close(&head->afbc);
 
-	for (i = 0; i <= fbIndex && i < DRM_FBMAX; i++) {
-		if (drmBufferMapList[i] != MAP_FAILED)
-			munmap(drmBufferMapList[i], screenInfo.stride * screenInfo.height * drmState.multiBuffer);
+		if (head->cursorMap)
+			munmap(head->cursorMap, head->cursorMapSize);
+		head->cursorMap = NULL;
+		head->cursorFbId = 0;
+
+		// Reset all framebuffer values
+		head->fbIndex = -1;
+		head->bufferMap = NULL;
 	}
 
 	close(drmFd);
 
-	// Reset all framebuffer values
 	drmFd = -1;
-	fbIndex = -1;
 }
 
-int drm_checkBufferStateChange(void) {
+int drm_checkHeadStateChange(drm_head_t *head) {
+	drm_state_t *state = &head->state;
+	screen_info_t tmpInfo;
 	drmModeCrtc *crtc;
 	drmModeFB2 *buffer;
 	double refreshRate;
@@ -279,116 +533,136 @@ int drm_checkBufferStateChange(void) {
 	int multiBuffer = 1;
 	int scanFactor, colorGroup, i;
 
-	// Reset DRM reinit delay
-	if (reinitDelay != DRM_DELAY)
-		reinitDelay = DRM_DELAY;
-
 	// Critical hard reinit triggers
-	crtc = drmModeGetCrtc(drmFd, crtcId);
+	crtc = drmModeGetCrtc(drmFd, head->crtcId);
 	if (!crtc) {
-		LOG(" Failed to query CRTC state: %u.\n", crtcId);
-		return 1;
+		LOGE(" Failed to query CRTC state: %u.\n", head->crtcId);
+		metricsReinit(REINIT_STATE_LOST);
+		return DRM_STATE_HARD;
 	}
 
 	// This is a standard framebuffer change indicator, if the buffer ID value is temporarily 0
 	if (crtc->buffer_id == 0) {
-		if (!suspend) {
+		if (!head->suspend) {
 			drmModeFreeCrtc(crtc);
 
 			if (reinitDelay > 0) {
-				LOG(" No active framebuffer found, retry after %d ms delay.\n", reinitDelay);
+				LOGW(" No active framebuffer found, retry after %d ms delay.\n", reinitDelay);
 				usleep(reinitDelay * 1000);
 				reinitDelay = 0; // This indicates that the delay was already in use, so it is no longer needed later
 			}
 
-			crtc = drmModeGetCrtc(drmFd, crtcId);
+			crtc = drmModeGetCrtc(drmFd, head->crtcId);
 			if (!crtc) {
-				LOG(" Failed to query CRTC state, DRM state lost.\n");
-				return 1;
+				LOGE(" Failed to query CRTC state, DRM state lost.\n");
+				metricsReinit(REINIT_STATE_LOST);
+				return DRM_STATE_HARD;
 			}
 
 			if (crtc->buffer_id == 0) {
-				if (drm_findVideoPlane()) {
+				if (drm_findVideoPlane(head)) {
 					LOG(" The video plane is active, suspended state is initiated.\n");
-					suspend = 1;
-					return 0;
+					head->suspend = 1;
+					drmModeFreeCrtc(crtc);
+					return DRM_STATE_KEEP;
 				} else {
 					LOG(" There is still no framebuffer or active video plane.\n");
+					metricsReinit(REINIT_NO_FRAMEBUFFER);
 					drmModeFreeCrtc(crtc);
-					return 1;
+					return DRM_STATE_HARD;
 				}
 			}
 
 			softReinit = 1; // If it was 0 due to a state change, then a soft reinit is definitely required
 		} else {
 			drmModeFreeCrtc(crtc);
-			return 0; // The suspended state is still active, no further verification is required in this cycle
+			return DRM_STATE_KEEP; // The suspended state is still active, no further verification is required in this cycle
 		}
 	} else {
-		if (suspend) {
-			suspend = 0; // The post-suspension check will determines the reinit level, whether it is hard or soft
-			if (fbIndex >= 0)
+		if (head->suspend) {
+			head->suspend = 0; // The post-suspension check will determines the reinit level, whether it is hard or soft
+			if (head->fbIndex >= 0)
 				LOG(" Active framebuffer found again, returning from suspended state.\n");
 		}
 	}
 
 	// Skipping the complete soft/hard verification chain when buffer suspension is active
-	if (!suspend) {
+	if (!head->suspend) {
 		buffer = drmModeGetFB2(drmFd, crtc->buffer_id);
 		if (!buffer) {
-			LOG(" Failed to query active framebuffer, DRM state lost.\n");
+			LOGE(" Failed to query active framebuffer, DRM state lost.\n");
+			metricsReinit(REINIT_STATE_LOST);
 			drmModeFreeCrtc(crtc);
-			return 1;
+			return DRM_STATE_HARD;
 		}
 
 		// Scan mode change
 		scanFactor = (crtc->mode.flags & DRM_MODE_FLAG_INTERLACE) ? 2 : 1;
-		if (scanFactor != drmState.scanFactor) {
+		if (scanFactor != state->scanFactor) {
 			LOG(" Scan mode changed from %s to %s.\n",
-				drmState.scanFactor == 2 ? "interlaced" : "progressive",
+				state->scanFactor == 2 ? "interlaced" : "progressive",
 				scanFactor == 2 ? "interlaced" : "progressive");
+			metricsReinit(REINIT_SCAN_MODE);
 				softReinit = 1;
 		}
 
 		// Refresh rate change
-		refreshRate = (double)(crtc->mode.clock * 1000 * scanFactor) / (crtc->mode.htotal * crtc->mode.vtotal * drm_getFracRate());
-		if (refreshRate != drmState.refreshRate) {
-			LOG(" Screen refresh rate changed from %.2f Hz to %.2f Hz.\n", drmState.refreshRate, refreshRate);
+		refreshRate = (double)(crtc->mode.clock * 1000 * scanFactor) / (crtc->mode.htotal * crtc->mode.vtotal * drm_getFracRate(head));
+		if (refreshRate != state->refreshRate) {
+			LOG(" Screen refresh rate changed from %.2f Hz to %.2f Hz.\n", state->refreshRate, refreshRate);
+			metricsReinit(REINIT_REFRESH_RATE);
 			softReinit = 1;
 		}
 
 		// Pixel format change
-		if (buffer->pixel_format != drmState.pixelFormat) {
-			LOG(" Screen pixel format changed from %.4s to %.4s.\n", (char *)&drmState.pixelFormat, (char *)&buffer->pixel_format);
+		if (buffer->pixel_format != state->pixelFormat) {
+			LOG(" Screen pixel format changed from %.4s to %.4s.\n", (char *)&state->pixelFormat, (char *)&buffer->pixel_format);
 
-			colorGroup = drm_updateScreenFormat(buffer->pixel_format);
-			if (colorGroup != drmState.colorGroup) {
-				LOG(" Screen color group changed from %d to %d.\n", drmState.colorGroup, colorGroup);
+			colorGroup = drm_updateScreenFormat(buffer->pixel_format, &tmpInfo);
+			if (colorGroup != state->colorGroup) {
+				LOG(" Screen color group changed from %d to %d.\n", state->colorGroup, colorGroup);
+				metricsReinit(REINIT_COLOR_GROUP);
 				drmModeFreeFB2(buffer);
 				drmModeFreeCrtc(crtc);
-				return 1; // Hard reinit is required because libvncserver does not update color profile during active server session
+				return DRM_STATE_HARD; // Hard reinit is required because libvncserver does not update color profile during active server session
 			} else {
+				metricsReinit(REINIT_PIXEL_FORMAT);
 				softReinit = 1;
 			}
 		}
 
+		// Framebuffer modifier change
+		if (buffer->modifier != state->modifier) {
+			LOG(" Framebuffer modifier changed from 0x%llx to 0x%llx.\n",
+				(unsigned long long)state->modifier, (unsigned long long)buffer->modifier);
+			metricsReinit(REINIT_MODIFIER);
+			if (buffer->modifier != DRM_FORMAT_MOD_LINEAR && !afbc_isSupported(buffer->modifier)) {
+				drmModeFreeFB2(buffer);
+				drmModeFreeCrtc(crtc);
+				return DRM_STATE_HARD; // Let the hard reinit report the unsupported modifier
+			}
+			softReinit = 1;
+		}
+
 		// Multibuffer ratio change
-		multiBuffer = buffer->height / (buffer->width * crtc->mode.vdisplay / crtc->mode.hdisplay);
-		if (multiBuffer != drmState.multiBuffer) {
-			LOG(" Ratio of buffer to screen size changed from %d:1 to %d:1.\n", drmState.multiBuffer, multiBuffer);
+		if (buffer->modifier == DRM_FORMAT_MOD_LINEAR)
+			multiBuffer = buffer->height / (buffer->width * crtc->mode.vdisplay / crtc->mode.hdisplay);
+		if (multiBuffer != state->multiBuffer) {
+			LOG(" Ratio of buffer to screen size changed from %d:1 to %d:1.\n", state->multiBuffer, multiBuffer);
+			metricsReinit(REINIT_MULTI_BUFFER);
 			softReinit = 1;
 		}
 
 		// Framebuffer ID change
-		if (buffer->fb_id != drmState.fbId && !softReinit) {
+		if (buffer->fb_id != state->fbId && !softReinit) {
 
-			for (i = 0; i <= fbIndex; i++) {
-				if (buffer->fb_id == fbId[i]) {
+			for (i = 0; i <= head->fbIndex; i++) {
+				if (buffer->fb_id == head->fbId[i]) {
 					fbActive = i;
 
 					// Set current framebuffer ID and memory map pointer as active
-					drmState.fbId = fbId[fbActive];
-					drmBufferMap = drmBufferMapList[fbActive];
+					state->fbId = head->fbId[fbActive];
+					head->bufferMap = head->bufferMapList[fbActive];
 
 					break;
 				}
@@ -396,119 +670,381 @@ int drm_checkBufferStateChange(void) {
 
 			// New framebuffer handling
 			if (fbActive < 0) {
-				fbIndex++;
-				if (fbIndex < DRM_FBMAX) {
-					fbActive = fbIndex;
-					fbId[fbActive] = buffer->fb_id;
+				head->fbIndex++;
+				if (head->fbIndex < DRM_FBMAX) {
+					fbActive = head->fbIndex;
+					head->fbId[fbActive] = buffer->fb_id;
 
-					if (fbIndex == 0) {
-						LOG(" Initial DRM framebuffer detected (#%d): %u.\n", fbIndex + 1, fbId[fbIndex]);
+					if (head->fbIndex == 0) {
+						LOG(" Initial DRM framebuffer detected (#%d): %u.\n", head->fbIndex + 1, head->fbId[head->fbIndex]);
 					} else {
-						LOG(" New DRM framebuffer detected (#%d): %u.\n", fbActive + 1, fbId[fbActive]);
+						LOG(" New DRM framebuffer detected (#%d): %u.\n", fbActive + 1, head->fbId[fbActive]);
 					}
 
 					// Set the value of multibuffer ratio if initialization is completed in suspended state
-					if (fbIndex == 0) {
-						drmState.multiBuffer = buffer->height / (buffer->width * crtc->mode.vdisplay / crtc->mode.hdisplay);
-						LOG(" Ratio of framebuffer size to actual screen size: %d:1.\n", drmState.multiBuffer);
+					if (head->fbIndex == 0) {
+						state->multiBuffer = buffer->height / (buffer->width * crtc->mode.vdisplay / crtc->mode.hdisplay);
+						LOG(" Ratio of framebuffer size to actual screen size: %d:1.\n", state->multiBuffer);
 					}
 
 					// Init the new framebuffer
-					drmBufferMapList[fbActive] = drm_mapFrameBuffer(buffer);
+					head->bufferMapList[fbActive] = drm_mapFrameBuffer(head, buffer);
 
-					if (drmBufferMapList[fbActive] == MAP_FAILED) {
-						LOG(" Failed to map DRM framebuffer (#%d) memory into userspace.\n", fbActive + 1);
+					if (head->bufferMapList[fbActive] == MAP_FAILED) {
+						LOGE(" Failed to map DRM framebuffer (#%d) memory into userspace.\n", fbActive + 1);
+						metricsReinit(REINIT_MAP_FAILED);
 						drmModeFreeFB2(buffer);
 						drmModeFreeCrtc(crtc);
-						return 1;
+						return DRM_STATE_HARD;
 					}
 				} else {
+					metricsReinit(REINIT_BUFFER_COUNT);
 					softReinit = 1;
 				}
 			}
 
 			// Set current framebuffer ID and memory map pointer as active
 			if (!softReinit) {
-				drmState.fbId = fbId[fbActive];
-				drmBufferMap = drmBufferMapList[fbActive];
+				state->fbId = head->fbId[fbActive];
+				head->bufferMap = head->bufferMapList[fbActive];
 			}
 		}
 
 		// Display resolution width or height -> Hard reinit is required because most VNC clients do not handle screen size changes
-		if (crtc->mode.hdisplay != drmState.modeWidth ||
-		    crtc->mode.vdisplay != drmState.modeHeight) {
+		if (crtc->mode.hdisplay != state->modeWidth ||
+		    crtc->mode.vdisplay != state->modeHeight) {
 			LOG(" Screen resolution changed from %ux%u to %ux%u.\n",
-				drmState.modeWidth, drmState.modeHeight,
+				state->modeWidth, state->modeHeight,
 				crtc->mode.hdisplay, crtc->mode.vdisplay);
+			metricsReinit(REINIT_RESOLUTION);
 			drmModeFreeFB2(buffer);
 			drmModeFreeCrtc(crtc);
-			return 1;
+			return DRM_STATE_HARD;
 		}
 
 		// Buffer width and height -> A hard reinit is required because the same policy applies as for resolution
-		if (buffer->width != screenInfo.width ||
-		    (buffer->height / multiBuffer) != screenInfo.height) {
+		if (buffer->width != head->info.width ||
+		    (buffer->height / multiBuffer) != head->info.height) {
 			LOG(" DRM framebuffer size changed from %ux%u to %ux%u.\n",
-				screenInfo.width, screenInfo.height,
+				head->info.width, head->info.height,
 				buffer->width, buffer->height);
+			metricsReinit(REINIT_BUFFER_SIZE);
 			drmModeFreeFB2(buffer);
 			drmModeFreeCrtc(crtc);
-			return 1;
+			return DRM_STATE_HARD;
 		}
 
 		drmModeFreeFB2(buffer);
 	}
 
+	drmModeFreeCrtc(crtc);
+
+	return softReinit ? DRM_STATE_SOFT : DRM_STATE_KEEP;
+}
+
+int drm_checkBufferStateChange(void) {
+	uint32_t width, height;
+	int softReinit = 0;
+	int i;
+
+	// Reset DRM reinit delay
+	if (reinitDelay != DRM_DELAY)
+		reinitDelay = DRM_DELAY;
+
+	for (i = 0; i < drmHeadCount; i++) {
+		switch (drm_checkHeadStateChange(&drmHeads[i])) {
+		case DRM_STATE_HARD:
+			return 1;
+		case DRM_STATE_SOFT:
+			softReinit = 1;
+			break;
+		default:
+			break;
+		}
+	}
+
 	// Perform a soft reinit if trigger is set
 	if (softReinit) {
 		LOG(" DRM framebuffer state changed, reinitialization started...\n");
-		drmModeFreeCrtc(crtc);
+		metrics.softReinits++;
+
+		width = screenInfo.width;
+		height = screenInfo.height;
 
 		closeFrameBuffer();
 		if (reinitDelay > 0)
 			usleep(reinitDelay * 1000);
 		initFrameBuffer();
 
+		// The served desktop can not change its size without restarting the server
+		if (screenInfo.width != width || screenInfo.height != height) {
+			LOG(" Desktop size changed from %ux%u to %ux%u.\n", width, height, screenInfo.width, screenInfo.height);
+			metricsReinit(REINIT_DESKTOP_SIZE);
+			return 1;
+		}
+
 		return 0;
 	}
 
-	drmModeFreeCrtc(crtc);
+	// The suspended state is only global if there is nothing to capture at all
+	suspend = 1;
+	for (i = 0; i < drmHeadCount; i++) {
+		if (!drmHeads[i].suspend)
+			suspend = 0;
+	}
+
 	return 0;
 }
 
-int drm_updateScreenFormat(uint32_t pixelFormat) {
-	screenFormat.width = screenInfo.width;
-	screenFormat.height = screenInfo.height;
-	screenFormat.size = screenInfo.width * screenInfo.height * (BPP / CHAR_BIT);
+int drm_updateScreenFormat(uint32_t pixelFormat, screen_info_t *info) {
+	int colorGroup;
+
+	// Default: 32-bit pixels used without conversion
+	screenFormat.bitsPerPixel = 32;
+	screenFormat.redMax = 8;
+	screenFormat.greenMax = 8;
+	screenFormat.blueMax = 8;
+	info->pixelBytes = 4;
+	info->convert = CONVERT_NONE;
 
 	switch (pixelFormat) {
 
+	case DRM_FORMAT_XRGB2101010:
+	case DRM_FORMAT_ARGB2101010:
+		info->convert = CONVERT_DEEP30;
+		/* fall through */
 	case DRM_FORMAT_XRGB8888:
 	case DRM_FORMAT_ARGB8888:
-		screenFormat.bitsPerPixel	= 32;
 		screenFormat.redShift		= 16;
 		screenFormat.greenShift		= 8;
 		screenFormat.blueShift		= 0;
-		screenFormat.redMax		= 8;
-		screenFormat.greenMax		= 8;
-		screenFormat.blueMax		= 8;
-		return 1;
-
+		colorGroup = 1;
+		break;
+
+	case DRM_FORMAT_XBGR2101010:
+	case DRM_FORMAT_ABGR2101010:
+		info->convert = CONVERT_DEEP30;
+		/* fall through */
+	case DRM_FORMAT_XBGR8888:
 	case DRM_FORMAT_ABGR8888:
-		screenFormat.bitsPerPixel	= 32;
 		screenFormat.redShift		= 0;
 		screenFormat.greenShift		= 8;
 		screenFormat.blueShift		= 16;
-		screenFormat.redMax		= 8;
-		screenFormat.greenMax		= 8;
-		screenFormat.blueMax		= 8;
-		return 2;
+		colorGroup = 2;
+		break;
+
+	case DRM_FORMAT_RGB888:
+		info->pixelBytes		= 3;
+		info->convert			= CONVERT_PACKED24;
+		screenFormat.redShift		= 16;
+		screenFormat.greenShift		= 8;
+		screenFormat.blueShift		= 0;
+		colorGroup = 1;
+		break;
+
+	case DRM_FORMAT_BGR888:
+		info->pixelBytes		= 3;
+		info->convert			= CONVERT_PACKED24;
+		screenFormat.redShift		= 0;
+		screenFormat.greenShift		= 8;
+		screenFormat.blueShift		= 16;
+		colorGroup = 2;
+		break;
+
+	// 16-bit formats are served natively to halve the buffer memory
+	case DRM_FORMAT_RGB565:
+		screenFormat.bitsPerPixel	= 16;
+		info->pixelBytes		= 2;
+		screenFormat.redShift		= 11;
+		screenFormat.greenShift		= 5;
+		screenFormat.blueShift		= 0;
+		screenFormat.redMax		= 5;
+		screenFormat.greenMax		= 6;
+		screenFormat.blueMax		= 5;
+		colorGroup = 3;
+		break;
+
+	case DRM_FORMAT_BGR565:
+		screenFormat.bitsPerPixel	= 16;
+		info->pixelBytes		= 2;
+		screenFormat.redShift		= 0;
+		screenFormat.greenShift		= 5;
+		screenFormat.blueShift		= 11;
+		screenFormat.redMax		= 5;
+		screenFormat.greenMax		= 6;
+		screenFormat.blueMax		= 5;
+		colorGroup = 4;
+		break;
 
 	default:
 		return 0; // Unsupported pixel format
 	}
+
+	return colorGroup;
+}
+
+void drm_readFrameBuffer(int index) {
+	drm_head_t *head = &drmHeads[index];
+	screen_head_t *screenHead = &screenHeads[index];
+
+	// Suspended heads have nothing to capture
+	if (head->suspend || !head->bufferMap) {
+		screenHead->buffer = NULL;
+		screenHead->damage.valid = 0;
+		return;
+	}
+
+	if (head->state.modifier != DRM_FORMAT_MOD_LINEAR) {
+		screenHead->buffer = (uint8_t *)afbc_decodeFrame(&head->afbc, (const uint8_t *)head->bufferMap,
+			head->state.mapSize, &screenHead->damage);
+		// This runs on a worker thread, an undecodable frame keeps the previous one instead of ending the session
+		if (!screenHead->buffer) {
+			LOGE(" Failed to decode AFBC framebuffer (modifier: 0x%llx), frame skipped.\n",
+				(unsigned long long)head->state.modifier);
+			screenHead->buffer = (uint8_t *)head->afbc.linear;
+			screenHead->damage.valid = 1;
+			screenHead->damage.yMin = 1;
+			screenHead->damage.yMax = 0;
+		}
+		return;
+	}
+
+	screenHead->damage.valid = 0;
+	screenHead->buffer = (uint8_t *)head->bufferMap;
+}
+
+int drm_readCursor(cursor_state_t *cursor) {
+	drm_head_t *head;
+	drmModePlane *plane;
+	drmModeFB2 *buffer;
+	drmModeObjectProperties *props;
+	uint64_t crtcX = 0, crtcY = 0;
+	int i, j, primeFd, found, cursorPlanes = 0;
+
+	cursor->visible = 0;
+	cursor->hotX = cursor->hotY = -1;
+
+	for (i = 0; i < drmHeadCount; i++) {
+		head = &drmHeads[i];
+
+		if (!head->cursorPlane)
+			continue;
+
+		cursorPlanes = 1;
+
+		plane = drmModeGetPlane(drmFd, head->cursorPlane);
+		if (!plane)
+			continue;
+
+		// Hidden cursor: the plane is detached or has no framebuffer
+		if (plane->crtc_id != head->crtcId || !plane->fb_id) {
+			drmModeFreePlane(plane);
+			continue;
+		}
+
+		// A new cursor framebuffer is mapped once and kept until it changes
+		if (plane->fb_id != head->cursorFbId) {
+			if (head->cursorMap)
+				munmap(head->cursorMap, head->cursorMapSize);
+			head->cursorMap = NULL;
+			head->cursorFbId = 0;
+
+			buffer = drmModeGetFB2(drmFd, plane->fb_id);
+			if (buffer && buffer->modifier == DRM_FORMAT_MOD_LINEAR &&
+			    (buffer->pixel_format == DRM_FORMAT_ARGB8888 || buffer->pixel_format == DRM_FORMAT_XRGB8888) &&
+			    drmPrimeHandleToFD(drmFd, buffer->handles[0], DRM_CLOEXEC | DRM_RDWR, &primeFd) == 0) {
+				head->cursorMapSize = buffer->pitches[0] * buffer->height;
+				head->cursorMap = mmap(NULL, head->cursorMapSize, PROT_READ, MAP_SHARED, primeFd, 0);
+				close(primeFd);
+
+				if (head->cursorMap == MAP_FAILED) {
+					head->cursorMap = NULL;
+				} else {
+					head->cursorFbId = plane->fb_id;
+					head->cursorWidth = buffer->width;
+					head->cursorHeight = buffer->height;
+					head->cursorStride = buffer->pitches[0];
+				}
+			}
+
+			if (buffer)
+				drmModeFreeFB2(buffer);
+		}
+
+		drmModeFreePlane(plane);
+
+		if (!head->cursorMap)
+			continue;
+
+		// One property read per frame, matched by the cached IDs
+		props = drmModeObjectGetProperties(drmFd, head->cursorPlane, DRM_MODE_OBJECT_PLANE);
+		if (!props)
+			continue;
+
+		found = 0;
+		for (j = 0; j < props->count_props; j++) {
+			if (props->props[j] == head->cursorPropX) {
+				crtcX = props->prop_values[j];
+				found |= 1;
+			} else if (props->props[j] == head->cursorPropY) {
+				crtcY = props->prop_values[j];
+				found |= 2;
+			} else if (head->cursorPropHotX && props->props[j] == head->cursorPropHotX) {
+				cursor->hotX = (int)(int64_t)props->prop_values[j];
+			} else if (head->cursorPropHotY && props->props[j] == head->cursorPropHotY) {
+				cursor->hotY = (int)(int64_t)props->prop_values[j];
+			}
+		}
+		drmModeFreeObjectProperties(props);
+
+		if (found != 3)
+			continue;
+
+		// Plane coordinates are signed and relative to the display mode, not to the served (scaled) head
+		cursor->x = screenHeads[i].x + (int)(int64_t)crtcX * (int)screenHeads[i].scale.width / (int)head->state.modeWidth;
+		cursor->y = (int)(int64_t)crtcY * (int)screenHeads[i].scale.height / (int)head->state.modeHeight;
+		cursor->width = head->cursorWidth;
+		cursor->height = head->cursorHeight;
+		cursor->stride = head->cursorStride;
+		cursor->image = head->cursorMap;
+		cursor->visible = 1;
+
+		return 1;
+	}
+
+	// Hidden cursor, if there is a cursor plane at all
+	return cursorPlanes;
+}
+
+int drm_getEventFd(void) {
+	return drmFd;
+}
+
+int drm_requestVblank(void) {
+	drmVBlank vblank;
+	int crtcIndex = drmHeads[0].crtcIndex;
+
+	// The next vertical blank of the first head triggers the capture (it is readable on the DRM fd)
+	memset(&vblank, 0, sizeof(vblank));
+	vblank.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT;
+	if (crtcIndex == 1)
+		vblank.request.type |= DRM_VBLANK_SECONDARY;
+	else if (crtcIndex > 1)
+		vblank.request.type |= (crtcIndex << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+	vblank.request.sequence = 1;
+
+	return drmHeads[0].suspend ? 0 : drmWaitVBlank(drmFd, &vblank) == 0;
+}
+
+static void drm_vblankHandler(int fd, unsigned int sequence, unsigned int sec, unsigned int usec, void *data) {
+	// Nothing to do, the event only wakes up the event loop
 }
 
-uint32_t *drm_readFrameBuffer(void) {
-	return (uint32_t *)drmBufferMap;
+void drm_handleEvent(void) {
+	drmEventContext context;
+
+	memset(&context, 0, sizeof(context));
+	context.version = 2;
+	context.vblank_handler = drm_vblankHandler;
+	drmHandleEvent(drmFd, &context);
 }
@@ -18,14 +18,22 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "afbc.h"
+
 #define DRM_DEVICE "/dev/dri/card0"
 #define DRM_DELAY 500
 #define DRM_FBMAX 4
 
+#define DRM_STATE_KEEP	0
+#define DRM_STATE_HARD	1
+#define DRM_STATE_SOFT	2
+
 typedef struct {
     uint32_t fbId;
     uint32_t stride;
     uint32_t pixelFormat;
+    uint64_t modifier;
+    size_t mapSize;
     uint32_t modeWidth;
     uint32_t modeHeight;
     double refreshRate;
@@ -34,16 +42,51 @@ typedef struct {
     int colorGroup;
 } drm_state_t;
 
-extern drm_state_t drmState;
+typedef struct {
+    uint32_t connId;
+    uint32_t crtcId;
+    int crtcIndex;
+    uint32_t cursorPlane;
+    uint32_t cursorFbId;
+    void *cursorMap;
+    size_t cursorMapSize;
+    uint32_t cursorWidth;
+    uint32_t cursorHeight;
+    uint32_t cursorStride;
+    uint32_t cursorPropX; // Property IDs of the cursor plane (0: not exposed)
+    uint32_t cursorPropY;
+    uint32_t cursorPropHotX;
+    uint32_t cursorPropHotY;
+    uint32_t fbId[DRM_FBMAX];
+    void *bufferMap;
+    void *bufferMapList[DRM_FBMAX];
+    int fbIndex;
+    int suspend;
+    drm_state_t state;
+    screen_info_t info;
+    afbc_state_t afbc;
+} drm_head_t;
+
+extern drm_head_t drmHeads[MAX_HEADS];
+extern int drmHeadCount;
 
-void drm_findActiveCrtc(void);
-double drm_getFracRate(void);
-uint32_t drm_findVideoPlane(void);
+void drm_findActiveCrtcs(void);
+double drm_getFracRate(drm_head_t *head);
+int drm_getObjectProperty(uint32_t objectId, uint32_t objectType, const char *name, uint64_t *value);
+uint32_t drm_findObjectProperty(uint32_t objectId, uint32_t objectType, const char *name);
+uint32_t drm_findVideoPlane(drm_head_t *head);
+uint32_t drm_findCursorPlane(drm_head_t *head);
+void drm_initHead(drm_head_t *head);
 int drm_initFrameBuffer(void);
-void *drm_mapFrameBuffer(drmModeFB2 *buffer);
+void *drm_mapFrameBuffer(drm_head_t *head, drmModeFB2 *buffer);
 void drm_closeFrameBuffer(void);
+int drm_checkHeadStateChange(drm_head_t *head);
 int drm_checkBufferStateChange(void);
-int drm_updateScreenFormat(uint32_t pixelFormat);
-uint32_t *drm_readFrameBuffer(void);
+int drm_updateScreenFormat(uint32_t pixelFormat, screen_info_t *info);
+void drm_readFrameBuffer(int index);
+int drm_readCursor(cursor_state_t *cursor);
+int drm_getEventFd(void);
+int drm_requestVblank(void);
+void drm_handleEvent(void);
 
 #endif
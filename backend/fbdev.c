@@ -8,19 +8,59 @@ size_t fbSize = 0;
 void *fbBufferMap = MAP_FAILED;
 struct fb_var_screeninfo varInfo;
 
+// Vsync and screen information polling
+int fbVsync = 1;
+uint64_t fbLastPoll = 0;
+
+// The vsync wait blocks, a helper thread waits and signals the event loop through an eventfd
+static pthread_t vsyncThread;
+static pthread_mutex_t vsyncLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vsyncCond = PTHREAD_COND_INITIALIZER;
+static int vsyncEventFd = -1;
+static int vsyncRequested = 0;
+static int vsyncStop = 0;
+
+static void *fbdev_waitVsync(void *arg) {
+	uint32_t vsyncArg = 0;
+	uint64_t value = 1;
+
+	pthread_mutex_lock(&vsyncLock);
+	while (1) {
+		while (!vsyncRequested && !vsyncStop)
+			pthread_cond_wait(&vsyncCond, &vsyncLock);
+		if (vsyncStop)
+			break;
+		vsyncRequested = 0;
+		pthread_mutex_unlock(&vsyncLock);
+
+		// Wait for the vertical blanking, so the pan offset read after it belongs to a completed frame
+		if (ioctl(fbFd, FBIO_WAITFORVSYNC, &vsyncArg) != 0 && errno != EINTR) {
+			LOG(" Vsync wait is not supported by the framebuffer device.\n");
+			__atomic_store_n(&fbVsync, 0, __ATOMIC_RELAXED);
+		}
+		if (write(vsyncEventFd, &value, sizeof(value)) < 0)
+			LOGE(" Failed to signal the vsync event: %s.\n", strerror(errno));
+
+		pthread_mutex_lock(&vsyncLock);
+	}
+	pthread_mutex_unlock(&vsyncLock);
+
+	return NULL;
+}
+
 int fbdev_initFrameBuffer(void) {
 	LOG("-- Initializing FBDEV framebuffer device --\n");
 
 	fbFd = open(FB_DEVICE, O_RDONLY);
 	if (fbFd == -1) {
-		LOG(" Cannot open FBDEV framebuffer device '%s'.\n", FB_DEVICE);
+		LOGE(" Cannot open FBDEV framebuffer device '%s'.\n", FB_DEVICE);
 		return -1; // Return to the selector
 	}
 
 	fbdev_updateFrameBufferInfo();
 
-	if (varInfo.bits_per_pixel != BPP) {
-		LOG(" Unsupported BPP value: '%u', only %d bit mode supported.\n", varInfo.bits_per_pixel, BPP);
+	if (varInfo.bits_per_pixel != 16 && varInfo.bits_per_pixel != 24 && varInfo.bits_per_pixel != BPP) {
+		LOGE(" Unsupported BPP value: '%u', only 16, 24 and %d bit modes supported.\n", varInfo.bits_per_pixel, BPP);
 		exit(EXIT_FAILURE);
 	}
 
@@ -36,17 +76,39 @@ int fbdev_initFrameBuffer(void) {
 	LOG(" Stride: %u bytes, framebuffer size: %zu bytes.\n",
 		screenInfo.stride, fbSize);
 
+	fbLastPoll = getMonotonicTime();
+
 	fbBufferMap = mmap(NULL, fbSize, PROT_READ, MAP_SHARED, fbFd, 0);
 
 	if (fbBufferMap == MAP_FAILED) {
-		LOG(" Failed to map FBDEV framebuffer memory into userspace.\n");
+		LOGE(" Failed to map FBDEV framebuffer memory into userspace.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	vsyncEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (vsyncEventFd < 0) {
+		LOGE(" Failed to create the vsync event: %s.\n", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
+	vsyncRequested = 0;
+	vsyncStop = 0;
+	pthread_create(&vsyncThread, NULL, fbdev_waitVsync, NULL);
 
 	return 0;
 }
 
 void fbdev_closeFrameBuffer(void) {
+	// A running wait ends with the next vertical blanking
+	if (vsyncEventFd != -1) {
+		pthread_mutex_lock(&vsyncLock);
+		vsyncStop = 1;
+		pthread_cond_signal(&vsyncCond);
+		pthread_mutex_unlock(&vsyncLock);
+		pthread_join(vsyncThread, NULL);
+		close(vsyncEventFd);
+		vsyncEventFd = -1;
+	}
+
 	if (fbBufferMap != MAP_FAILED)
 		munmap(fbBufferMap, fbSize);
 
@@ -61,7 +123,7 @@ void fbdev_closeFrameBuffer(void) {
 
 void fbdev_updateFrameBufferInfo(void) {
 	if (ioctl(fbFd, FBIOGET_VSCREENINFO, &varInfo) != 0) {
-		LOG(" Failed to query framebuffer screen information.\n");
+		LOGE(" Failed to query framebuffer screen information.\n");
 		exit(EXIT_FAILURE);
 	}
 
@@ -69,15 +131,32 @@ void fbdev_updateFrameBufferInfo(void) {
 	screenInfo.height = varInfo.yres;
 	screenInfo.stride = varInfo.xres_virtual * (varInfo.bits_per_pixel / CHAR_BIT);
 	screenInfo.start = varInfo.yoffset;
+	screenInfo.pixelBytes = varInfo.bits_per_pixel / CHAR_BIT;
+
+	// 24-bit pixels are padded, 10-bit components are truncated to the 32-bit server format
+	if (varInfo.bits_per_pixel == 24)
+		screenInfo.convert = CONVERT_PACKED24;
+	else if (varInfo.bits_per_pixel == BPP && varInfo.red.length == 10)
+		screenInfo.convert = CONVERT_DEEP30;
+	else
+		screenInfo.convert = CONVERT_NONE;
 }
 
 int fbdev_checkBufferStateChange(void) {
+	uint64_t timeNow = getMonotonicTime();
+
+	// The screen information is polled at a limited rate, pan offsets are tracked by the reader
+	if (timeNow - fbLastPoll < FB_POLL_INTERVAL * 1000ULL)
+		return 0;
+	fbLastPoll = timeNow;
+
 	// In the case of FBDEV, the only hard trigger event is the resolution change
 	fbdev_updateFrameBufferInfo();
 	if ((varInfo.xres != screenFormat.width) || (varInfo.yres != screenFormat.height)) {
 		LOG(" Screen resolution changed from %ux%u to %ux%u.\n",
 			screenFormat.width, screenFormat.height,
 			varInfo.xres, varInfo.yres);
+		metricsReinit(REINIT_RESOLUTION);
 		return 1;
 	} else {
 		return 0;
@@ -87,7 +166,7 @@ int fbdev_checkBufferStateChange(void) {
 void fbdev_updateScreenFormat(void) {
 	screenFormat.width		= varInfo.xres;
 	screenFormat.height		= varInfo.yres;
-	screenFormat.bitsPerPixel	= varInfo.bits_per_pixel;
+	screenFormat.bitsPerPixel	= varInfo.bits_per_pixel == 16 ? 16 : BPP;
 	screenFormat.size		= screenFormat.width * screenFormat.height * screenFormat.bitsPerPixel / CHAR_BIT;
 	screenFormat.redShift		= varInfo.red.offset;
 	screenFormat.redMax		= varInfo.red.length;
@@ -95,8 +174,60 @@ void fbdev_updateScreenFormat(void) {
 	screenFormat.greenMax		= varInfo.green.length;
 	screenFormat.blueShift		= varInfo.blue.offset;
 	screenFormat.blueMax		= varInfo.blue.length;
+
+	// Truncated 10-bit components keep their position (offsets 0/10/20 -> 0/8/16)
+	if (screenInfo.convert == CONVERT_DEEP30) {
+		screenFormat.redShift	= varInfo.red.offset * 8 / 10;
+		screenFormat.redMax	= 8;
+		screenFormat.greenShift	= varInfo.green.offset * 8 / 10;
+		screenFormat.greenMax	= 8;
+		screenFormat.blueShift	= varInfo.blue.offset * 8 / 10;
+		screenFormat.blueMax	= 8;
+	}
 }
 
 uint32_t *fbdev_readFrameBuffer(void) {
+	struct fb_var_screeninfo panInfo;
+
+	screenHeads[0].damage.valid = 0;
+
+	// The capture follows the vsync event (or the frame deadline), the pan offset is read right away
+	if (ioctl(fbFd, FBIOGET_VSCREENINFO, &panInfo) != 0)
+		return (uint32_t *)fbBufferMap;
+
+	// Resolution changes are handled by the state check, force it on the next cycle
+	if (panInfo.xres != varInfo.xres || panInfo.yres != varInfo.yres) {
+		fbLastPoll = 0;
+		return (uint32_t *)fbBufferMap;
+	}
+
+	// The diff always runs: an even number of pan flips since the last read leaves the offset unchanged
+	screenInfo.start = panInfo.yoffset;
+
 	return (uint32_t *)fbBufferMap;
 }
+
+int fbdev_getEventFd(void) {
+	return vsyncEventFd;
+}
+
+// The next vertical blanking triggers the capture, without vsync support the deadline captures
+int fbdev_requestVsync(void) {
+	if (vsyncEventFd == -1 || !__atomic_load_n(&fbVsync, __ATOMIC_RELAXED))
+		return 0;
+
+	pthread_mutex_lock(&vsyncLock);
+	vsyncRequested = 1;
+	pthread_cond_signal(&vsyncCond);
+	pthread_mutex_unlock(&vsyncLock);
+
+	return 1;
+}
+
+void fbdev_handleEvent(void) {
+	uint64_t value;
+
+	// Only wakes up the event loop, the counter is reset
+	if (read(vsyncEventFd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+		LOGE(" Failed to read the vsync event: %s.\n", strerror(errno));
+}
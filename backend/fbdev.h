@@ -7,8 +7,12 @@
 #include "common.h"
 #include "framebuffer.h"
 
+#include <pthread.h>
+#include <sys/eventfd.h>
+
 #define FB_DEVICE "/dev/fb0"
 #define FB_DELAY 0
+#define FB_POLL_INTERVAL 250	// Screen information poll interval in ms
 
 int fbdev_initFrameBuffer(void);
 void fbdev_closeFrameBuffer(void);
@@ -16,5 +20,8 @@ void fbdev_updateFrameBufferInfo(void);
 int fbdev_checkBufferStateChange(void);
 void fbdev_updateScreenFormat(void);
 uint32_t *fbdev_readFrameBuffer(void);
+int fbdev_getEventFd(void);
+int fbdev_requestVsync(void);
+void fbdev_handleEvent(void);
 
 #endif
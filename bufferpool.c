@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Frame buffer pool (aligned, pre-faulted buffers kept across reinitializations)
+
+#include "bufferpool.h"
+
+// Options
+int useHugePages = 0;
+int lockBuffers = 0;
+
+pool_stats_t poolStats;
+
+static pool_buffer_t poolBuffers[BUFFER_POOL_MAX];
+
+static void unmapBuffer(pool_buffer_t *buffer) {
+	if (buffer->locked)
+		munlock(buffer->data, buffer->size);
+	munmap(buffer->data, buffer->size);
+
+	poolStats.mapped -= buffer->size;
+	memset(buffer, 0, sizeof(*buffer));
+}
+
+// Size of the default huge pages, which MAP_HUGETLB maps
+static size_t getHugePageSize(void) {
+	static size_t hugePageSize = 0;
+	unsigned long kiB;
+	char line[128];
+	FILE *meminfo;
+
+	if (hugePageSize)
+		return hugePageSize;
+
+	hugePageSize = HUGE_PAGE_SIZE;
+	meminfo = fopen("/proc/meminfo", "r");
+	if (meminfo) {
+		while (fgets(line, sizeof(line), meminfo)) {
+			if (sscanf(line, "Hugepagesize: %lu kB", &kiB) == 1 && kiB) {
+				hugePageSize = kiB * 1024;
+				break;
+			}
+		}
+		fclose(meminfo);
+	}
+
+	return hugePageSize;
+}
+
+static int mapBuffer(pool_buffer_t *buffer, size_t size) {
+	long pageSize = sysconf(_SC_PAGESIZE);
+	void *data = MAP_FAILED;
+	size_t hugeSize;
+
+	if (useHugePages) {
+		// munmap() of a huge page mapping fails unless the length is a multiple of the huge page size
+		hugeSize = (size + getHugePageSize() - 1) & ~(getHugePageSize() - 1);
+		data = mmap(NULL, hugeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+		if (data == MAP_FAILED) {
+			LOGW(" Huge pages are not available for a %zu byte buffer, using normal pages.\n", hugeSize);
+		} else {
+			buffer->hugePages = 1;
+			size = hugeSize;
+		}
+	}
+
+	// Whole pages keep the start aligned far beyond the cache line
+	if (data == MAP_FAILED)
+		size = (size + pageSize - 1) & ~(size_t)(pageSize - 1);
+
+	// Populating the mapping avoids page faults on the first frame
+	if (data == MAP_FAILED)
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (data == MAP_FAILED)
+		return -1;
+
+	if (lockBuffers) {
+		if (mlock(data, size) == 0)
+			buffer->locked = 1;
+		else
+			LOGW(" Could not lock a %zu byte buffer in memory: %s.\n", size, strerror(errno));
+	}
+
+	buffer->data = data;
+	buffer->size = size;
+
+	poolStats.mapped += size;
+	poolStats.peak = MAX(poolStats.peak, poolStats.mapped);
+
+	return 0;
+}
+
+void *getPoolBuffer(size_t size) {
+	pool_buffer_t *buffer = NULL;
+	int i;
+
+	// The smallest free buffer which fits is reused
+	for (i = 0; i < BUFFER_POOL_MAX; i++) {
+		if (!poolBuffers[i].data || poolBuffers[i].inUse)
+			continue;
+		if (poolBuffers[i].size >= size && (!buffer || poolBuffers[i].size < buffer->size))
+			buffer = &poolBuffers[i];
+	}
+
+	if (buffer) {
+		poolStats.reused++;
+	} else {
+		// Free buffers which are too small are released before a new one is mapped
+		for (i = 0; i < BUFFER_POOL_MAX; i++) {
+			if (poolBuffers[i].data && !poolBuffers[i].inUse)
+				unmapBuffer(&poolBuffers[i]);
+		}
+
+		for (i = 0; i < BUFFER_POOL_MAX && poolBuffers[i].data; i++);
+		if (i == BUFFER_POOL_MAX) {
+			LOGE(" The buffer pool is exhausted.\n");
+			return NULL;
+		}
+
+		buffer = &poolBuffers[i];
+		if (mapBuffer(buffer, size) < 0) {
+			LOGE(" Could not map a %zu byte buffer: %s.\n", size, strerror(errno));
+			return NULL;
+		}
+
+		LOG(" Screen buffer mapped: %zu bytes%s%s, pool: %llu bytes (peak: %llu bytes).\n", buffer->size,
+			buffer->hugePages ? ", huge pages" : "", buffer->locked ? ", locked" : "",
+			(unsigned long long)poolStats.mapped, (unsigned long long)poolStats.peak);
+	}
+
+	// Buffers are handed out cleared, like calloc()
+	memset(buffer->data, 0, size);
+	buffer->inUse = 1;
+	poolStats.inUse += buffer->size;
+
+	return buffer->data;
+}
+
+void putPoolBuffer(void *data) {
+	int i;
+
+	if (!data)
+		return;
+
+	// The mapping is kept for the next request of the same size
+	for (i = 0; i < BUFFER_POOL_MAX; i++) {
+		if (poolBuffers[i].data == data && poolBuffers[i].inUse) {
+			poolBuffers[i].inUse = 0;
+			poolStats.inUse -= poolBuffers[i].size;
+			return;
+		}
+	}
+
+	LOGE(" Unknown buffer returned to the pool.\n");
+}
+
+void closeBufferPool(void) {
+	int i;
+
+	for (i = 0; i < BUFFER_POOL_MAX; i++) {
+		if (poolBuffers[i].data)
+			unmapBuffer(&poolBuffers[i]);
+	}
+	poolStats.inUse = 0;
+}
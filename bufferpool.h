@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for the frame buffer pool
+
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include "common.h"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024) // Huge page size if the kernel does not report one
+#define BUFFER_POOL_MAX 12
+
+typedef struct {
+	uint8_t *data;
+	size_t size; // Mapped size
+	int inUse;
+	int hugePages;
+	int locked;
+} pool_buffer_t;
+
+typedef struct {
+	uint64_t mapped; // Bytes mapped by the pool
+	uint64_t inUse; // Bytes handed out
+	uint64_t peak; // Highest mapped value
+	uint64_t reused; // Requests served by a kept buffer
+} pool_stats_t;
+
+extern int useHugePages;
+extern int lockBuffers;
+extern pool_stats_t poolStats;
+
+void *getPoolBuffer(size_t size);
+void putPoolBuffer(void *data);
+void closeBufferPool(void);
+
+#endif
@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for per-client state
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include "common.h"
+#include "continuous.h"
+#include "latency.h"
+#include "translate.h"
+
+#ifdef HAVE_OPENH264
+#include "h264.h"
+#endif
+
+// Stored in the clientData of every connected client
+typedef struct {
+	int session;
+	int recorder; // Internal recording client (not counted as a connected client)
+	latency_state_t latency;
+	uint64_t sendStart; // Trace start of the framebuffer update being sent
+	uint64_t sentBytes; // Byte counters (libvncserver only keeps them as int)
+	uint64_t receivedBytes;
+	uint32_t lastSentStat; // libvncserver statistics at the last counter update
+	uint32_t lastReceivedStat;
+	shared_format_t *sharedFormat; // Translated buffer used instead of per-client translation
+	rfbTranslateFnType translateFn; // libvncserver translator replaced while sharing
+	sraRegionPtr videoPending; // Flushed video tiles not sent yet (NULL: none so far)
+	sraRegionPtr videoRepair; // Other changes sent lossy with the video tiles
+	int videoRefresh; // The next update is lossless (stopped video tiles, repaired areas)
+	int qualitySaved; // The JPEG quality levels are changed for the running update
+	int savedQuality; // JPEG quality levels of the client during a video update
+	int savedTurboQuality;
+	continuous_state_t continuous;
+#ifdef HAVE_OPENH264
+	h264_state_t h264;
+#endif
+} client_info_t;
+
+#endif
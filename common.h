@@ -31,13 +31,28 @@
 #define SERVER_STOP	1
 #define SERVER_REINIT	2
 
-#define LOG(fmt, ...) do { fprintf(stderr, fmt, ##__VA_ARGS__); } while (0)
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+#define SQUARE(x) ((x)*(x))
+
+#include "log.h"
+
+// Monotonic timestamp in microseconds
+static inline uint64_t getMonotonicTime(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000ULL;
+}
 
 extern int idle;
 extern int suspend;
+extern int deepIdle;
+extern char serverPassword[256];
 
 #ifdef HAVE_LIBDRM
 extern int forceFbdevBackend;
+extern int multiHead;
 #endif
 
 #endif
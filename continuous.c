@@ -0,0 +1,240 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// ContinuousUpdates and Fence protocol extensions (updates pushed within a fence paced window)
+
+#include "continuous.h"
+#include "client.h"
+#include "updatescreen.h"
+
+#include <arpa/inet.h>
+
+static int continuousEncodings[] = { CU_ENCODING, FENCE_ENCODING, 0 };
+static int extensionRegistered = 0;
+
+// Payload of the server fences, the client returns it unchanged
+typedef struct {
+	uint64_t time; // Monotonic time of the request
+	uint32_t sent; // Sent bytes before the request
+} fence_payload_t;
+
+static void writeMessage(rfbClientPtr cl, const uint8_t *buffer, int length) {
+	if (rfbWriteExact(cl, (const char *)buffer, length) < 0) {
+		rfbLogPerror("writeMessage: write");
+		rfbCloseClient(cl);
+		return;
+	}
+	rfbStatRecordMessageSent(cl, buffer[0], length, length);
+}
+
+static int readMessage(rfbClientPtr cl, uint8_t *buffer, int length) {
+	int n = rfbReadExact(cl, (char *)buffer, length);
+
+	if (n <= 0) {
+		if (n != 0)
+			rfbLogPerror("readMessage: read");
+		rfbCloseClient(cl);
+		return -1;
+	}
+	return 0;
+}
+
+static void sendEndOfContinuousUpdates(rfbClientPtr cl) {
+	uint8_t type = CU_MESSAGE;
+
+	writeMessage(cl, &type, 1);
+}
+
+static void sendFence(rfbClientPtr cl, uint32_t flags, int length, const void *payload) {
+	uint8_t buffer[9 + FENCE_MAX_PAYLOAD];
+
+	memset(buffer, 0, 9);
+	buffer[0] = FENCE_MESSAGE;
+	flags = htonl(flags);
+	memcpy(buffer + 4, &flags, 4);
+	buffer[8] = length;
+	memcpy(buffer + 9, payload, length);
+	writeMessage(cl, buffer, 9 + length);
+}
+
+// Measures the round trip of everything sent so far
+static void sendFenceRequest(rfbClientPtr cl) {
+	fence_payload_t payload;
+
+	payload.time = getMonotonicTime();
+	payload.sent = (uint32_t)rfbStatGetSentBytes(cl);
+	sendFence(cl, FENCE_REQUEST | FENCE_BLOCK_BEFORE, sizeof(payload), &payload);
+}
+
+// The pushed area stays requested while the window has room
+static void requestArea(rfbClientPtr cl) {
+	continuous_state_t *state = &((client_info_t *)cl->clientData)->continuous;
+	sraRegionPtr area;
+
+	if (!state->width || !state->height)
+		return;
+
+	if (state->fence && state->sent - state->acked >= state->window)
+		return;
+
+	area = sraRgnCreateRect(state->x, state->y, state->x + state->width, state->y + state->height);
+	sraRgnOr(cl->requestedRegion, area);
+	sraRgnDestroy(area);
+}
+
+static rfbBool enableContinuous(rfbClientPtr cl, void **data, int encoding) {
+	client_info_t *info = cl->clientData;
+
+	if (!info)
+		return FALSE;
+
+	switch (encoding) {
+	case CU_ENCODING:
+		// The first EndOfContinuousUpdates announces the support
+		if (!info->continuous.supported) {
+			info->continuous.supported = 1;
+			sendEndOfContinuousUpdates(cl);
+		}
+		return TRUE;
+	case FENCE_ENCODING:
+		if (!info->continuous.fence) {
+			info->continuous.fence = 1;
+			info->continuous.window = CU_WINDOW_INITIAL;
+			sendFenceRequest(cl);
+		}
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void handleEnable(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+	continuous_state_t *state = &info->continuous;
+	uint8_t buffer[9];
+	uint16_t area[4];
+
+	if (readMessage(cl, buffer, sizeof(buffer)) < 0)
+		return;
+
+	if (!buffer[0]) {
+		if (state->enabled)
+			LOG(" [%d] Continuous updates disabled.\n", info->session);
+		state->enabled = 0;
+
+		// The client waits for the end of the pushed updates
+		sendEndOfContinuousUpdates(cl);
+		return;
+	}
+
+	memcpy(area, buffer + 1, sizeof(area));
+	state->x = MIN(ntohs(area[0]), vncScreen->width);
+	state->y = MIN(ntohs(area[1]), vncScreen->height);
+	state->width = MIN(ntohs(area[2]), vncScreen->width - state->x);
+	state->height = MIN(ntohs(area[3]), vncScreen->height - state->y);
+
+	if (!state->enabled)
+		LOG(" [%d] Continuous updates enabled for %dx%d+%d+%d.\n", info->session,
+			state->width, state->height, state->x, state->y);
+	state->enabled = 1;
+	state->sent = state->acked = (uint32_t)rfbStatGetSentBytes(cl);
+	requestArea(cl);
+}
+
+// Delay based window: queueing in the network shrinks it, a clear path lets it grow
+static void fenceAcked(rfbClientPtr cl, const fence_payload_t *payload) {
+	continuous_state_t *state = &((client_info_t *)cl->clientData)->continuous;
+	uint64_t rtt = getMonotonicTime() - payload->time;
+
+	latencyRoundTrip(cl, rtt);
+
+	if (!state->minRtt || rtt < state->minRtt)
+		state->minRtt = rtt;
+
+	if (rtt > 2 * state->minRtt + CU_RTT_SLACK)
+		state->window = MAX(CU_WINDOW_MIN, state->window - state->window / 4);
+	else if (rtt <= state->minRtt + state->minRtt / 4 + CU_RTT_SLACK)
+		state->window = MIN(CU_WINDOW_MAX, state->window + state->window / 8);
+
+	state->acked = payload->sent;
+	if (state->enabled)
+		requestArea(cl);
+}
+
+static void handleFence(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+	uint8_t buffer[8 + FENCE_MAX_PAYLOAD];
+	fence_payload_t payload;
+	uint32_t flags;
+	int length;
+
+	if (readMessage(cl, buffer, 8) < 0)
+		return;
+
+	memcpy(&flags, buffer + 3, 4);
+	flags = ntohl(flags);
+	length = buffer[7];
+	if (length > FENCE_MAX_PAYLOAD) {
+		LOGE(" [%d] Fence payload too long: %d bytes.\n", info->session, length);
+		rfbCloseClient(cl);
+		return;
+	}
+	if (length && readMessage(cl, buffer + 8, length) < 0)
+		return;
+
+	if (flags & FENCE_REQUEST) {
+		// Messages are handled in order, so the blocking flags hold already (SyncNext is not supported)
+		sendFence(cl, flags & (FENCE_BLOCK_BEFORE | FENCE_BLOCK_AFTER), length, buffer + 8);
+		return;
+	}
+
+	if (length == sizeof(payload)) {
+		memcpy(&payload, buffer + 8, sizeof(payload));
+		fenceAcked(cl, &payload);
+	}
+}
+
+static rfbBool handleContinuousMessage(rfbClientPtr cl, void *data, const rfbClientToServerMsg *message) {
+	if (!cl->clientData)
+		return FALSE;
+
+	switch (message->type) {
+	case CU_MESSAGE:
+		handleEnable(cl);
+		return TRUE;
+	case FENCE_MESSAGE:
+		handleFence(cl);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static rfbProtocolExtension continuousExtension = {
+	.pseudoEncodings = continuousEncodings,
+	.enablePseudoEncoding = enableContinuous,
+	.handleMessage = handleContinuousMessage,
+};
+
+void initContinuousUpdates(void) {
+	if (!extensionRegistered) {
+		rfbRegisterProtocolExtension(&continuousExtension);
+		extensionRegistered = 1;
+	}
+}
+
+// Every pushed update is followed by a fence, the area is requested again while the window has room
+void continuousUpdateSent(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+	continuous_state_t *state;
+	uint32_t sent;
+
+	if (!info || !info->continuous.enabled)
+		return;
+
+	state = &info->continuous;
+	sent = (uint32_t)rfbStatGetSentBytes(cl);
+	if (sent != state->sent && state->fence)
+		sendFenceRequest(cl);
+	state->sent = (uint32_t)rfbStatGetSentBytes(cl);
+
+	requestArea(cl);
+}
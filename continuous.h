@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for the ContinuousUpdates and Fence protocol extensions
+
+#ifndef CONTINUOUS_H
+#define CONTINUOUS_H
+
+#include "common.h"
+
+#define CU_ENCODING -313 // ContinuousUpdates pseudo-encoding
+#define FENCE_ENCODING -312 // Fence pseudo-encoding
+#define CU_MESSAGE 150 // EnableContinuousUpdates (client) and EndOfContinuousUpdates (server)
+#define FENCE_MESSAGE 248
+
+#define FENCE_BLOCK_BEFORE 0x00000001
+#define FENCE_BLOCK_AFTER 0x00000002
+#define FENCE_SYNC_NEXT 0x00000004
+#define FENCE_REQUEST 0x80000000
+#define FENCE_MAX_PAYLOAD 64
+
+#define CU_WINDOW_MIN (32 * 1024) // Bytes in flight which are always allowed
+#define CU_WINDOW_INITIAL (256 * 1024)
+#define CU_WINDOW_MAX (32 * 1024 * 1024)
+#define CU_RTT_SLACK 5000 // Round trip above the minimum (in us) which is not counted as queueing
+
+// Per-client state of the pushed updates, part of client_info_t
+typedef struct {
+	int supported; // EndOfContinuousUpdates was sent
+	int fence; // The client supports fences
+	int enabled; // Updates are pushed without requests
+	int x, y, width, height; // Area of the pushed updates
+	uint32_t window; // Allowed unacknowledged bytes
+	uint32_t acked; // Sent bytes acknowledged by the last fence
+	uint32_t sent; // Sent bytes after the last update
+	uint64_t minRtt; // Smallest fence round trip in us
+} continuous_state_t;
+
+void initContinuousUpdates(void);
+void continuousUpdateSent(rfbClientPtr cl);
+
+#endif
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Capture-side pixel format conversion
+
+#include "convert.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CONVERT_NEON
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#define CONVERT_SSE
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CONVERT_SSE2
+#endif
+
+static void convertPacked24(uint32_t *dst, const uint8_t *src, uint32_t count) {
+	uint32_t i = 0;
+
+#if defined(CONVERT_NEON)
+	// 16 pixels per iteration: deinterleave 3 channels, interleave again with a zero channel
+	uint8x16x4_t out;
+	uint8x16x3_t in;
+
+	out.val[3] = vdupq_n_u8(0);
+	for (; i + 16 <= count; i += 16) {
+		in = vld3q_u8(src + i * 3);
+		out.val[0] = in.val[0];
+		out.val[1] = in.val[1];
+		out.val[2] = in.val[2];
+		vst4q_u8((uint8_t *)(dst + i), out);
+	}
+#elif defined(CONVERT_SSE)
+	// 4 pixels per iteration, the last load reads 4 bytes ahead so it stops one group early
+	const __m128i mask = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+
+	for (; i + 6 <= count; i += 4) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(src + i * 3));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(in, mask));
+	}
+#endif
+
+	for (; i < count; i++)
+		dst[i] = convertPixel(CONVERT_PACKED24, src + i * 3);
+}
+
+static void convertDeep30(uint32_t *dst, const uint8_t *src, uint32_t count) {
+	uint32_t i = 0;
+
+#if defined(CONVERT_NEON)
+	const uint32x4_t redMask = vdupq_n_u32(0x00ff0000);
+	const uint32x4_t greenMask = vdupq_n_u32(0x0000ff00);
+	const uint32x4_t blueMask = vdupq_n_u32(0x000000ff);
+
+	for (; i + 4 <= count; i += 4) {
+		uint32x4_t in = vreinterpretq_u32_u8(vld1q_u8(src + i * 4));
+		uint32x4_t out = vandq_u32(vshrq_n_u32(in, 6), redMask);
+		out = vorrq_u32(out, vandq_u32(vshrq_n_u32(in, 4), greenMask));
+		out = vorrq_u32(out, vandq_u32(vshrq_n_u32(in, 2), blueMask));
+		vst1q_u32(dst + i, out);
+	}
+#elif defined(CONVERT_SSE) || defined(CONVERT_SSE2)
+	const __m128i redMask = _mm_set1_epi32(0x00ff0000);
+	const __m128i greenMask = _mm_set1_epi32(0x0000ff00);
+	const __m128i blueMask = _mm_set1_epi32(0x000000ff);
+
+	for (; i + 4 <= count; i += 4) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(src + i * 4));
+		__m128i out = _mm_and_si128(_mm_srli_epi32(in, 6), redMask);
+		out = _mm_or_si128(out, _mm_and_si128(_mm_srli_epi32(in, 4), greenMask));
+		out = _mm_or_si128(out, _mm_and_si128(_mm_srli_epi32(in, 2), blueMask));
+		_mm_storeu_si128((__m128i *)(dst + i), out);
+	}
+#endif
+
+	for (; i < count; i++)
+		dst[i] = convertPixel(CONVERT_DEEP30, src + i * 4);
+}
+
+void convertLine(int mode, uint32_t *dst, const uint8_t *src, uint32_t count) {
+	switch (mode) {
+	case CONVERT_PACKED24:
+		convertPacked24(dst, src, count);
+		break;
+
+	case CONVERT_DEEP30:
+		convertDeep30(dst, src, count);
+		break;
+
+	case CONVERT_NONE:
+	default:
+		memcpy(dst, src, count * sizeof(uint32_t));
+		break;
+	}
+}
@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for capture-side pixel format conversion
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include "common.h"
+
+#define CONVERT_NONE		0	// Captured pixels are used as-is
+#define CONVERT_PACKED24	1	// 24 bpp packed pixels, a zero byte is appended
+#define CONVERT_DEEP30		2	// 10 bits per component, truncated to 8 bits
+
+// Converts a single captured pixel (used by the sampled diff)
+static inline uint32_t convertPixel(int mode, const uint8_t *src) {
+	uint32_t pixel;
+
+	switch (mode) {
+	case CONVERT_PACKED24:
+		return (uint32_t)src[0] | ((uint32_t)src[1] << 8) | ((uint32_t)src[2] << 16);
+
+	case CONVERT_DEEP30:
+		memcpy(&pixel, src, sizeof(pixel));
+		return ((pixel >> 6) & 0x00ff0000) | ((pixel >> 4) & 0x0000ff00) | ((pixel >> 2) & 0x000000ff);
+
+	case CONVERT_NONE:
+	default:
+		memcpy(&pixel, src, sizeof(pixel));
+		return pixel;
+	}
+}
+
+void convertLine(int mode, uint32_t *dst, const uint8_t *src, uint32_t count);
+
+#endif
@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Cursor shape and position publishing
+
+#include "cursor.h"
+
+static cursor_state_t cursorState;
+static rfbCursorPtr activeCursor = NULL;
+static uint8_t *lastImage = NULL;
+static uint32_t lastWidth = 0, lastHeight = 0;
+static int lastVisible = -1;
+static int lastX = INT_MIN, lastY = INT_MIN; // Published pointer position (the hotspot)
+
+// The cursor plane is placed by its top left corner, the pointer is at the hotspot of the shape
+static int hotX = 0, hotY = 0;
+static int planeX = INT_MIN, planeY = INT_MIN;
+static uint64_t hotPointerTime = 0; // Client pointer event the plane position is compared with
+static int foreignPointer = 0; // Another device moved the pointer after that event
+
+static rfbCursorPtr makeCursor(const cursor_state_t *cursor) {
+	rfbCursorPtr c;
+	uint32_t pixel, value, x, y;
+	uint32_t width = cursor->visible ? cursor->width : 1;
+	uint32_t height = cursor->visible ? cursor->height : 1;
+	int bytesPerPixel = screenFormat.bitsPerPixel / CHAR_BIT;
+	int maskStride = (width + 7) / CHAR_BIT;
+	uint8_t alpha, red, green, blue;
+
+	c = calloc(1, sizeof(rfbCursor));
+	assert(c != NULL);
+
+	c->width = width;
+	c->height = height;
+	c->richSource = calloc(width * height, bytesPerPixel);
+	c->alphaSource = calloc(width * height, 1);
+	c->mask = calloc(maskStride * height, 1);
+	assert(c->richSource != NULL && c->alphaSource != NULL && c->mask != NULL);
+
+	c->cleanup = TRUE;
+	c->cleanupSource = TRUE;
+	c->cleanupMask = TRUE;
+	c->cleanupRichSource = TRUE;
+	c->alphaPreMultiplied = TRUE;
+	c->foreRed = c->foreGreen = c->foreBlue = 0xffff;
+
+	// A hidden cursor is a single transparent pixel
+	if (!cursor->visible)
+		return c;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			memcpy(&pixel, cursor->image + y * cursor->stride + x * 4, sizeof(pixel));
+
+			alpha = pixel >> 24;
+			red = pixel >> 16;
+			green = pixel >> 8;
+			blue = pixel;
+
+			// ARGB8888 to the server pixel format
+			value = ((uint32_t)(red >> (8 - screenFormat.redMax)) << screenFormat.redShift) |
+				((uint32_t)(green >> (8 - screenFormat.greenMax)) << screenFormat.greenShift) |
+				((uint32_t)(blue >> (8 - screenFormat.blueMax)) << screenFormat.blueShift);
+			memcpy(c->richSource + (y * width + x) * bytesPerPixel, &value, bytesPerPixel);
+
+			c->alphaSource[y * width + x] = alpha;
+			if (alpha)
+				c->mask[y * maskStride + x / CHAR_BIT] |= 0x80 >> (x % CHAR_BIT);
+		}
+	}
+
+	return c;
+}
+
+static int checkShapeChange(void) {
+	uint32_t y;
+
+	if (cursorState.visible != lastVisible)
+		return 1;
+
+	if (!cursorState.visible)
+		return 0;
+
+	if (cursorState.width != lastWidth || cursorState.height != lastHeight || !lastImage)
+		return 1;
+
+	for (y = 0; y < cursorState.height; y++) {
+		if (memcmp(lastImage + y * cursorState.width * 4, cursorState.image + y * cursorState.stride, cursorState.width * 4))
+			return 1;
+	}
+
+	return 0;
+}
+
+// The driver reports the hotspot, or it is the offset of the resting client pointer from the plane (1: changed)
+static int updateHotspot(int shapeChange) {
+	uint64_t elapsed = getMonotonicTime() - pointerTime;
+	int moved = cursorState.x != planeX || cursorState.y != planeY;
+	int x = hotX, y = hotY;
+
+	planeX = cursorState.x;
+	planeY = cursorState.y;
+
+	if (cursorState.hotX >= 0 && cursorState.hotY >= 0) {
+		x = cursorState.hotX;
+		y = cursorState.hotY;
+	} else if (pointerClient && elapsed >= CURSOR_SETTLE_TIME * 1000ULL) {
+		// The plane moving with the same shape while the client pointer rests means another device
+		if (pointerTime != hotPointerTime) {
+			hotPointerTime = pointerTime;
+			foreignPointer = 0;
+		} else if (moved && !shapeChange) {
+			foreignPointer = 1;
+		}
+
+		if (!foreignPointer && pointerX >= planeX && pointerX < planeX + (int)cursorState.width &&
+		    pointerY >= planeY && pointerY < planeY + (int)cursorState.height) {
+			x = pointerX - planeX;
+			y = pointerY - planeY;
+		}
+	}
+
+	x = MAX(0, MIN(x, (int)cursorState.width - 1));
+	y = MAX(0, MIN(y, (int)cursorState.height - 1));
+	if (x == hotX && y == hotY)
+		return 0;
+
+	hotX = x;
+	hotY = y;
+	return 1;
+}
+
+void updateCursor(void) {
+	rfbClientIteratorPtr iterator;
+	rfbClientPtr cl;
+	rfbCursorPtr cursor;
+	uint64_t timeNow;
+	int shapeChange, hotChange = 0;
+	uint32_t y;
+
+	// Without hardware cursor information, the default cursor of libvncserver is kept
+	if (!readCursor(&cursorState))
+		return;
+
+	shapeChange = checkShapeChange();
+	if (cursorState.visible)
+		hotChange = updateHotspot(shapeChange);
+
+	if (shapeChange || hotChange) {
+		if (cursorState.visible) {
+			free(lastImage);
+			lastImage = malloc(cursorState.width * cursorState.height * 4);
+			assert(lastImage != NULL);
+
+			for (y = 0; y < cursorState.height; y++)
+				memcpy(lastImage + y * cursorState.width * 4, cursorState.image + y * cursorState.stride, cursorState.width * 4);
+
+			lastWidth = cursorState.width;
+			lastHeight = cursorState.height;
+		}
+
+		lastVisible = cursorState.visible;
+
+		// The new shape is sent to clients with the rich cursor pseudo-encoding
+		cursor = makeCursor(&cursorState);
+		if (cursorState.visible) {
+			cursor->xhot = hotX;
+			cursor->yhot = hotY;
+		}
+		rfbSetCursor(vncScreen, cursor);
+		if (activeCursor)
+			rfbFreeCursor(activeCursor);
+		activeCursor = cursor;
+	}
+
+	if (!cursorState.visible || (cursorState.x + hotX == lastX && cursorState.y + hotY == lastY))
+		return;
+
+	lastX = cursorState.x + hotX;
+	lastY = cursorState.y + hotY;
+
+	// Cursor motion only costs a PointerPos update instead of a framebuffer update
+	vncScreen->cursorX = lastX;
+	vncScreen->cursorY = lastY;
+
+	timeNow = getMonotonicTime();
+
+	iterator = rfbGetClientIterator(vncScreen);
+	while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+		// The client which is moving the pointer already knows the position
+		if (cl == pointerClient && timeNow - pointerTime < CURSOR_OWNER_TIMEOUT * 1000ULL)
+			continue;
+
+		if (cl->enableCursorPosUpdates)
+			cl->cursorWasMoved = TRUE;
+	}
+	rfbReleaseClientIterator(iterator);
+}
+
+void closeCursor(void) {
+	// The cursor is released here, so the screen cleanup does not free it again
+	if (activeCursor) {
+		if (vncScreen->cursor == activeCursor)
+			vncScreen->cursor = NULL;
+		rfbFreeCursor(activeCursor);
+		activeCursor = NULL;
+	}
+
+	free(lastImage);
+	lastImage = NULL;
+	lastWidth = lastHeight = 0;
+	lastVisible = -1;
+	lastX = lastY = INT_MIN;
+	hotX = hotY = 0;
+	planeX = planeY = INT_MIN;
+	hotPointerTime = 0;
+	foreignPointer = 0;
+}
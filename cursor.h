@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for cursor shape and position publishing
+
+#ifndef CURSOR_H
+#define CURSOR_H
+
+#include "common.h"
+#include "framebuffer.h"
+#include "input.h"
+#include "updatescreen.h"
+
+#define CURSOR_OWNER_TIMEOUT 500 // Client pointer ownership in ms
+#define CURSOR_SETTLE_TIME 50 // Time for the cursor plane to follow a client pointer event in ms
+
+void updateCursor(void);
+void closeCursor(void);
+
+#endif
@@ -2,14 +2,20 @@
 // Framebuffer backend abstraction
 
 #include "framebuffer.h"
+#include "scale.h"
 
 screen_info_t screenInfo;
 screen_format_t screenFormat;
+screen_head_t screenHeads[MAX_HEADS];
+int screenHeadCount = 0;
 
 int activeBackend = BACKEND_NONE;
 int reinitDelay = 0;
+int frameBufferGeneration = 0; // Counts the backend initializations
 
 void initFrameBuffer(void) {
+	// Descriptors of the new backend may reuse the numbers of the closed ones
+	frameBufferGeneration++;
 
 #ifdef HAVE_LIBDRM
 	// 1st probe: DRM
@@ -26,6 +32,9 @@ void initFrameBuffer(void) {
 	if (activeBackend == BACKEND_NONE || activeBackend == BACKEND_FBDEV) {
 		if (fbdev_initFrameBuffer() == 0) {
 			reinitDelay = FB_DELAY;
+			screenHeadCount = 1;
+			screenHeads[0].x = 0;
+			screenHeads[0].info = screenInfo;
 			if (activeBackend == BACKEND_NONE)
 				activeBackend = BACKEND_FBDEV;
 		}
@@ -35,6 +44,9 @@ void initFrameBuffer(void) {
 		LOG(" There is no backend device available.\n");
 		exit(EXIT_FAILURE);
 	}
+
+	// The served desktop layout follows the scaling options
+	applyScale();
 }
 
 void closeFrameBuffer(void) {
@@ -52,9 +64,11 @@ void closeFrameBuffer(void) {
 
 	case BACKEND_NONE:
 	default:
-		LOG(" Invalid backend state: %d\n", activeBackend);
+		LOGE(" Invalid backend state: %d\n", activeBackend);
 		exit(EXIT_FAILURE);
 	}
+
+	closeScale();
 }
 
 int checkBufferStateChange() {
@@ -70,27 +84,92 @@ int checkBufferStateChange() {
 
 	case BACKEND_NONE:
 	default:
-		LOG(" Invalid backend state: %d\n", activeBackend);
+		LOGE(" Invalid backend state: %d\n", activeBackend);
 		exit(EXIT_FAILURE);
 		return -1;
 	}
 }
 
-uint32_t *readFrameBuffer(void) {
+void readFrameBuffer(int head) {
 	switch (activeBackend) {
 
 #ifdef HAVE_LIBDRM
 	case BACKEND_DRM:
-		return drm_readFrameBuffer();
+		drm_readFrameBuffer(head);
+		break;
 #endif
 
 	case BACKEND_FBDEV:
-		return fbdev_readFrameBuffer();
+		screenHeads[0].buffer = (uint8_t *)fbdev_readFrameBuffer();
+		screenHeads[0].info = screenInfo;
+		break;
 
 	case BACKEND_NONE:
 	default:
-		LOG(" Invalid backend state: %d\n", activeBackend);
+		LOGE(" Invalid backend state: %d\n", activeBackend);
 		exit(EXIT_FAILURE);
-		return NULL;
+	}
+}
+
+int readCursor(cursor_state_t *cursor) {
+	switch (activeBackend) {
+
+#ifdef HAVE_LIBDRM
+	case BACKEND_DRM:
+		return drm_readCursor(cursor);
+#endif
+
+	default:
+		return 0; // No hardware cursor information available
+	}
+}
+
+int getFrameEventFd(void) {
+	switch (activeBackend) {
+
+#ifdef HAVE_LIBDRM
+	case BACKEND_DRM:
+		return drm_getEventFd();
+#endif
+
+	case BACKEND_FBDEV:
+		return fbdev_getEventFd();
+
+	default:
+		return -1; // No frame events, capture follows the frame timer only
+	}
+}
+
+int requestFrameEvent(void) {
+	switch (activeBackend) {
+
+#ifdef HAVE_LIBDRM
+	case BACKEND_DRM:
+		return drm_requestVblank();
+#endif
+
+	case BACKEND_FBDEV:
+		return fbdev_requestVsync();
+
+	default:
+		return 0;
+	}
+}
+
+void handleFrameEvent(void) {
+	switch (activeBackend) {
+
+#ifdef HAVE_LIBDRM
+	case BACKEND_DRM:
+		drm_handleEvent();
+		break;
+#endif
+
+	case BACKEND_FBDEV:
+		fbdev_handleEvent();
+		break;
+
+	default:
+		break;
 	}
 }
@@ -5,25 +5,27 @@
 #define FRAMEBUFFER_H
 
 #include "common.h"
-
-#ifdef HAVE_LIBDRM
-#include "backend/drm.h"
-#endif
-
-#include "backend/fbdev.h"
+#include "convert.h"
+#include "metrics.h"
+#include "bufferpool.h"
 
 #define BACKEND_NONE	0
 #define BACKEND_FBDEV	1
 #define BACKEND_DRM	2
 
+#define MAX_HEADS 4
+
 extern int activeBackend;
 extern int reinitDelay;
+extern int frameBufferGeneration;
 
 typedef struct {
 	uint32_t width;		// Screen width in pixels
 	uint32_t height;	// Screen height in pixels
 	uint32_t stride;	// Aligned value of bytes per line
 	uint32_t start;		// Current frame vertical offset
+	uint32_t pixelBytes;	// Bytes per pixel in the captured buffer
+	int convert;		// Capture-side pixel conversion (CONVERT_*)
 } screen_info_t;
 
 extern screen_info_t screenInfo;
@@ -48,9 +50,57 @@ typedef struct _screenformat {
 
 extern screen_format_t screenFormat;
 
+typedef struct {
+	int valid;		// The backend provided exact damage for the last read
+	uint32_t yMin;		// First changed line (empty if greater than yMax)
+	uint32_t yMax;		// Last changed line
+} frame_damage_t;
+
+typedef struct {
+	uint32_t width;		// Served width in pixels
+	uint32_t height;	// Served height in pixels
+	uint32_t step;		// Captured pixels per served pixel (16.16 fixed point)
+	uint32_t factor;	// Box filter size for integer steps (0: bilinear)
+} scale_t;
+
+typedef struct {
+	uint32_t x;		// Horizontal position on the served desktop
+	uint32_t nativeX;	// Horizontal position on the captured desktop
+	screen_info_t info;	// Layout of the captured buffer
+	scale_t scale;		// Served size of the head
+	uint8_t *buffer;	// Captured buffer (NULL if the head is suspended)
+	frame_damage_t damage;	// Damage reported by the last read
+	int blank;		// The desktop area of the head has been cleared
+} screen_head_t;
+
+extern screen_head_t screenHeads[MAX_HEADS];
+extern int screenHeadCount;
+
+typedef struct {
+	int visible;		// A cursor image is shown by the hardware
+	int x;			// Left edge on the served desktop
+	int y;			// Top edge on the served desktop
+	uint32_t width;		// Cursor image width in pixels
+	uint32_t height;	// Cursor image height in pixels
+	uint32_t stride;	// Bytes per line of the cursor image
+	const uint8_t *image;	// ARGB8888 cursor image
+	int hotX;		// Hotspot in the image, if the driver reports it (-1: unknown)
+	int hotY;
+} cursor_state_t;
+
+#ifdef HAVE_LIBDRM
+#include "backend/drm.h"
+#endif
+
+#include "backend/fbdev.h"
+
 void initFrameBuffer(void);
 void closeFrameBuffer(void);
 int checkBufferStateChange(void);
-uint32_t *readFrameBuffer(void);
+void readFrameBuffer(int head);
+int readCursor(cursor_state_t *cursor);
+int getFrameEventFd(void);
+int requestFrameEvent(void);
+void handleFrameEvent(void);
 
 #endif
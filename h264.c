@@ -0,0 +1,351 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Open H.264 encoding of full-motion content (OpenH264 software encoder)
+
+#include "h264.h"
+#include "client.h"
+#include "updatescreen.h"
+
+// Target bitrate in kbit/s (0 disables the encoding)
+int h264Bitrate = 0;
+
+static int h264Encodings[] = { H264_ENCODING, 0 };
+static int extensionRegistered = 0;
+
+// The screen in I420, shared by the encoders of all clients
+static uint8_t *frame = NULL;
+static uint8_t *frameU, *frameV;
+static int frameWidth, frameHeight;
+static int dirtyMin, dirtyMax; // Lines changed since the last conversion (empty if dirtyMin > dirtyMax)
+static int convertMin, convertMax;
+static int activeEncoders = 0;
+
+static rfbBool enableH264(rfbClientPtr cl, void **data, int encoding) {
+	client_info_t *info = cl->clientData;
+
+	if (encoding != H264_ENCODING || !info)
+		return FALSE;
+
+	if (!info->h264.supported)
+		LOG(" [%d] Client supports H.264.\n", info->session);
+	info->h264.supported = 1;
+	return TRUE;
+}
+
+static rfbProtocolExtension h264Extension = {
+	.pseudoEncodings = h264Encodings,
+	.enablePseudoEncoding = enableH264,
+};
+
+void initH264(void) {
+	if (!h264Bitrate)
+		return;
+
+	if (!extensionRegistered) {
+		rfbRegisterProtocolExtension(&h264Extension);
+		extensionRegistered = 1;
+	}
+
+	closeH264();
+
+	if (screenFormat.width & 1 || screenFormat.height & 1) {
+		LOG(" H.264 disabled, the screen size is odd: %dx%d.\n", (int)screenFormat.width, (int)screenFormat.height);
+		return;
+	}
+
+	frameWidth = screenFormat.width;
+	frameHeight = screenFormat.height;
+	frame = getPoolBuffer((size_t)frameWidth * frameHeight * 3 / 2);
+	assert(frame != NULL);
+	frameU = frame + (size_t)frameWidth * frameHeight;
+	frameV = frameU + (size_t)frameWidth * frameHeight / 4;
+
+	// The first encoder converts the whole screen
+	dirtyMin = 0;
+	dirtyMax = frameHeight - 1;
+
+	LOG(" H.264 enabled for full-motion content at %d kbit/s.\n", h264Bitrate);
+}
+
+void closeH264(void) {
+	if (frame)
+		putPoolBuffer(frame);
+	frame = NULL;
+}
+
+void h264MarkDirty(int yMin, int yMax) {
+	dirtyMin = MIN(dirtyMin, yMin);
+	dirtyMax = MAX(dirtyMax, yMax);
+}
+
+// BT.601 limited range, chroma of the 2x2 blocks (worker job, one band of line pairs per worker)
+static void convertBand(int index) {
+	const int pixelBytes = screenFormat.bitsPerPixel / CHAR_BIT;
+	const int lineBytes = frameWidth * pixelBytes;
+	const uint32_t redMask = (1 << screenFormat.redMax) - 1;
+	const uint32_t greenMask = (1 << screenFormat.greenMax) - 1;
+	const uint32_t blueMask = (1 << screenFormat.blueMax) - 1;
+	int pairs = (convertMax - convertMin + 1) / 2;
+	int first = convertMin + pairs * index / WORKER_MAX * 2;
+	int last = convertMin + pairs * (index + 1) / WORKER_MAX * 2;
+	int x, y, i, r, g, b, sumR, sumG, sumB;
+	const uint8_t *src;
+	uint32_t pixel;
+	uint8_t *dstY;
+
+	for (y = first; y < last; y += 2) {
+		for (x = 0; x < frameWidth; x += 2) {
+			sumR = sumG = sumB = 0;
+			for (i = 0; i < 4; i++) {
+				src = (const uint8_t *)vncBuffer + (size_t)(y + i / 2) * lineBytes + (x + i % 2) * pixelBytes;
+				pixel = pixelBytes == 4 ? *(const uint32_t *)src : *(const uint16_t *)src;
+				r = ((pixel >> screenFormat.redShift) & redMask) << (8 - screenFormat.redMax);
+				g = ((pixel >> screenFormat.greenShift) & greenMask) << (8 - screenFormat.greenMax);
+				b = ((pixel >> screenFormat.blueShift) & blueMask) << (8 - screenFormat.blueMax);
+				dstY = frame + (size_t)(y + i / 2) * frameWidth + x + i % 2;
+				*dstY = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+				sumR += r;
+				sumG += g;
+				sumB += b;
+			}
+			r = sumR / 4;
+			g = sumG / 4;
+			b = sumB / 4;
+			i = (y / 2) * (frameWidth / 2) + x / 2;
+			frameU[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+			frameV[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+		}
+	}
+}
+
+static void convertDirty(void) {
+	if (dirtyMin > dirtyMax)
+		return;
+
+	// Whole line pairs share the chroma
+	convertMin = MAX(0, dirtyMin) & ~1;
+	convertMax = MIN(frameHeight - 1, dirtyMax | 1);
+	runWorkers(convertBand, WORKER_MAX);
+
+	dirtyMin = frameHeight;
+	dirtyMax = -1;
+}
+
+// Converts the changes once for all encoders and schedules an update for their clients
+void h264UpdateFrame(void) {
+	rfbClientIteratorPtr iterator;
+	rfbClientPtr cl;
+	client_info_t *info;
+	sraRegionPtr rect;
+	uint64_t traceStart;
+
+	if (!activeEncoders || dirtyMin > dirtyMax)
+		return;
+
+	// Every change is a new frame of the stream, the video tiles are not waited for
+	rect = sraRgnCreateRect(0, MAX(0, dirtyMin), frameWidth, MIN(frameHeight, dirtyMax + 1));
+	iterator = rfbGetClientIterator(vncScreen);
+	while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+		info = cl->clientData;
+		if (info && info->h264.active)
+			sraRgnOr(cl->modifiedRegion, rect);
+	}
+	rfbReleaseClientIterator(iterator);
+	sraRgnDestroy(rect);
+
+	traceStart = TRACE_START();
+	convertDirty();
+	TRACE_STOP("h264Convert", traceStart);
+}
+
+static ISVCEncoder *openEncoder(void) {
+	ISVCEncoder *encoder = NULL;
+	SEncParamExt param;
+	int format = videoFormatI420;
+
+	if (WelsCreateSVCEncoder(&encoder) != 0 || !encoder)
+		return NULL;
+
+	// Low latency: no frame skipping, one slice, IDR frames only for a new stream
+	(*encoder)->GetDefaultParams(encoder, &param);
+	param.iUsageType = SCREEN_CONTENT_REAL_TIME;
+	param.iPicWidth = frameWidth;
+	param.iPicHeight = frameHeight;
+	param.iTargetBitrate = h264Bitrate * 1000;
+	param.iRCMode = RC_BITRATE_MODE;
+	param.fMaxFrameRate = H264_FRAME_RATE;
+	param.bEnableFrameSkip = 0;
+	param.uiIntraPeriod = 0;
+	param.iSpatialLayerNum = 1;
+	param.iTemporalLayerNum = 1;
+	param.iMultipleThreadIdc = 1;
+	param.sSpatialLayers[0].iVideoWidth = frameWidth;
+	param.sSpatialLayers[0].iVideoHeight = frameHeight;
+	param.sSpatialLayers[0].fFrameRate = H264_FRAME_RATE;
+	param.sSpatialLayers[0].iSpatialBitrate = param.iTargetBitrate;
+	param.sSpatialLayers[0].uiProfileIdc = PRO_BASELINE;
+	param.sSpatialLayers[0].sSliceArgument.uiSliceMode = SM_SINGLE_SLICE;
+
+	if ((*encoder)->InitializeExt(encoder, &param) != cmResultSuccess) {
+		WelsDestroySVCEncoder(encoder);
+		return NULL;
+	}
+	(*encoder)->SetOption(encoder, ENCODER_OPTION_DATAFORMAT, &format);
+
+	return encoder;
+}
+
+static void closeEncoder(h264_state_t *state) {
+	if (state->encoder) {
+		(*state->encoder)->Uninitialize(state->encoder);
+		WelsDestroySVCEncoder(state->encoder);
+	}
+	state->encoder = NULL;
+
+	if (state->active)
+		activeEncoders--;
+	state->active = 0;
+}
+
+static void put16(uint8_t *dst, uint16_t value) {
+	dst[0] = value >> 8;
+	dst[1] = value;
+}
+
+static void put32(uint8_t *dst, uint32_t value) {
+	put16(dst, value >> 16);
+	put16(dst + 2, value);
+}
+
+// One framebuffer update with a single Open H.264 rectangle of the whole screen
+static int sendFrame(rfbClientPtr cl, SFrameBSInfo *bitstream, int flags) {
+	uint8_t header[24];
+	SLayerBSInfo *layer;
+	int i, j, length = 0, layerLength;
+
+	for (i = 0; i < bitstream->iLayerNum; i++) {
+		layer = &bitstream->sLayerInfo[i];
+		for (j = 0; j < layer->iNalCount; j++)
+			length += layer->pNalLengthInByte[j];
+	}
+
+	header[0] = rfbFramebufferUpdate;
+	header[1] = 0;
+	put16(header + 2, 1);
+	put16(header + 4, 0);
+	put16(header + 6, 0);
+	put16(header + 8, frameWidth);
+	put16(header + 10, frameHeight);
+	put32(header + 12, H264_ENCODING);
+	put32(header + 16, length);
+	put32(header + 20, flags);
+
+	if (rfbWriteExact(cl, (char *)header, sizeof(header)) < 0)
+		return -1;
+
+	for (i = 0; i < bitstream->iLayerNum; i++) {
+		layer = &bitstream->sLayerInfo[i];
+		layerLength = 0;
+		for (j = 0; j < layer->iNalCount; j++)
+			layerLength += layer->pNalLengthInByte[j];
+		if (layerLength && rfbWriteExact(cl, (char *)layer->pBsBuf, layerLength) < 0)
+			return -1;
+	}
+
+	rfbStatRecordEncodingSent(cl, H264_ENCODING, sizeof(header) + length,
+		frameWidth * frameHeight * (screenFormat.bitsPerPixel / CHAR_BIT));
+	metrics.h264Bytes += length;
+	return 0;
+}
+
+// The lossy stream is replaced by a lossless refresh
+static void stopStream(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+	sraRegionPtr full;
+
+	closeEncoder(&info->h264);
+	info->h264.frames = 0;
+
+	full = sraRgnCreateRect(0, 0, frameWidth, frameHeight);
+	sraRgnOr(cl->modifiedRegion, full);
+	sraRgnDestroy(full);
+	info->videoRefresh = 1;
+}
+
+// Sends the update as an H.264 frame while the screen is mostly video (display hook)
+void h264SendUpdate(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+	h264_state_t *state;
+	SSourcePicture picture;
+	SFrameBSInfo bitstream;
+	uint64_t traceStart;
+	int share, flags = 0;
+
+	if (!frame || !info || !info->h264.supported)
+		return;
+
+	state = &info->h264;
+	share = videoShare();
+
+	if (!state->active && share >= H264_MOTION_START) {
+		state->encoder = openEncoder();
+		if (!state->encoder) {
+			LOGE(" [%d] Failed to create the H.264 encoder.\n", info->session);
+			state->supported = 0;
+			return;
+		}
+		state->active = 1;
+		activeEncoders++;
+		flags = H264_RESET_CONTEXT;
+		convertDirty();
+		LOG(" [%d] Full-motion content, sending H.264.\n", info->session);
+	} else if (state->active && share < H264_MOTION_STOP) {
+		LOG(" [%d] Motion stopped after %llu H.264 frames.\n", info->session, (unsigned long long)state->frames);
+		stopStream(cl);
+		return;
+	}
+
+	if (!state->active)
+		return;
+
+	traceStart = TRACE_START();
+
+	memset(&picture, 0, sizeof(picture));
+	picture.iColorFormat = videoFormatI420;
+	picture.iPicWidth = frameWidth;
+	picture.iPicHeight = frameHeight;
+	picture.iStride[0] = frameWidth;
+	picture.iStride[1] = picture.iStride[2] = frameWidth / 2;
+	picture.pData[0] = frame;
+	picture.pData[1] = frameU;
+	picture.pData[2] = frameV;
+	picture.uiTimeStamp = getMonotonicTime() / 1000;
+
+	memset(&bitstream, 0, sizeof(bitstream));
+	if ((*state->encoder)->EncodeFrame(state->encoder, &picture, &bitstream) != cmResultSuccess) {
+		LOGE(" [%d] H.264 encoding failed.\n", info->session);
+		stopStream(cl);
+		state->supported = 0;
+		return;
+	}
+
+	// The whole screen is in the frame, the pending changes are consumed with the request
+	sraRgnMakeEmpty(cl->modifiedRegion);
+	if (bitstream.eFrameType != videoFrameTypeSkip) {
+		sraRgnMakeEmpty(cl->requestedRegion);
+		if (sendFrame(cl, &bitstream, flags) < 0) {
+			rfbLogPerror("h264SendUpdate: write");
+			rfbCloseClient(cl);
+		}
+		state->frames++;
+		metrics.h264Frames++;
+	}
+
+	TRACE_STOP("h264Encode", traceStart);
+}
+
+void h264CloseClient(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+
+	if (info)
+		closeEncoder(&info->h264);
+}
@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for the Open H.264 encoding of full-motion content
+
+#ifndef H264_H
+#define H264_H
+
+#include "common.h"
+#include "framebuffer.h"
+
+#include <wels/codec_api.h>
+
+#define H264_ENCODING 50 // RFB Open H.264 encoding number
+#define H264_RESET_CONTEXT 1 // Open H.264 flag: the decoder starts a new stream
+#define H264_MOTION_START 50 // Video tiles (% of the screen) which switch a client to H.264
+#define H264_MOTION_STOP 25 // Video tiles (% of the screen) which switch back to the normal encodings
+#define H264_VIDEO_RATE 10 // Video detection rate in Hz when only H.264 enables it
+#define H264_FRAME_RATE 30 // Frame rate hint of the rate control
+#define H264_MAX_BITRATE 100000 // kbit/s
+
+// Per-client encoder state, part of client_info_t
+typedef struct {
+	int supported; // The client advertised the Open H.264 encoding
+	int active; // Updates are sent as H.264 frames
+	ISVCEncoder *encoder;
+	uint64_t frames;
+} h264_state_t;
+
+extern int h264Bitrate;
+
+void initH264(void);
+void closeH264(void);
+void h264MarkDirty(int yMin, int yMax);
+void h264UpdateFrame(void);
+void h264SendUpdate(rfbClientPtr cl);
+void h264CloseClient(rfbClientPtr cl);
+
+#endif
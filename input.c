@@ -2,14 +2,34 @@
 // Virtual input device handling
 
 #include "input.h"
+#include "record.h"
 
 int virtKbd, virtPtr;
 int downKeys[KEY_CNT];
 int mouseX, mouseY;
 int mouseButton = 0;
 
+// Pointer motion coalescing (0 disables it)
+int pointerRate = POINTER_RATE;
+int motionPending = 0;
+static uint64_t motionTime = 0;
+
+input_stats_t inputStats;
+static input_batch_t kbdBatch, ptrBatch;
+
+// Background creation of the input devices
+static pthread_t inputThread;
+static int inputThreadActive = 0;
+static int initKeyboard, initPointer;
+
+// Last client driving the virtual pointer
+rfbClientPtr pointerClient = NULL;
+uint64_t pointerTime = 0;
+int pointerX = 0, pointerY = 0; // Last client position on the served desktop
+
 void initVirtualKeyboard(void) {
 	struct uinput_user_dev uinpDev;
+	uint8_t keyBits[KEYMAP_KEYBITS_SIZE];
 	int retcode, i;
 
 	memset(downKeys, 0, sizeof(downKeys));
@@ -18,7 +38,7 @@ void initVirtualKeyboard(void) {
 
 	virtKbd = open("/dev/uinput", O_WRONLY | O_NDELAY );
 	if (virtKbd == 0) {
-		LOG(" Could not open '/dev/uinput'.\n");
+		LOGE(" Could not open '/dev/uinput'.\n");
 		exit(EXIT_FAILURE);
 	}
 
@@ -30,15 +50,18 @@ void initVirtualKeyboard(void) {
 	ioctl(virtKbd, UI_SET_EVBIT, EV_SYN);
 	ioctl(virtKbd, UI_SET_EVBIT, EV_KEY);
 
-	for (i=0; i<KEY_MAX; i++) {
-		ioctl(virtKbd, UI_SET_KEYBIT, i);
+	// Only the keys of the keymap are enabled (instead of one ioctl for every key code)
+	getKeymapKeyBits(keyBits);
+	for (i = 0; i < KEY_CNT; i++) {
+		if (keyBits[i / CHAR_BIT] & (1 << (i % CHAR_BIT)))
+			ioctl(virtKbd, UI_SET_KEYBIT, i);
 	}
 
 	write(virtKbd, &uinpDev, sizeof(uinpDev));
 
 	retcode = (ioctl(virtKbd, UI_DEV_CREATE));
 	if (retcode) {
-		LOG(" Error create virtual keyboard device.\n");
+		LOGE(" Error create virtual keyboard device.\n");
 		exit(EXIT_FAILURE);
 	} else {
 		LOG(" The virtual keyboard device has been created.\n");
@@ -53,7 +76,7 @@ void initVirtualPointer(void) {
 
 	virtPtr = open("/dev/uinput", O_WRONLY | O_NDELAY );
 	if (virtPtr == 0) {
-		LOG(" Could not open '/dev/uinput'.\n");
+		LOGE(" Could not open '/dev/uinput'.\n");
 		exit(EXIT_FAILURE);
 	}
 
@@ -77,21 +100,51 @@ void initVirtualPointer(void) {
 	ioctl(virtPtr, UI_SET_ABSBIT, ABS_Y);
 
 	uinpDev.absmin[ABS_X] = 0;
-	uinpDev.absmax[ABS_X] = screenFormat.width - 1;
+	uinpDev.absmax[ABS_X] = screenInfo.width - 1;
 	uinpDev.absmin[ABS_Y] = 0;
-	uinpDev.absmax[ABS_Y] = screenFormat.height - 1;
+	uinpDev.absmax[ABS_Y] = screenInfo.height - 1;
 
 	write(virtPtr, &uinpDev, sizeof(uinpDev));
 
 	retcode = (ioctl(virtPtr, UI_DEV_CREATE));
 	if (retcode) {
-		LOG(" Error create virtual pointer device.\n");
+		LOGE(" Error create virtual pointer device.\n");
 		exit(EXIT_FAILURE);
 	} else {
 		LOG(" The virtual pointer device has been created.\n");
 	}
 }
 
+static void *inputDevicesThread(void *arg) {
+	uint64_t timeStart = getMonotonicTime();
+
+	if (initKeyboard)
+		initVirtualKeyboard();
+	if (initPointer)
+		initVirtualPointer();
+
+	startupPhase("input devices (background)", timeStart);
+	return NULL;
+}
+
+void initInputDevices(int keyboard, int pointer) {
+	initKeyboard = keyboard;
+	initPointer = pointer;
+
+	// The devices are created next to the server startup, events wait for them in waitInputDevices()
+	if (pthread_create(&inputThread, NULL, inputDevicesThread, NULL) == 0)
+		inputThreadActive = 1;
+	else
+		inputDevicesThread(NULL);
+}
+
+void waitInputDevices(void) {
+	if (inputThreadActive) {
+		pthread_join(inputThread, NULL);
+		inputThreadActive = 0;
+	}
+}
+
 void closeVirtualKeyboard(void) {
 	ioctl(virtKbd, UI_DEV_DESTROY);
 	close(virtKbd);
@@ -99,260 +152,198 @@ void closeVirtualKeyboard(void) {
 }
 
 void closeVirtualPointer(void) {
+	motionPending = 0;
 	ioctl(virtPtr, UI_DEV_DESTROY);
 	close(virtPtr);
 	LOG(" The virtual pointer device has been deleted.\n");
 }
 
-void writeEvent(int udev, uint16_t type, uint16_t code, int value) {
-	struct input_event event;
-	memset(&event, 0, sizeof(event));
-	gettimeofday(&event.time, NULL);
-	event.type = type;
-	event.code = code;
-	event.value = value;
-	write(udev, &event, sizeof(event));
+void queueEvent(input_batch_t *batch, uint16_t type, uint16_t code, int value) {
+	struct input_event *event;
+
+	// One slot is always kept for the closing SYN_REPORT
+	if (batch->count >= INPUT_BATCH_MAX - 1)
+		flushEvents(batch);
+
+	event = &batch->events[batch->count++];
+	event->type = type;
+	event->code = code;
+	event->value = value;
 }
 
-int keySym2Scancode(rfbKeySym key) {
-	// LOG(" DEBUG -> Keyboard keysym key: %04X.\n", key);
-
-	switch (key) {
-
-	/* Modifiers */
-	case XK_Shift_L:	return KEY_LEFTSHIFT;
-	case XK_Shift_R:	return KEY_RIGHTSHIFT;
-	case XK_Control_L:	return KEY_LEFTCTRL;
-	case XK_Control_R:	return KEY_RIGHTCTRL;
-	case XK_Alt_L:		return KEY_LEFTALT;
-	case XK_Alt_R:
-	case XK_ISO_Level3_Shift:
-				return KEY_RIGHTALT;
-
-	/* Alphabetic keys */
-	case XK_a: case XK_A:	return KEY_A;
-	case XK_b: case XK_B:	return KEY_B;
-	case XK_c: case XK_C:	return KEY_C;
-	case XK_d: case XK_D:	return KEY_D;
-	case XK_e: case XK_E:	return KEY_E;
-	case XK_f: case XK_F:	return KEY_F;
-	case XK_g: case XK_G:	return KEY_G;
-	case XK_h: case XK_H:	return KEY_H;
-	case XK_i: case XK_I:	return KEY_I;
-	case XK_j: case XK_J:	return KEY_J;
-	case XK_k: case XK_K:	return KEY_K;
-	case XK_l: case XK_L:	return KEY_L;
-	case XK_m: case XK_M:	return KEY_M;
-	case XK_n: case XK_N:	return KEY_N;
-	case XK_o: case XK_O:	return KEY_O;
-	case XK_p: case XK_P:	return KEY_P;
-	case XK_q: case XK_Q:	return KEY_Q;
-	case XK_r: case XK_R:	return KEY_R;
-	case XK_s: case XK_S:	return KEY_S;
-	case XK_t: case XK_T:	return KEY_T;
-	case XK_u: case XK_U:	return KEY_U;
-	case XK_v: case XK_V:	return KEY_V;
-	case XK_w: case XK_W:	return KEY_W;
-	case XK_x: case XK_X:	return KEY_X;
-	case XK_y: case XK_Y:	return KEY_Y;
-	case XK_z: case XK_Z:	return KEY_Z;
-
-	/* Numeric keys */
-	case XK_1:		return KEY_1;
-	case XK_2:		return KEY_2;
-	case XK_3:		return KEY_3;
-	case XK_4:		return KEY_4;
-	case XK_5:		return KEY_5;
-	case XK_6:		return KEY_6;
-	case XK_7:		return KEY_7;
-	case XK_8:		return KEY_8;
-	case XK_9:		return KEY_9;
-	case XK_0:		return KEY_0;
-
-	/* System and navigation keys */
-	case XK_Escape:		return KEY_ESC;
-	case XK_BackSpace:	return KEY_BACKSPACE;
-	case XK_Tab:		return KEY_TAB;
-	case XK_Return:		return KEY_ENTER;
-	case XK_Insert:		return KEY_INSERT;
-	case XK_Delete:		return KEY_DELETE;
-	case XK_Home:		return KEY_HOME;
-	case XK_Left:		return KEY_LEFT;
-	case XK_Up:		return KEY_UP;
-	case XK_Right:		return KEY_RIGHT;
-	case XK_Down:		return KEY_DOWN;
-	case XK_Page_Up:	return KEY_PAGEUP;
-	case XK_Page_Down:	return KEY_PAGEDOWN;
-	case XK_End:		return KEY_END;
-
-	/* Function keys (F1-F12) */
-	case XK_F1:		return KEY_F1;
-	case XK_F2:		return KEY_F2;
-	case XK_F3:		return KEY_F3;
-	case XK_F4:		return KEY_F4;
-	case XK_F5:		return KEY_F5;
-	case XK_F6:		return KEY_F6;
-	case XK_F7:		return KEY_F7;
-	case XK_F8:		return KEY_F8;
-	case XK_F9:		return KEY_F9;
-	case XK_F10:		return KEY_F10;
-	case XK_F11:		return KEY_F11;
-	case XK_F12:		return KEY_F12;
-
-	/* Physical punctuation keys */
-	case XK_space:		return KEY_SPACE;
-	case XK_minus:		return KEY_MINUS;
-	case XK_equal:		return KEY_EQUAL;
-	case XK_bracketleft:	return KEY_LEFTBRACE;
-	case XK_bracketright:	return KEY_RIGHTBRACE;
-	case XK_semicolon:	return KEY_SEMICOLON;
-	case XK_apostrophe:	return KEY_APOSTROPHE;
-	case XK_grave:		return KEY_GRAVE;
-	case XK_backslash:	return KEY_BACKSLASH;
-	case XK_comma:		return KEY_COMMA;
-	case XK_period:		return KEY_DOT;
-	case XK_slash:		return KEY_SLASH;
-
-	/* Layout dependent keys - Used together with modifiers (US) */
-	case XK_exclam:		return KEY_1;
-	case XK_at:		return KEY_2;
-	case XK_numbersign:	return KEY_3;
-	case XK_dollar:		return KEY_4;
-	case XK_percent:	return KEY_5;
-	case XK_asciicircum:	return KEY_6;
-	case XK_ampersand:	return KEY_7;
-	case XK_parenleft:	return KEY_9;
-	case XK_parenright:	return KEY_0;
-	case XK_underscore:	return KEY_MINUS;
-	case XK_colon:		return KEY_SEMICOLON;
-	case XK_quotedbl:	return KEY_APOSTROPHE;
-	case XK_asciitilde:	return KEY_GRAVE;
-	case XK_bar:		return KEY_BACKSLASH;
-	case XK_less:		return KEY_COMMA;
-	case XK_greater:	return KEY_DOT;
-	case XK_question:	return KEY_SLASH;
-
-	/* Numeric keypad - Independent of server-side Num Lock state */
-	case XK_KP_Divide:	return KEY_KPSLASH;
-	case XK_KP_Multiply:	return KEY_KPASTERISK;
-	case XK_KP_Add:		return KEY_KPPLUS;
-	case XK_KP_Subtract:	return KEY_KPMINUS;
-	case XK_KP_Enter:	return KEY_KPENTER;
-	case XK_KP_Decimal:	return KEY_KPDOT;
-	case XK_KP_0:		return KEY_0;
-	case XK_KP_1:		return KEY_1;
-	case XK_KP_2:		return KEY_2;
-	case XK_KP_3:		return KEY_3;
-	case XK_KP_4:		return KEY_4;
-	case XK_KP_5:		return KEY_5;
-	case XK_KP_6:		return KEY_6;
-	case XK_KP_7:		return KEY_7;
-	case XK_KP_8:		return KEY_8;
-	case XK_KP_9:		return KEY_9;
-	case XK_KP_Home:	return KEY_HOME;
-	case XK_KP_End:		return KEY_END;
-	case XK_KP_Page_Up:	return KEY_PAGEUP;
-	case XK_KP_Page_Down:	return KEY_PAGEDOWN;
-	case XK_KP_Up:		return KEY_UP;
-	case XK_KP_Down:	return KEY_DOWN;
-	case XK_KP_Left:	return KEY_LEFT;
-	case XK_KP_Right:	return KEY_RIGHT;
-	case XK_KP_Insert:	return KEY_INSERT;
-	case XK_KP_Delete:	return KEY_DELETE;
-
-	/* Redefined keys */
-	case XK_asterisk:	return KEY_KPASTERISK;
-	case XK_plus:		return KEY_KPPLUS;
-
-	/* Unhandled keys */
-	default:		return 0;
-	}
+void flushEvents(input_batch_t *batch) {
+	struct input_event *event;
+	struct timeval time;
+	struct iovec iov;
+	int i;
+
+	if (!batch->count)
+		return;
+
+	// The slot kept free by queueEvent() takes the closing SYN_REPORT
+	event = &batch->events[batch->count++];
+	event->type = EV_SYN;
+	event->code = SYN_REPORT;
+	event->value = 0;
+
+	// The whole batch shares one timestamp
+	gettimeofday(&time, NULL);
+	for (i = 0; i < batch->count; i++)
+		batch->events[i].time = time;
+
+	iov.iov_base = batch->events;
+	iov.iov_len = batch->count * sizeof(struct input_event);
+	if (writev(batch->udev, &iov, 1) < 0)
+		LOGE(" Could not write input events: %s.\n", strerror(errno));
+
+	inputStats.written += batch->count;
+	inputStats.writes++;
+	batch->count = 0;
 }
 
 void addKeyboardEvent(rfbBool down, rfbKeySym key, rfbClientPtr cl) {
 	int scancode = keySym2Scancode(key);
 	int wasDown = downKeys[scancode];
 
-	// Reset synchronization request
-	int needSync = 0;
+	inputStats.received++;
+	latencyInput(cl);
+	recordKeyEvent(cl, down, key);
+	waitInputDevices();
+	kbdBatch.udev = virtKbd;
 
 	// Key repeat and press event
 	if(down) {
-		writeEvent(virtKbd, EV_KEY, scancode, wasDown ? 2 : 1); // Auto-repeat (2), Press (1)
+		queueEvent(&kbdBatch, EV_KEY, scancode, wasDown ? 2 : 1); // Auto-repeat (2), Press (1)
 		downKeys[scancode] = 1;
-		needSync = 1;
 
 	// Key release event
 	} else {
-		writeEvent(virtKbd, EV_KEY, scancode, 0); // Release (0)
+		queueEvent(&kbdBatch, EV_KEY, scancode, 0); // Release (0)
 		downKeys[scancode] = 0;
-		needSync = 1;
 	}
 
 	// Synchronization
-	if (needSync) {
-		writeEvent(virtKbd, EV_SYN, SYN_REPORT, 0);
-	}
+	flushEvents(&kbdBatch);
 }
 
 void addPointerEvent(int buttonMask, int x, int y, rfbClientPtr cl) {
 	// LOG(" DEBUG -> Last button mask: 0x%x, current button mask: 0x%x, cursor position: X=%d, Y=%d.\n", mouseButton, buttonMask, x, y);
 
-	// Reset synchronization request
-	int needSync = 0;
+	uint64_t timeNow = getMonotonicTime();
+	int clientX = x, clientY = y;
+	int motion;
 
-	// Mouse cursor events are only processed when movement occurs
-	if (mouseX != x || mouseY != y) {
+	recordPointerEvent(cl, buttonMask, x, y);
 
-		// Set cursor coordinates
-		writeEvent(virtPtr, EV_ABS, ABS_X, x); // X axis
-		writeEvent(virtPtr, EV_ABS, ABS_Y, y); // Y axis
-		needSync = 1;
+	// Clients point on the served desktop, the virtual pointer covers the captured one
+	scalePointer(&x, &y);
+	motion = (mouseX != x || mouseY != y);
 
-		// Set the current position as the last position
-		mouseX = x;
-		mouseY = y;
-	}
+	inputStats.received++;
+	if (motion || mouseButton != buttonMask)
+		latencyInput(cl);
+	waitInputDevices();
+	ptrBatch.udev = virtPtr;
+
+	// Set the current position as the last position
+	mouseX = x;
+	mouseY = y;
 
 	// Button and scrool wheel events are only processed when a state change occurs
 	if (mouseButton != buttonMask) {
 
-		// Left button
-		if ((mouseButton & BTN_LEFT_MASK) != (buttonMask & BTN_LEFT_MASK)) {
-			writeEvent(virtPtr, EV_KEY, BTN_LEFT, (buttonMask & BTN_LEFT_MASK) ? 1 : 0);
-			needSync = 1;
+		// Buttons must act on the latest position, so a pending motion is written first
+		if (motion || motionPending) {
+			queueEvent(&ptrBatch, EV_ABS, ABS_X, x); // X axis
+			queueEvent(&ptrBatch, EV_ABS, ABS_Y, y); // Y axis
+			motionPending = 0;
+			motionTime = timeNow;
 		}
 
+		// Left button
+		if ((mouseButton & BTN_LEFT_MASK) != (buttonMask & BTN_LEFT_MASK))
+			queueEvent(&ptrBatch, EV_KEY, BTN_LEFT, (buttonMask & BTN_LEFT_MASK) ? 1 : 0);
+
 		// Middle button
-		if ((mouseButton & BTN_MIDDLE_MASK) != (buttonMask & BTN_MIDDLE_MASK)) {
-			writeEvent(virtPtr, EV_KEY, BTN_MIDDLE, (buttonMask & BTN_MIDDLE_MASK) ? 1 : 0);
-			needSync = 1;
-		}
+		if ((mouseButton & BTN_MIDDLE_MASK) != (buttonMask & BTN_MIDDLE_MASK))
+			queueEvent(&ptrBatch, EV_KEY, BTN_MIDDLE, (buttonMask & BTN_MIDDLE_MASK) ? 1 : 0);
 
 		// Right button
-		if ((mouseButton & BTN_RIGHT_MASK) != (buttonMask & BTN_RIGHT_MASK)) {
-			writeEvent(virtPtr, EV_KEY, BTN_RIGHT, (buttonMask & BTN_RIGHT_MASK) ? 1 : 0);
-			needSync = 1;
-		}
+		if ((mouseButton & BTN_RIGHT_MASK) != (buttonMask & BTN_RIGHT_MASK))
+			queueEvent(&ptrBatch, EV_KEY, BTN_RIGHT, (buttonMask & BTN_RIGHT_MASK) ? 1 : 0);
 
 		// Scroll wheel up
-		if (!(mouseButton & WHEEL_UP_MASK) && (buttonMask & WHEEL_UP_MASK)) {
-			writeEvent(virtPtr, EV_REL, REL_WHEEL, 1);
-			needSync = 1;
-		}
+		if (!(mouseButton & WHEEL_UP_MASK) && (buttonMask & WHEEL_UP_MASK))
+			queueEvent(&ptrBatch, EV_REL, REL_WHEEL, 1);
 
 		// Scroll wheel down
-		if (!(mouseButton & WHEEL_DOWN_MASK) && (buttonMask & WHEEL_DOWN_MASK)) {
-			writeEvent(virtPtr, EV_REL, REL_WHEEL, -1);
-			needSync = 1;
-		}
+		if (!(mouseButton & WHEEL_DOWN_MASK) && (buttonMask & WHEEL_DOWN_MASK))
+			queueEvent(&ptrBatch, EV_REL, REL_WHEEL, -1);
 
 		// Set the current state as the last button state
 		mouseButton = buttonMask;
+
+	// Mouse cursor events are only processed when movement occurs
+	} else if (motion) {
+
+		// Motion faster than the pointer rate is coalesced into the newest position
+		if (pointerRate > 0 && timeNow - motionTime < 1000000ULL / pointerRate) {
+			if (motionPending)
+				inputStats.coalesced++;
+			motionPending = 1;
+		} else {
+			queueEvent(&ptrBatch, EV_ABS, ABS_X, x); // X axis
+			queueEvent(&ptrBatch, EV_ABS, ABS_Y, y); // Y axis
+			motionPending = 0;
+			motionTime = timeNow;
+		}
 	}
 
 	// Synchronization
-	if (needSync) {
-		writeEvent(virtPtr, EV_SYN, SYN_REPORT, 0);
-	}
+	flushEvents(&ptrBatch);
+
+	// Publish the pointer position to the other clients (PointerPos pseudo-encoding)
+	pointerClient = cl;
+	pointerTime = timeNow;
+	pointerX = clientX;
+	pointerY = clientY;
+	rfbDefaultPtrAddEvent(buttonMask, clientX, clientY, cl);
+}
+
+void flushPointerMotion(void) {
+	uint64_t timeNow;
+
+	if (!motionPending)
+		return;
+
+	// The last coalesced position is written once the rate limit allows it
+	timeNow = getMonotonicTime();
+	if (timeNow - motionTime < 1000000ULL / pointerRate)
+		return;
+
+	queueEvent(&ptrBatch, EV_ABS, ABS_X, mouseX); // X axis
+	queueEvent(&ptrBatch, EV_ABS, ABS_Y, mouseY); // Y axis
+	flushEvents(&ptrBatch);
+
+	motionPending = 0;
+	motionTime = timeNow;
+}
+
+int getPointerFlushDelay(void) {
+	uint64_t elapsed;
+
+	if (!motionPending)
+		return -1;
+
+	// Time left until the coalesced position may be written, in ms (rounded up)
+	elapsed = getMonotonicTime() - motionTime;
+	if (elapsed >= 1000000ULL / pointerRate)
+		return 0;
+	return (1000000ULL / pointerRate - elapsed + 999) / 1000;
+}
+
+void logInputStats(void) {
+	LOG(" Input events: %llu received, %llu coalesced, %llu written in %llu writes.\n",
+		(unsigned long long)inputStats.received, (unsigned long long)inputStats.coalesced,
+		(unsigned long long)inputStats.written, (unsigned long long)inputStats.writes);
 }
@@ -6,11 +6,15 @@
 
 #include "common.h"
 #include "framebuffer.h"
+#include "keymap.h"
+#include "latency.h"
+#include "scale.h"
+#include "startup.h"
 
+#include <pthread.h>
 #include <linux/input.h>
 #include <linux/uinput.h>
-
-#include <rfb/keysym.h>
+#include <sys/uio.h>
 
 #define BTN_LEFT_MASK 0x1
 #define BTN_MIDDLE_MASK 0x2
@@ -18,13 +22,44 @@
 #define WHEEL_UP_MASK 0x8
 #define WHEEL_DOWN_MASK 0x10
 
+#define INPUT_BATCH_MAX 16 // Events of one RFB message (SYN_REPORT included)
+#define POINTER_RATE 120 // Default pointer motion rate in Hz
+
+// Events collected from one RFB message, written with a single syscall
+typedef struct {
+	int udev;
+	int count;
+	struct input_event events[INPUT_BATCH_MAX];
+} input_batch_t;
+
+// Input pipeline counters
+typedef struct {
+	uint64_t received; // RFB key and pointer messages
+	uint64_t coalesced; // Pointer motions replaced by a newer position
+	uint64_t written; // Input events written to uinput
+	uint64_t writes; // Write syscalls
+} input_stats_t;
+
+extern int pointerRate;
+extern int motionPending;
+extern input_stats_t inputStats;
+
+extern rfbClientPtr pointerClient;
+extern uint64_t pointerTime;
+extern int pointerX, pointerY;
+
 void initVirtualKeyboard(void);
 void initVirtualPointer(void);
+void initInputDevices(int keyboard, int pointer);
+void waitInputDevices(void);
 void closeVirtualKeyboard(void);
 void closeVirtualPointer(void);
-void writeEvent(int udev, uint16_t type, uint16_t code, int value);
-int keySym2Scancode(rfbKeySym key);
+void queueEvent(input_batch_t *batch, uint16_t type, uint16_t code, int value);
+void flushEvents(input_batch_t *batch);
 void addKeyboardEvent(rfbBool down, rfbKeySym key, rfbClientPtr cl);
 void addPointerEvent(int buttonMask, int x, int y, rfbClientPtr cl);
+void flushPointerMotion(void);
+int getPointerFlushDelay(void);
+void logInputStats(void);
 
 #endif
@@ -0,0 +1,350 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Keysym to scancode translation
+
+#include "keymap.h"
+
+// Path of an alternative layout map (NULL: built-in US layout)
+char *keymapFile = NULL;
+
+// Latin-1 keysyms (0x0000-0x00ff), indexed by the keysym
+static const uint16_t defaultLatinKeys[KEYMAP_PAGE_SIZE] = {
+	/* Alphabetic keys */
+	[XK_a]				= KEY_A,
+	[XK_A]				= KEY_A,
+	[XK_b]				= KEY_B,
+	[XK_B]				= KEY_B,
+	[XK_c]				= KEY_C,
+	[XK_C]				= KEY_C,
+	[XK_d]				= KEY_D,
+	[XK_D]				= KEY_D,
+	[XK_e]				= KEY_E,
+	[XK_E]				= KEY_E,
+	[XK_f]				= KEY_F,
+	[XK_F]				= KEY_F,
+	[XK_g]				= KEY_G,
+	[XK_G]				= KEY_G,
+	[XK_h]				= KEY_H,
+	[XK_H]				= KEY_H,
+	[XK_i]				= KEY_I,
+	[XK_I]				= KEY_I,
+	[XK_j]				= KEY_J,
+	[XK_J]				= KEY_J,
+	[XK_k]				= KEY_K,
+	[XK_K]				= KEY_K,
+	[XK_l]				= KEY_L,
+	[XK_L]				= KEY_L,
+	[XK_m]				= KEY_M,
+	[XK_M]				= KEY_M,
+	[XK_n]				= KEY_N,
+	[XK_N]				= KEY_N,
+	[XK_o]				= KEY_O,
+	[XK_O]				= KEY_O,
+	[XK_p]				= KEY_P,
+	[XK_P]				= KEY_P,
+	[XK_q]				= KEY_Q,
+	[XK_Q]				= KEY_Q,
+	[XK_r]				= KEY_R,
+	[XK_R]				= KEY_R,
+	[XK_s]				= KEY_S,
+	[XK_S]				= KEY_S,
+	[XK_t]				= KEY_T,
+	[XK_T]				= KEY_T,
+	[XK_u]				= KEY_U,
+	[XK_U]				= KEY_U,
+	[XK_v]				= KEY_V,
+	[XK_V]				= KEY_V,
+	[XK_w]				= KEY_W,
+	[XK_W]				= KEY_W,
+	[XK_x]				= KEY_X,
+	[XK_X]				= KEY_X,
+	[XK_y]				= KEY_Y,
+	[XK_Y]				= KEY_Y,
+	[XK_z]				= KEY_Z,
+	[XK_Z]				= KEY_Z,
+
+	/* Numeric keys */
+	[XK_1]				= KEY_1,
+	[XK_2]				= KEY_2,
+	[XK_3]				= KEY_3,
+	[XK_4]				= KEY_4,
+	[XK_5]				= KEY_5,
+	[XK_6]				= KEY_6,
+	[XK_7]				= KEY_7,
+	[XK_8]				= KEY_8,
+	[XK_9]				= KEY_9,
+	[XK_0]				= KEY_0,
+
+	/* Physical punctuation keys */
+	[XK_space]			= KEY_SPACE,
+	[XK_minus]			= KEY_MINUS,
+	[XK_equal]			= KEY_EQUAL,
+	[XK_bracketleft]		= KEY_LEFTBRACE,
+	[XK_bracketright]		= KEY_RIGHTBRACE,
+	[XK_semicolon]			= KEY_SEMICOLON,
+	[XK_apostrophe]			= KEY_APOSTROPHE,
+	[XK_grave]			= KEY_GRAVE,
+	[XK_backslash]			= KEY_BACKSLASH,
+	[XK_comma]			= KEY_COMMA,
+	[XK_period]			= KEY_DOT,
+	[XK_slash]			= KEY_SLASH,
+
+	/* Layout dependent keys - Used together with modifiers (US) */
+	[XK_exclam]			= KEY_1,
+	[XK_at]				= KEY_2,
+	[XK_numbersign]			= KEY_3,
+	[XK_dollar]			= KEY_4,
+	[XK_percent]			= KEY_5,
+	[XK_asciicircum]		= KEY_6,
+	[XK_ampersand]			= KEY_7,
+	[XK_parenleft]			= KEY_9,
+	[XK_parenright]			= KEY_0,
+	[XK_underscore]			= KEY_MINUS,
+	[XK_colon]			= KEY_SEMICOLON,
+	[XK_quotedbl]			= KEY_APOSTROPHE,
+	[XK_asciitilde]			= KEY_GRAVE,
+	[XK_bar]			= KEY_BACKSLASH,
+	[XK_less]			= KEY_COMMA,
+	[XK_greater]			= KEY_DOT,
+	[XK_question]			= KEY_SLASH,
+
+	/* Redefined keys */
+	[XK_asterisk]			= KEY_KPASTERISK,
+	[XK_plus]			= KEY_KPPLUS,
+};
+
+// Function keysyms (0xff00-0xffff), indexed by the low byte of the keysym
+static const uint16_t defaultFunctionKeys[KEYMAP_PAGE_SIZE] = {
+	/* Modifiers */
+	[XK_Shift_L & 0xff]		= KEY_LEFTSHIFT,
+	[XK_Shift_R & 0xff]		= KEY_RIGHTSHIFT,
+	[XK_Control_L & 0xff]		= KEY_LEFTCTRL,
+	[XK_Control_R & 0xff]		= KEY_RIGHTCTRL,
+	[XK_Alt_L & 0xff]		= KEY_LEFTALT,
+	[XK_Alt_R & 0xff]		= KEY_RIGHTALT,
+
+	/* System and navigation keys */
+	[XK_Escape & 0xff]		= KEY_ESC,
+	[XK_BackSpace & 0xff]		= KEY_BACKSPACE,
+	[XK_Tab & 0xff]			= KEY_TAB,
+	[XK_Return & 0xff]		= KEY_ENTER,
+	[XK_Insert & 0xff]		= KEY_INSERT,
+	[XK_Delete & 0xff]		= KEY_DELETE,
+	[XK_Home & 0xff]		= KEY_HOME,
+	[XK_Left & 0xff]		= KEY_LEFT,
+	[XK_Up & 0xff]			= KEY_UP,
+	[XK_Right & 0xff]		= KEY_RIGHT,
+	[XK_Down & 0xff]		= KEY_DOWN,
+	[XK_Page_Up & 0xff]		= KEY_PAGEUP,
+	[XK_Page_Down & 0xff]		= KEY_PAGEDOWN,
+	[XK_End & 0xff]			= KEY_END,
+
+	/* Function keys (F1-F12) */
+	[XK_F1 & 0xff]			= KEY_F1,
+	[XK_F2 & 0xff]			= KEY_F2,
+	[XK_F3 & 0xff]			= KEY_F3,
+	[XK_F4 & 0xff]			= KEY_F4,
+	[XK_F5 & 0xff]			= KEY_F5,
+	[XK_F6 & 0xff]			= KEY_F6,
+	[XK_F7 & 0xff]			= KEY_F7,
+	[XK_F8 & 0xff]			= KEY_F8,
+	[XK_F9 & 0xff]			= KEY_F9,
+	[XK_F10 & 0xff]			= KEY_F10,
+	[XK_F11 & 0xff]			= KEY_F11,
+	[XK_F12 & 0xff]			= KEY_F12,
+
+	/* Numeric keypad - Independent of server-side Num Lock state */
+	[XK_KP_Divide & 0xff]		= KEY_KPSLASH,
+	[XK_KP_Multiply & 0xff]		= KEY_KPASTERISK,
+	[XK_KP_Add & 0xff]		= KEY_KPPLUS,
+	[XK_KP_Subtract & 0xff]		= KEY_KPMINUS,
+	[XK_KP_Enter & 0xff]		= KEY_KPENTER,
+	[XK_KP_Decimal & 0xff]		= KEY_KPDOT,
+	[XK_KP_0 & 0xff]		= KEY_0,
+	[XK_KP_1 & 0xff]		= KEY_1,
+	[XK_KP_2 & 0xff]		= KEY_2,
+	[XK_KP_3 & 0xff]		= KEY_3,
+	[XK_KP_4 & 0xff]		= KEY_4,
+	[XK_KP_5 & 0xff]		= KEY_5,
+	[XK_KP_6 & 0xff]		= KEY_6,
+	[XK_KP_7 & 0xff]		= KEY_7,
+	[XK_KP_8 & 0xff]		= KEY_8,
+	[XK_KP_9 & 0xff]		= KEY_9,
+	[XK_KP_Home & 0xff]		= KEY_HOME,
+	[XK_KP_End & 0xff]		= KEY_END,
+	[XK_KP_Page_Up & 0xff]		= KEY_PAGEUP,
+	[XK_KP_Page_Down & 0xff]	= KEY_PAGEDOWN,
+	[XK_KP_Up & 0xff]		= KEY_UP,
+	[XK_KP_Down & 0xff]		= KEY_DOWN,
+	[XK_KP_Left & 0xff]		= KEY_LEFT,
+	[XK_KP_Right & 0xff]		= KEY_RIGHT,
+	[XK_KP_Insert & 0xff]		= KEY_INSERT,
+	[XK_KP_Delete & 0xff]		= KEY_DELETE,
+};
+
+// Keysyms outside of both pages, sorted by keysym
+static const keymap_entry_t defaultOtherKeys[] = {
+	{ XK_ISO_Level3_Shift,	KEY_RIGHTALT },
+};
+
+// Active translation tables
+static uint16_t latinKeys[KEYMAP_PAGE_SIZE];
+static uint16_t functionKeys[KEYMAP_PAGE_SIZE];
+static keymap_entry_t *otherKeys = NULL;
+static size_t otherCount = 0, otherSize = 0;
+
+static int compareEntry(const void *a, const void *b) {
+	const keymap_entry_t *ea = a, *eb = b;
+
+	return ea->keysym < eb->keysym ? -1 : ea->keysym > eb->keysym;
+}
+
+static void setKey(uint32_t keysym, uint16_t scancode) {
+	size_t i;
+
+	if (keysym < KEYMAP_PAGE_SIZE) {
+		latinKeys[keysym] = scancode;
+	} else if ((keysym & ~0xffU) == 0xff00) {
+		functionKeys[keysym & 0xff] = scancode;
+	} else {
+		// A keysym which is already known gets the new scancode
+		for (i = 0; i < otherCount; i++) {
+			if (otherKeys[i].keysym == keysym) {
+				otherKeys[i].scancode = scancode;
+				return;
+			}
+		}
+
+		if (otherCount == otherSize) {
+			otherSize = otherSize ? otherSize * 2 : 64;
+			otherKeys = realloc(otherKeys, otherSize * sizeof(keymap_entry_t));
+			assert(otherKeys != NULL);
+		}
+		otherKeys[otherCount].keysym = keysym;
+		otherKeys[otherCount].scancode = scancode;
+		otherCount++;
+	}
+}
+
+static int parseKeysym(const char *str, uint32_t *keysym) {
+	char *end;
+	unsigned long value;
+
+	// Unicode code point (U+XXXX) or numeric keysym (hex with 0x prefix, or decimal)
+	if (str[0] == 'U' && str[1] == '+') {
+		value = strtoul(str + 2, &end, 16);
+		if (*end || end == str + 2 || value > 0x10ffff)
+			return 0;
+		*keysym = value < 0x100 ? value : KEYMAP_UNICODE | value;
+	} else {
+		value = strtoul(str, &end, 0);
+		if (*end || end == str || value > 0x1ffffff)
+			return 0;
+		*keysym = value;
+	}
+
+	return 1;
+}
+
+static void loadKeymap(const char *path) {
+	char line[256], keysymStr[64];
+	uint32_t keysym;
+	FILE *file;
+	int lineNum = 0, count = 0, scancode;
+
+	LOG("-- Loading keymap --\n");
+
+	file = fopen(path, "r");
+	if (!file) {
+		LOGE(" Could not open keymap file '%s': %s.\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	// Format: "<keysym> <scancode>" per line, '#' starts a comment
+	while (fgets(line, sizeof(line), file)) {
+		lineNum++;
+
+		if (strchr(line, '#'))
+			*strchr(line, '#') = '\0';
+
+		if (sscanf(line, "%63s", keysymStr) != 1)
+			continue; // Empty line
+
+		if (sscanf(line, "%63s %d", keysymStr, &scancode) != 2 || !parseKeysym(keysymStr, &keysym) ||
+		    scancode < 0 || scancode >= KEY_CNT) {
+			LOGE(" Invalid keymap entry in '%s' at line %d.\n", path, lineNum);
+			exit(EXIT_FAILURE);
+		}
+
+		setKey(keysym, scancode);
+		count++;
+	}
+
+	fclose(file);
+
+	LOG(" %d keys have been loaded from '%s'.\n", count, path);
+}
+
+void initKeymap(void) {
+	size_t i;
+
+	memcpy(latinKeys, defaultLatinKeys, sizeof(latinKeys));
+	memcpy(functionKeys, defaultFunctionKeys, sizeof(functionKeys));
+
+	otherCount = 0;
+	for (i = 0; i < sizeof(defaultOtherKeys) / sizeof(defaultOtherKeys[0]); i++)
+		setKey(defaultOtherKeys[i].keysym, defaultOtherKeys[i].scancode);
+
+	// Entries of the layout map override the built-in US layout
+	if (keymapFile)
+		loadKeymap(keymapFile);
+
+	// Sort the remaining keysyms for binary search
+	qsort(otherKeys, otherCount, sizeof(keymap_entry_t), compareEntry);
+}
+
+void closeKeymap(void) {
+	free(otherKeys);
+	otherKeys = NULL;
+	otherCount = otherSize = 0;
+}
+
+void getKeymapKeyBits(uint8_t *bits) {
+	size_t i;
+
+	// Only scancodes which the active tables can produce are announced by the keyboard
+	memset(bits, 0, KEYMAP_KEYBITS_SIZE);
+	for (i = 0; i < KEYMAP_PAGE_SIZE; i++) {
+		bits[latinKeys[i] / CHAR_BIT] |= 1 << (latinKeys[i] % CHAR_BIT);
+		bits[functionKeys[i] / CHAR_BIT] |= 1 << (functionKeys[i] % CHAR_BIT);
+	}
+	for (i = 0; i < otherCount; i++)
+		bits[otherKeys[i].scancode / CHAR_BIT] |= 1 << (otherKeys[i].scancode % CHAR_BIT);
+
+	// Unmapped keysyms translate to 0 (KEY_RESERVED), which is not announced
+	bits[0] &= ~1;
+}
+
+int keySym2Scancode(rfbKeySym key) {
+	// LOG(" DEBUG -> Keyboard keysym key: %04X.\n", key);
+
+	size_t low = 0, high = otherCount, mid;
+
+	// Direct lookup for the Latin-1 and function key pages
+	if (key < KEYMAP_PAGE_SIZE)
+		return latinKeys[key];
+	if ((key & ~0xffU) == 0xff00)
+		return functionKeys[key & 0xff];
+
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (otherKeys[mid].keysym == key)
+			return otherKeys[mid].scancode;
+		if (otherKeys[mid].keysym < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	/* Unhandled keys */
+	return 0;
+}
@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for keysym to scancode translation
+
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+#include "common.h"
+
+#include <rfb/keysym.h>
+
+#define KEYMAP_PAGE_SIZE 256
+#define KEYMAP_UNICODE 0x01000000 // Unicode keysym offset (U+XXXX)
+#define KEYMAP_KEYBITS_SIZE ((KEY_CNT + CHAR_BIT - 1) / CHAR_BIT)
+
+typedef struct {
+	uint32_t keysym;
+	uint16_t scancode;
+} keymap_entry_t;
+
+extern char *keymapFile;
+
+void initKeymap(void);
+void closeKeymap(void);
+void getKeymapKeyBits(uint8_t *bits);
+int keySym2Scancode(rfbKeySym key);
+
+#endif
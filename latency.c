@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Input-to-screen latency measurement
+
+#include "latency.h"
+#include "client.h"
+#include "updatescreen.h"
+
+static void addSample(latency_histogram_t *histogram, uint64_t time) {
+	uint64_t bucket = time / 1000;
+
+	histogram->buckets[MIN(bucket, LATENCY_BUCKETS - 1)]++;
+	histogram->count++;
+}
+
+void latencyInput(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+
+	// Only the oldest input event is timed until the screen answers it
+	if (info && !info->latency.inputTime)
+		info->latency.inputTime = getMonotonicTime();
+}
+
+void latencyScreenChange(void) {
+	rfbClientIteratorPtr iterator;
+	rfbClientPtr cl;
+	client_info_t *info;
+	uint64_t timeNow = getMonotonicTime();
+
+	iterator = rfbGetClientIterator(vncScreen);
+	while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+		info = cl->clientData;
+		if (!info || !info->latency.inputTime || info->latency.changeTime)
+			continue;
+
+		// Input without any visible effect (e.g. a modifier key) is not measured
+		if (timeNow - info->latency.inputTime > LATENCY_TIMEOUT * 1000ULL) {
+			info->latency.inputTime = 0;
+			continue;
+		}
+
+		info->latency.changeTime = timeNow;
+		addSample(&info->latency.detect, timeNow - info->latency.inputTime);
+	}
+	rfbReleaseClientIterator(iterator);
+}
+
+void latencyUpdateSent(rfbClientPtr cl, int result) {
+	client_info_t *info = cl->clientData;
+
+	if (!info || !info->latency.changeTime || !result)
+		return;
+
+	addSample(&info->latency.flush, getMonotonicTime() - info->latency.inputTime);
+	info->latency.inputTime = 0;
+	info->latency.changeTime = 0;
+}
+
+void latencyRoundTrip(rfbClientPtr cl, uint64_t time) {
+	client_info_t *info = cl->clientData;
+
+	if (info)
+		addSample(&info->latency.roundTrip, time);
+}
+
+int latencyPercentile(const latency_histogram_t *histogram, int percent) {
+	uint64_t target, sum = 0;
+	int i;
+
+	if (!histogram->count)
+		return -1;
+
+	target = (histogram->count * percent + 99) / 100;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		sum += histogram->buckets[i];
+		if (sum >= target)
+			break;
+	}
+
+	// Upper bound of the bucket in ms
+	return i + 1;
+}
+
+static void logHistogram(int session, const char *name, const latency_histogram_t *histogram) {
+	if (!histogram->count) {
+		LOGR(" [%d] %s latency: no samples.\n", session, name);
+		return;
+	}
+
+	LOGR(" [%d] %s latency: p50 %d ms, p95 %d ms, p99 %d ms (%llu samples).\n", session, name,
+		latencyPercentile(histogram, 50), latencyPercentile(histogram, 95),
+		latencyPercentile(histogram, 99), (unsigned long long)histogram->count);
+}
+
+void logLatency(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+
+	if (!info || info->recorder)
+		return;
+
+	logHistogram(info->session, "Input to change", &info->latency.detect);
+	logHistogram(info->session, "Input to update", &info->latency.flush);
+	if (info->latency.roundTrip.count)
+		logHistogram(info->session, "Fence round trip", &info->latency.roundTrip);
+}
+
+void logLatencyReport(void) {
+	rfbClientIteratorPtr iterator;
+	rfbClientPtr cl;
+
+	LOGR("-- Input latency report --\n");
+
+	iterator = rfbGetClientIterator(vncScreen);
+	while ((cl = rfbClientIteratorNext(iterator)) != NULL)
+		logLatency(cl);
+	rfbReleaseClientIterator(iterator);
+}
@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for input-to-screen latency measurement
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "common.h"
+
+#define LATENCY_BUCKETS 1024 // 1 ms buckets, the last one also collects slower samples
+#define LATENCY_TIMEOUT 2000 // Input without a visible screen change is dropped after this in ms
+
+typedef struct {
+	uint32_t buckets[LATENCY_BUCKETS];
+	uint64_t count;
+} latency_histogram_t;
+
+typedef struct {
+	uint64_t inputTime; // Oldest unanswered input event (0: none)
+	uint64_t changeTime; // First screen change detected after it (0: none)
+	latency_histogram_t detect; // Input to change detection in updateScreen()
+	latency_histogram_t flush; // Input to framebuffer update written to the socket
+	latency_histogram_t roundTrip; // Fence round trips of the pushed updates
+} latency_state_t;
+
+
+void latencyInput(rfbClientPtr cl);
+void latencyScreenChange(void);
+void latencyUpdateSent(rfbClientPtr cl, int result);
+void latencyRoundTrip(rfbClientPtr cl, uint64_t time);
+int latencyPercentile(const latency_histogram_t *histogram, int percent);
+void logLatency(rfbClientPtr cl);
+void logLatencyReport(void);
+
+#endif
@@ -0,0 +1,283 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Asynchronous, rate limited logger
+
+#include "common.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+typedef struct {
+	uint64_t sequence; // Ring position this slot is free (== position) or filled (== position + 1) for
+	uint64_t time;
+	int level;
+	char *longText;
+	char text[LOG_LINE];
+} log_slot_t;
+
+int logLevel = LOGLEVEL_INFO;
+
+static log_slot_t logSlots[LOG_SLOTS];
+static uint64_t logHead = 0, logTail = 0;
+static uint64_t logDropped = 0;
+static pthread_t logThread;
+static int logRunning = 0;
+static int logExit = 0;
+
+// The writer sleeps on the futex word while the ring is empty, the next message wakes it
+static uint32_t logWake = 0;
+static int logSleeping = 0;
+
+// Call sites which suppressed messages (a push-only list, the sites are static)
+static log_site_t *suppressedSites = NULL;
+
+static const char *levelTags[] = {
+	[LOGLEVEL_ERROR]	= " error:",
+	[LOGLEVEL_WARN]		= " warning:",
+	[LOGLEVEL_INFO]		= "",
+	[LOGLEVEL_DEBUG]	= " debug:",
+};
+
+static void writeLine(int level, uint64_t time, const char *text) {
+	fprintf(stderr, "[%llu.%06llu]%s%s", (unsigned long long)(time / 1000000),
+		(unsigned long long)(time % 1000000), levelTags[level], text);
+}
+
+static void wakeWriter(void) {
+	// Pairs with the sleep flag of the writer, either it sees the message or the message sees it sleeping
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&logSleeping, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_add_fetch(&logWake, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &logWake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void waitForMessage(const log_slot_t *slot, uint64_t position, int timed) {
+	struct timespec timeout = { LOG_WINDOW / 1000, (LOG_WINDOW % 1000) * 1000000 };
+	uint32_t wake = __atomic_load_n(&logWake, __ATOMIC_ACQUIRE);
+
+	__atomic_store_n(&logSleeping, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) != position + 1 && !__atomic_load_n(&logExit, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &logWake, FUTEX_WAIT_PRIVATE, wake, timed ? &timeout : NULL, NULL, 0);
+	__atomic_store_n(&logSleeping, 0, __ATOMIC_RELAXED);
+}
+
+static void lockText(log_site_t *site) {
+	while (__atomic_test_and_set(&site->textLock, __ATOMIC_ACQUIRE));
+}
+
+static void unlockText(log_site_t *site) {
+	__atomic_clear(&site->textLock, __ATOMIC_RELEASE);
+}
+
+// Reports the messages suppressed in a finished window, even if the call site stays silent afterwards (1: some window still runs)
+static int flushSuppressed(void) {
+	uint64_t timeNow = getMonotonicTime(), suppressed;
+	char text[LOG_LINE + 64];
+	log_site_t *site;
+	int pending = 0;
+
+	for (site = __atomic_load_n(&suppressedSites, __ATOMIC_ACQUIRE); site; site = site->next) {
+		if (!__atomic_load_n(&site->suppressed, __ATOMIC_RELAXED))
+			continue;
+
+		if (timeNow - __atomic_load_n(&site->windowStart, __ATOMIC_RELAXED) < LOG_WINDOW * 1000ULL) {
+			pending = 1;
+			continue;
+		}
+
+		suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+		if (suppressed) {
+			lockText(site);
+			snprintf(text, sizeof(text), " %llu more messages were suppressed, the last one:%s", (unsigned long long)suppressed, site->text);
+			unlockText(site);
+			writeLine(LOGLEVEL_WARN, timeNow, text);
+		}
+	}
+
+	return pending;
+}
+
+static void *logWriter(void *arg) {
+	log_slot_t *slot;
+	uint64_t dropped;
+
+	for (;;) {
+		slot = &logSlots[logTail & (LOG_SLOTS - 1)];
+
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != logTail + 1) {
+			// Empty ring, the exit is only taken after everything was written
+			if (__atomic_load_n(&logExit, __ATOMIC_ACQUIRE) &&
+			    __atomic_load_n(&logHead, __ATOMIC_ACQUIRE) == logTail) {
+				flushSuppressed();
+				break;
+			}
+			waitForMessage(slot, logTail, flushSuppressed());
+			continue;
+		}
+
+		writeLine(slot->level, slot->time, slot->longText ? slot->longText : slot->text);
+		free(slot->longText);
+		slot->longText = NULL;
+
+		// Release the slot for the next round of the ring
+		__atomic_store_n(&slot->sequence, logTail + LOG_SLOTS, __ATOMIC_RELEASE);
+		logTail++;
+
+		dropped = __atomic_exchange_n(&logDropped, 0, __ATOMIC_RELAXED);
+		if (dropped) {
+			char text[64];
+			snprintf(text, sizeof(text), " %llu log messages were dropped.\n", (unsigned long long)dropped);
+			writeLine(LOGLEVEL_WARN, getMonotonicTime(), text);
+		}
+	}
+
+	return NULL;
+}
+
+static void enqueue(int level, uint64_t time, const char *fmt, va_list args) {
+	log_slot_t *slot;
+	uint64_t position;
+	va_list copy;
+	int length;
+
+	// Before the writer thread runs (and after it stopped) messages are written directly
+	if (!__atomic_load_n(&logRunning, __ATOMIC_ACQUIRE)) {
+		char text[LOG_LINE];
+		va_copy(copy, args);
+		length = vsnprintf(text, sizeof(text), fmt, copy);
+		va_end(copy);
+		if (length >= LOG_LINE) {
+			fprintf(stderr, "[%llu.%06llu]%s", (unsigned long long)(time / 1000000),
+				(unsigned long long)(time % 1000000), levelTags[level]);
+			vfprintf(stderr, fmt, args);
+		} else {
+			writeLine(level, time, text);
+		}
+		return;
+	}
+
+	// Claim a free slot (bounded multi-producer queue), a full ring drops the message
+	position = __atomic_load_n(&logHead, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &logSlots[position & (LOG_SLOTS - 1)];
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position) {
+			__atomic_fetch_add(&logDropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		if (__atomic_compare_exchange_n(&logHead, &position, position + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+
+	slot->level = level;
+	slot->time = time;
+	slot->longText = NULL;
+
+	va_copy(copy, args);
+	length = vsnprintf(slot->text, sizeof(slot->text), fmt, copy);
+	va_end(copy);
+	if (length >= LOG_LINE) {
+		slot->longText = malloc(length + 1);
+		if (slot->longText)
+			vsnprintf(slot->longText, length + 1, fmt, args);
+	}
+
+	__atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+	wakeWriter();
+}
+
+static void enqueuef(int level, uint64_t time, const char *fmt, ...) {
+	va_list args;
+
+	va_start(args, fmt);
+	enqueue(level, time, fmt, args);
+	va_end(args);
+}
+
+// Call sites are shared by all threads, only the thread which starts a new window resets it (1: suppressed)
+static int rateLimit(log_site_t *site, uint64_t timeNow, const char *fmt, va_list args) {
+	uint64_t windowStart = __atomic_load_n(&site->windowStart, __ATOMIC_RELAXED), suppressed;
+	va_list copy;
+
+	if (timeNow - windowStart >= LOG_WINDOW * 1000ULL &&
+	    __atomic_compare_exchange_n(&site->windowStart, &windowStart, timeNow, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+
+		// A new window reports the messages suppressed in the previous one (unless the writer did)
+		suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+		if (suppressed)
+			enqueuef(LOGLEVEL_WARN, timeNow, " The following message was suppressed %llu times.\n", (unsigned long long)suppressed);
+	}
+
+	if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) < LOG_BURST)
+		return 0;
+
+	// The summary shows the last suppressed message (a cut one keeps its line end)
+	lockText(site);
+	va_copy(copy, args);
+	if (vsnprintf(site->text, sizeof(site->text), fmt, copy) >= LOG_LINE)
+		site->text[LOG_LINE - 2] = '\n';
+	va_end(copy);
+	unlockText(site);
+
+	if (!__atomic_exchange_n(&site->listed, 1, __ATOMIC_RELAXED)) {
+		site->next = __atomic_load_n(&suppressedSites, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&suppressedSites, &site->next, site, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	// The writer reports the count once the window is over
+	if (!__atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED))
+		wakeWriter();
+	return 1;
+}
+
+void logWrite(log_site_t *site, int level, const char *fmt, ...) {
+	uint64_t timeNow;
+	va_list args;
+
+	if (level > logLevel)
+		return;
+
+	timeNow = getMonotonicTime();
+	va_start(args, fmt);
+	if (!site || !rateLimit(site, timeNow, fmt, args))
+		enqueue(level, timeNow, fmt, args);
+	va_end(args);
+}
+
+void initLog(void) {
+	const char *level = getenv("VNC_LOGLEVEL");
+	int i;
+
+	if (level) {
+		if (!strcasecmp(level, "error"))
+			logLevel = LOGLEVEL_ERROR;
+		else if (!strcasecmp(level, "warn"))
+			logLevel = LOGLEVEL_WARN;
+		else if (!strcasecmp(level, "debug"))
+			logLevel = LOGLEVEL_DEBUG;
+	}
+
+	for (i = 0; i < LOG_SLOTS; i++)
+		logSlots[i].sequence = i;
+
+	if (pthread_create(&logThread, NULL, logWriter, NULL) != 0)
+		return; // Messages stay synchronous
+
+	__atomic_store_n(&logRunning, 1, __ATOMIC_RELEASE);
+
+	// Fatal paths call exit(), the queued messages are written before the process ends
+	atexit(closeLog);
+}
+
+void closeLog(void) {
+	if (!__atomic_load_n(&logRunning, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&logRunning, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&logExit, 1, __ATOMIC_SEQ_CST);
+	wakeWriter();
+	pthread_join(logThread, NULL);
+}
@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for the asynchronous logger
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+#define LOG_SLOTS 256 // Ring buffer size (power of two)
+#define LOG_LINE 256 // Longer messages are stored on the heap
+#define LOG_BURST 10 // Messages per site and window
+#define LOG_WINDOW 1000 // Rate limit window in ms
+
+enum {
+	LOGLEVEL_ERROR,
+	LOGLEVEL_WARN,
+	LOGLEVEL_INFO,
+	LOGLEVEL_DEBUG
+};
+
+// Rate limit state of one LOG() call site (updated atomically by every thread)
+typedef struct log_site {
+	uint64_t windowStart;
+	uint32_t count;
+	uint64_t suppressed;
+	int listed; // On the list of the writer, which reports suppressed messages
+	char textLock; // Spin lock of the text (only held while it is copied)
+	char text[LOG_LINE]; // Last suppressed message, formatted
+	struct log_site *next;
+} log_site_t;
+
+extern int logLevel;
+
+#define LOG_AT(level, fmt, ...) do { \
+	static log_site_t logSite; \
+	logWrite(&logSite, level, fmt, ##__VA_ARGS__); \
+} while (0)
+
+#define LOG(fmt, ...) LOG_AT(LOGLEVEL_INFO, fmt, ##__VA_ARGS__)
+#define LOGE(fmt, ...) LOG_AT(LOGLEVEL_ERROR, fmt, ##__VA_ARGS__)
+#define LOGW(fmt, ...) LOG_AT(LOGLEVEL_WARN, fmt, ##__VA_ARGS__)
+#define LOGD(fmt, ...) LOG_AT(LOGLEVEL_DEBUG, fmt, ##__VA_ARGS__)
+
+// Lines of reports and startup output, which are never rate limited
+#define LOGR(fmt, ...) logWrite(NULL, LOGLEVEL_INFO, fmt, ##__VA_ARGS__)
+
+void initLog(void);
+void logWrite(log_site_t *site, int level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void closeLog(void);
+
+#endif
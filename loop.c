@@ -0,0 +1,203 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Event loop (epoll with timerfd frame pacing and signalfd)
+
+#include "loop.h"
+#include "client.h"
+#include "framebuffer.h"
+#include "metrics.h"
+#include "unixsock.h"
+#include "updatescreen.h"
+
+// A registered file descriptor (the key makes reused descriptor numbers distinguishable)
+typedef struct {
+	int fd;
+	int key;
+	int type;
+} event_source_t;
+
+// A list of sources, grown as clients connect
+typedef struct {
+	event_source_t *items;
+	int count;
+	int size;
+} source_list_t;
+
+static int epollFd = -1, timerFd = -1, signalFd = -1;
+static source_list_t sources, wanted;
+
+static void addSource(int fd, int type) {
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u32 = type;
+
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0 && errno != EEXIST)
+		LOGE(" Could not watch file descriptor %d: %s.\n", fd, strerror(errno));
+}
+
+void initEventLoop(void) {
+	sigset_t signals;
+
+	// Signals are only delivered through the signalfd (every thread inherits the mask)
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (epollFd < 0 || timerFd < 0 || signalFd < 0) {
+		LOGE(" Could not create the event loop: %s.\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	addSource(timerFd, SOURCE_TIMER);
+	addSource(signalFd, SOURCE_SIGNAL);
+}
+
+void closeEventLoop(void) {
+	close(signalFd);
+	close(timerFd);
+	close(epollFd);
+	signalFd = timerFd = epollFd = -1;
+
+	free(sources.items);
+	free(wanted.items);
+	memset(&sources, 0, sizeof(sources));
+	memset(&wanted, 0, sizeof(wanted));
+}
+
+static int findSource(const source_list_t *list, int fd, int key) {
+	int i;
+
+	for (i = 0; i < list->count; i++) {
+		if (list->items[i].fd == fd && list->items[i].key == key)
+			return i;
+	}
+
+	return -1;
+}
+
+static void wantSource(source_list_t *list, int fd, int key, int type) {
+	if (fd < 0)
+		return;
+
+	// Every client is watched, however many are connected
+	if (list->count == list->size) {
+		list->size = list->size ? list->size * 2 : LOOP_SOURCES;
+		list->items = realloc(list->items, list->size * sizeof(event_source_t));
+		assert(list->items != NULL);
+	}
+
+	list->items[list->count].fd = fd;
+	list->items[list->count].key = key;
+	list->items[list->count].type = type;
+	list->count++;
+}
+
+void syncEventSources(void) {
+	rfbClientIteratorPtr iterator;
+	rfbClientPtr cl;
+	client_info_t *info;
+	source_list_t swap;
+	int i;
+
+	wanted.count = 0;
+
+	// Listening sockets and the metrics socket use key 0, the backend its generation, clients their session
+	// and waiting metrics connections a serial number
+	wantSource(&wanted, vncScreen->listenSock, 0, SOURCE_SOCKET);
+	wantSource(&wanted, vncScreen->listen6Sock, 0, SOURCE_SOCKET);
+	wantSource(&wanted, unixSocket, 0, SOURCE_SOCKET);
+	wantSource(&wanted, metricsSock, 0, SOURCE_SOCKET);
+	for (i = 0; metricsSock >= 0 && i < METRICS_MAX_CONNS; i++)
+		wantSource(&wanted, metricsConns[i].fd, metricsConns[i].key, SOURCE_SOCKET);
+	wantSource(&wanted, getFrameEventFd(), frameBufferGeneration, SOURCE_FRAME);
+
+	iterator = rfbGetClientIterator(vncScreen);
+	while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+		info = cl->clientData;
+		wantSource(&wanted, cl->sock, info ? info->session : -1, SOURCE_SOCKET);
+	}
+	rfbReleaseClientIterator(iterator);
+
+	// Closed descriptors already left the epoll set, a failing removal is expected then
+	for (i = 0; i < sources.count; i++) {
+		if (findSource(&wanted, sources.items[i].fd, sources.items[i].key) < 0)
+			epoll_ctl(epollFd, EPOLL_CTL_DEL, sources.items[i].fd, NULL);
+	}
+
+	for (i = 0; i < wanted.count; i++) {
+		if (findSource(&sources, wanted.items[i].fd, wanted.items[i].key) < 0) {
+			// A reused descriptor number of a gone client is still registered
+			epoll_ctl(epollFd, EPOLL_CTL_DEL, wanted.items[i].fd, NULL);
+			addSource(wanted.items[i].fd, wanted.items[i].type);
+		}
+	}
+
+	// The wanted list becomes the registered one, its storage is reused by the next call
+	swap = sources;
+	sources = wanted;
+	wanted = swap;
+}
+
+void resetEventSources(void) {
+	int i;
+
+	// Every descriptor may be reopened with the same number after a reinit
+	for (i = 0; i < sources.count; i++)
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, sources.items[i].fd, NULL);
+	sources.count = 0;
+}
+
+void armFrameTimer(uint64_t deadline) {
+	struct itimerspec timer;
+
+	// Absolute monotonic deadline in us (0 disarms the timer)
+	memset(&timer, 0, sizeof(timer));
+	timer.it_value.tv_sec = deadline / 1000000;
+	timer.it_value.tv_nsec = (deadline % 1000000) * 1000;
+	timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+int waitEvents(int timeout) {
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	struct signalfd_siginfo signal;
+	uint64_t expirations;
+	int count, result = 0, i;
+
+	count = epoll_wait(epollFd, events, LOOP_MAX_EVENTS, timeout);
+	if (count < 0 && errno != EINTR)
+		LOGE(" Event loop wait failed: %s.\n", strerror(errno));
+
+	for (i = 0; i < count; i++) {
+		switch (events[i].data.u32) {
+		case SOURCE_SOCKET:
+			result |= EVENT_SOCKET;
+			break;
+		case SOURCE_TIMER:
+			if (read(timerFd, &expirations, sizeof(expirations)) > 0)
+				result |= EVENT_TIMER;
+			break;
+		case SOURCE_FRAME:
+			result |= EVENT_FRAME;
+			break;
+		case SOURCE_SIGNAL:
+			while (read(signalFd, &signal, sizeof(signal)) == sizeof(signal)) {
+				if (signal.ssi_signo == SIGUSR1)
+					result |= EVENT_REPORT;
+				else if (signal.ssi_signo == SIGUSR2)
+					result |= EVENT_DUMP;
+				else
+					result |= EVENT_STOP;
+			}
+			break;
+		}
+	}
+
+	return result;
+}
@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for the event loop
+
+#ifndef LOOP_H
+#define LOOP_H
+
+#include "common.h"
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#define LOOP_MAX_EVENTS 16
+#define LOOP_SOURCES 64 // Initial size of the source lists
+
+// Event source types (epoll data)
+enum {
+	SOURCE_SOCKET,
+	SOURCE_TIMER,
+	SOURCE_SIGNAL,
+	SOURCE_FRAME
+};
+
+// Results of waitEvents()
+#define EVENT_SOCKET	0x01 // RFB or metrics socket readable
+#define EVENT_TIMER	0x02 // Frame deadline reached
+#define EVENT_FRAME	0x04 // Backend frame event (vertical blank)
+#define EVENT_STOP	0x08 // SIGINT or SIGTERM
+#define EVENT_REPORT	0x10 // SIGUSR1
+#define EVENT_DUMP	0x20 // SIGUSR2
+
+void initEventLoop(void);
+void closeEventLoop(void);
+void syncEventSources(void);
+void resetEventSources(void);
+void armFrameTimer(uint64_t deadline);
+int waitEvents(int timeout);
+
+#endif
@@ -0,0 +1,533 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Metrics endpoint (Prometheus text format on a Unix socket)
+
+#define _GNU_SOURCE // accept4()
+
+#include "metrics.h"
+#include "client.h"
+#include "input.h"
+#include "loop.h"
+#include "bufferpool.h"
+#include "snapshot.h"
+#include "updatescreen.h"
+
+#define METRICS_TIMEOUT 100 // Time for a request to arrive and for a scrape to be sent in ms
+
+// A response of the responder thread, a snapshot is encoded there first
+typedef struct metrics_response {
+	struct metrics_response *next;
+	int conn;
+	const char *status;
+	const char *type;
+	char *body;
+	size_t bodySize;
+	int timeout; // Send timeout in ms
+	uint8_t *frame; // Screen buffer copy of a snapshot (NULL: the body is ready)
+	screen_format_t frameFormat;
+	int format, scale, quality;
+} metrics_response_t;
+
+server_metrics_t metrics;
+char *metricsPath = NULL;
+
+int metricsSock = -1;
+metrics_conn_t metricsConns[METRICS_MAX_CONNS];
+static unsigned int connSerial = 0;
+
+// Sending (and encoding) never blocks the main loop
+static pthread_mutex_t responseLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t responseCond = PTHREAD_COND_INITIALIZER;
+static metrics_response_t *responseHead = NULL, *responseTail = NULL;
+static pthread_t responderThread;
+static int responderRunning = 0, responderExit = 0;
+static int snapshotBusy = 0; // A snapshot is queued or encoded (protected by the lock)
+
+static void *respond(void *arg);
+
+static const char *reinitCauseNames[REINIT_CAUSES] = {
+	[REINIT_STATE_LOST]	= "state_lost",
+	[REINIT_NO_FRAMEBUFFER]	= "no_framebuffer",
+	[REINIT_SCAN_MODE]	= "scan_mode",
+	[REINIT_REFRESH_RATE]	= "refresh_rate",
+	[REINIT_PIXEL_FORMAT]	= "pixel_format",
+	[REINIT_COLOR_GROUP]	= "color_group",
+	[REINIT_MODIFIER]	= "modifier",
+	[REINIT_MULTI_BUFFER]	= "multi_buffer",
+	[REINIT_BUFFER_COUNT]	= "buffer_count",
+	[REINIT_MAP_FAILED]	= "map_failed",
+	[REINIT_RESOLUTION]	= "resolution",
+	[REINIT_BUFFER_SIZE]	= "buffer_size",
+	[REINIT_DESKTOP_SIZE]	= "desktop_size",
+};
+
+void initMetrics(void) {
+	struct sockaddr_un addr;
+	int i;
+
+	if (!metricsPath)
+		return;
+
+	LOG("-- Initializing metrics endpoint --\n");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(metricsPath) >= sizeof(addr.sun_path)) {
+		LOG(" Metrics socket path is too long: %s.\n", metricsPath);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, metricsPath);
+
+	metricsSock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (metricsSock < 0) {
+		LOGE(" Could not create metrics socket: %s.\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	// A socket left behind by a previous instance is replaced
+	unlink(metricsPath);
+	if (bind(metricsSock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(metricsSock, 4) < 0) {
+		LOGE(" Could not listen on metrics socket '%s': %s.\n", metricsPath, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < METRICS_MAX_CONNS; i++)
+		metricsConns[i].fd = -1;
+
+	if (pthread_create(&responderThread, NULL, respond, NULL) != 0) {
+		LOGE(" Could not start the metrics responder thread.\n");
+		exit(EXIT_FAILURE);
+	}
+	responderRunning = 1;
+
+	LOG(" Metrics are served on '%s'.\n", metricsPath);
+}
+
+// The int statistics of libvncserver wrap, their 32-bit differences are added up (every update and scrape)
+void metricsClientBytes(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+	uint32_t sent, received;
+
+	if (!info)
+		return;
+
+	sent = rfbStatGetSentBytes(cl);
+	received = rfbStatGetRcvdBytes(cl);
+	info->sentBytes += sent - info->lastSentStat;
+	info->receivedBytes += received - info->lastReceivedStat;
+	info->lastSentStat = sent;
+	info->lastReceivedStat = received;
+}
+
+// Connected clients with their state (the internal recording client is left out)
+static rfbClientPtr nextMetricsClient(rfbClientIteratorPtr iterator) {
+	rfbClientPtr cl;
+	client_info_t *info;
+
+	while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+		info = cl->clientData;
+		if (info && !info->recorder)
+			return cl;
+	}
+
+	return NULL;
+}
+
+static void writeMetrics(FILE *out) {
+	rfbClientIteratorPtr iterator;
+	rfbClientPtr cl;
+	client_info_t *info;
+	char encoding[64];
+	int i;
+
+	fprintf(out, "# TYPE aml_vnc_frames_total counter\n");
+	fprintf(out, "aml_vnc_frames_total %llu\n", (unsigned long long)metrics.frames);
+	fprintf(out, "# TYPE aml_vnc_changed_frames_total counter\n");
+	fprintf(out, "aml_vnc_changed_frames_total %llu\n", (unsigned long long)metrics.changedFrames);
+
+	fprintf(out, "# TYPE aml_vnc_captured_pixels_total counter\n");
+	fprintf(out, "aml_vnc_captured_pixels_total %llu\n", (unsigned long long)metrics.capturedPixels);
+	fprintf(out, "# TYPE aml_vnc_dirty_pixels_total counter\n");
+	fprintf(out, "aml_vnc_dirty_pixels_total %llu\n", (unsigned long long)metrics.dirtyPixels);
+
+	fprintf(out, "# TYPE aml_vnc_translated_pixels_total counter\n");
+	fprintf(out, "aml_vnc_translated_pixels_total %llu\n", (unsigned long long)metrics.translatedPixels);
+
+	fprintf(out, "# TYPE aml_vnc_video_tiles gauge\n");
+	fprintf(out, "aml_vnc_video_tiles %d\n", videoTileCount);
+	fprintf(out, "# TYPE aml_vnc_video_updates_total counter\n");
+	fprintf(out, "aml_vnc_video_updates_total %llu\n", (unsigned long long)metrics.videoUpdates);
+	fprintf(out, "# TYPE aml_vnc_h264_frames_total counter\n");
+	fprintf(out, "aml_vnc_h264_frames_total %llu\n", (unsigned long long)metrics.h264Frames);
+	fprintf(out, "# TYPE aml_vnc_h264_bytes_total counter\n");
+	fprintf(out, "aml_vnc_h264_bytes_total %llu\n", (unsigned long long)metrics.h264Bytes);
+	fprintf(out, "# TYPE aml_vnc_record_dropped_total counter\n");
+	fprintf(out, "aml_vnc_record_dropped_total %llu\n", (unsigned long long)metrics.recordDrops);
+	fprintf(out, "# TYPE aml_vnc_record_bytes_total counter\n");
+	fprintf(out, "aml_vnc_record_bytes_total %llu\n", (unsigned long long)metrics.recordBytes);
+
+	fprintf(out, "# TYPE aml_vnc_time_seconds_total counter\n");
+	fprintf(out, "aml_vnc_time_seconds_total{stage=\"update_screen\"} %.6f\n", metrics.updateTime / 1e6);
+	fprintf(out, "aml_vnc_time_seconds_total{stage=\"check_state\"} %.6f\n", metrics.stateCheckTime / 1e6);
+	fprintf(out, "aml_vnc_time_seconds_total{stage=\"process_events\"} %.6f\n", metrics.eventTime / 1e6);
+
+	fprintf(out, "# TYPE aml_vnc_reinits_total counter\n");
+	fprintf(out, "aml_vnc_reinits_total{type=\"soft\"} %llu\n", (unsigned long long)metrics.softReinits);
+	fprintf(out, "aml_vnc_reinits_total{type=\"hard\"} %llu\n", (unsigned long long)metrics.hardReinits);
+	fprintf(out, "# TYPE aml_vnc_reinit_causes_total counter\n");
+	for (i = 0; i < REINIT_CAUSES; i++)
+		fprintf(out, "aml_vnc_reinit_causes_total{cause=\"%s\"} %llu\n", reinitCauseNames[i], (unsigned long long)metrics.reinitCauses[i]);
+
+	fprintf(out, "# TYPE aml_vnc_buffer_bytes gauge\n");
+	fprintf(out, "aml_vnc_buffer_bytes{state=\"mapped\"} %llu\n", (unsigned long long)poolStats.mapped);
+	fprintf(out, "aml_vnc_buffer_bytes{state=\"in_use\"} %llu\n", (unsigned long long)poolStats.inUse);
+	fprintf(out, "# TYPE aml_vnc_buffer_peak_bytes gauge\n");
+	fprintf(out, "aml_vnc_buffer_peak_bytes %llu\n", (unsigned long long)poolStats.peak);
+	fprintf(out, "# TYPE aml_vnc_buffer_reuses_total counter\n");
+	fprintf(out, "aml_vnc_buffer_reuses_total %llu\n", (unsigned long long)poolStats.reused);
+
+	fprintf(out, "# TYPE aml_vnc_input_messages_total counter\n");
+	fprintf(out, "aml_vnc_input_messages_total %llu\n", (unsigned long long)inputStats.received);
+	fprintf(out, "# TYPE aml_vnc_input_coalesced_total counter\n");
+	fprintf(out, "aml_vnc_input_coalesced_total %llu\n", (unsigned long long)inputStats.coalesced);
+	fprintf(out, "# TYPE aml_vnc_input_events_written_total counter\n");
+	fprintf(out, "aml_vnc_input_events_written_total %llu\n", (unsigned long long)inputStats.written);
+	fprintf(out, "# TYPE aml_vnc_input_writes_total counter\n");
+	fprintf(out, "aml_vnc_input_writes_total %llu\n", (unsigned long long)inputStats.writes);
+	fprintf(out, "# TYPE aml_vnc_input_pending_motion gauge\n");
+	fprintf(out, "aml_vnc_input_pending_motion %d\n", motionPending);
+
+	// Every family is one group: its TYPE line, then the samples of all clients
+	i = 0;
+	iterator = rfbGetClientIterator(vncScreen);
+	while ((cl = nextMetricsClient(iterator)) != NULL) {
+		metricsClientBytes(cl);
+		i++;
+	}
+	rfbReleaseClientIterator(iterator);
+	fprintf(out, "# TYPE aml_vnc_clients gauge\n");
+	fprintf(out, "aml_vnc_clients %d\n", i);
+
+	fprintf(out, "# TYPE aml_vnc_client_sent_bytes_total counter\n");
+	iterator = rfbGetClientIterator(vncScreen);
+	while ((cl = nextMetricsClient(iterator)) != NULL) {
+		info = cl->clientData;
+		fprintf(out, "aml_vnc_client_sent_bytes_total{client=\"%d\"} %llu\n", info->session, (unsigned long long)info->sentBytes);
+	}
+	rfbReleaseClientIterator(iterator);
+
+	fprintf(out, "# TYPE aml_vnc_client_received_bytes_total counter\n");
+	iterator = rfbGetClientIterator(vncScreen);
+	while ((cl = nextMetricsClient(iterator)) != NULL) {
+		info = cl->clientData;
+		fprintf(out, "aml_vnc_client_received_bytes_total{client=\"%d\"} %llu\n", info->session, (unsigned long long)info->receivedBytes);
+	}
+	rfbReleaseClientIterator(iterator);
+
+	fprintf(out, "# TYPE aml_vnc_client_pending_update gauge\n");
+	iterator = rfbGetClientIterator(vncScreen);
+	while ((cl = nextMetricsClient(iterator)) != NULL) {
+		info = cl->clientData;
+		fprintf(out, "aml_vnc_client_pending_update{client=\"%d\"} %d\n", info->session, !sraRgnEmpty(cl->modifiedRegion));
+	}
+	rfbReleaseClientIterator(iterator);
+
+	fprintf(out, "# TYPE aml_vnc_client_encoding gauge\n");
+	iterator = rfbGetClientIterator(vncScreen);
+	while ((cl = nextMetricsClient(iterator)) != NULL) {
+		info = cl->clientData;
+		fprintf(out, "aml_vnc_client_encoding{client=\"%d\",encoding=\"%s\"} 1\n", info->session,
+			encodingName(cl->preferredEncoding, encoding, sizeof(encoding)));
+	}
+	rfbReleaseClientIterator(iterator);
+
+	fprintf(out, "# TYPE aml_vnc_client_input_latency_ms gauge\n");
+	iterator = rfbGetClientIterator(vncScreen);
+	while ((cl = nextMetricsClient(iterator)) != NULL) {
+		info = cl->clientData;
+
+		// A stage without samples has no quantiles, the series are left out
+		if (info->latency.detect.count) {
+			fprintf(out, "aml_vnc_client_input_latency_ms{client=\"%d\",stage=\"change\",quantile=\"0.5\"} %d\n", info->session, latencyPercentile(&info->latency.detect, 50));
+			fprintf(out, "aml_vnc_client_input_latency_ms{client=\"%d\",stage=\"change\",quantile=\"0.95\"} %d\n", info->session, latencyPercentile(&info->latency.detect, 95));
+			fprintf(out, "aml_vnc_client_input_latency_ms{client=\"%d\",stage=\"change\",quantile=\"0.99\"} %d\n", info->session, latencyPercentile(&info->latency.detect, 99));
+		}
+		if (info->latency.flush.count) {
+			fprintf(out, "aml_vnc_client_input_latency_ms{client=\"%d\",stage=\"update\",quantile=\"0.5\"} %d\n", info->session, latencyPercentile(&info->latency.flush, 50));
+			fprintf(out, "aml_vnc_client_input_latency_ms{client=\"%d\",stage=\"update\",quantile=\"0.95\"} %d\n", info->session, latencyPercentile(&info->latency.flush, 95));
+			fprintf(out, "aml_vnc_client_input_latency_ms{client=\"%d\",stage=\"update\",quantile=\"0.99\"} %d\n", info->session, latencyPercentile(&info->latency.flush, 99));
+		}
+	}
+	rfbReleaseClientIterator(iterator);
+}
+
+static void sendResponse(int conn, const char *status, const char *type, const void *body, size_t bodySize, int timeout) {
+	struct timeval sendTimeout = { timeout / 1000, (timeout % 1000) * 1000 };
+	char header[160];
+
+	// The responder thread may block, up to the timeout
+	fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+
+	snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n", status, type, bodySize);
+	send(conn, header, strlen(header), MSG_NOSIGNAL);
+	send(conn, body, bodySize, MSG_NOSIGNAL);
+}
+
+static void *respond(void *arg) {
+	metrics_response_t *response;
+	uint8_t *data;
+	size_t size;
+
+	for (;;) {
+		pthread_mutex_lock(&responseLock);
+		while (!responseHead && !responderExit)
+			pthread_cond_wait(&responseCond, &responseLock);
+		response = responseHead;
+		if (response) {
+			responseHead = response->next;
+			if (!responseHead)
+				responseTail = NULL;
+		}
+		pthread_mutex_unlock(&responseLock);
+
+		// The queue is drained before the thread exits
+		if (!response)
+			break;
+
+		if (response->frame) {
+			if (encodeSnapshot(response->frame, &response->frameFormat, response->format, response->scale, response->quality, &data, &size) < 0) {
+				sendResponse(response->conn, "500 Internal Server Error", "text/plain", "Encoding failed\n", 16, METRICS_TIMEOUT);
+			} else {
+				sendResponse(response->conn, "200 OK", response->type, data, size, response->timeout);
+				free(data);
+			}
+			free(response->frame);
+
+			pthread_mutex_lock(&responseLock);
+			snapshotBusy = 0;
+			pthread_mutex_unlock(&responseLock);
+		} else {
+			sendResponse(response->conn, response->status, response->type, response->body, response->bodySize, response->timeout);
+			free(response->body);
+		}
+
+		close(response->conn);
+		free(response);
+	}
+
+	return NULL;
+}
+
+// Hands the connection to the responder thread (a NULL frame takes the body, which is freed there)
+static void queueResponse(metrics_response_t *response) {
+	response->next = NULL;
+
+	pthread_mutex_lock(&responseLock);
+	if (responseTail)
+		responseTail->next = response;
+	else
+		responseHead = response;
+	responseTail = response;
+	pthread_cond_signal(&responseCond);
+	pthread_mutex_unlock(&responseLock);
+}
+
+static void queueBody(int conn, const char *status, const char *type, char *body, size_t bodySize) {
+	metrics_response_t *response = body ? calloc(1, sizeof(metrics_response_t)) : NULL;
+
+	if (!response) {
+		free(body);
+		close(conn);
+		return;
+	}
+
+	response->conn = conn;
+	response->status = status;
+	response->type = type;
+	response->body = body;
+	response->bodySize = bodySize;
+	response->timeout = METRICS_TIMEOUT;
+	queueResponse(response);
+}
+
+static void queueText(int conn, const char *status, const char *text) {
+	queueBody(conn, status, "text/plain", strdup(text), strlen(text));
+}
+
+static int queryValue(const char *path, const char *name, int value) {
+	const char *query = strchr(path, '?');
+	size_t length = strlen(name);
+
+	while (query) {
+		query++;
+		if (!strncmp(query, name, length) && query[length] == '=')
+			return atoi(query + length + 1);
+		query = strchr(query, '&');
+	}
+	return value;
+}
+
+// GET /snapshot.png or /snapshot.jpg, optionally with ?scale=<divisor>&quality=<1-100>
+static void serveSnapshot(int conn, const char *path) {
+	int jpeg = !strncmp(path, "/snapshot.jpg", 13) || !strncmp(path, "/snapshot.jpeg", 14);
+	int scale = queryValue(path, "scale", 1);
+	int quality = queryValue(path, "quality", SNAPSHOT_QUALITY);
+	size_t frameSize = (size_t)screenFormat.width * screenFormat.height * (screenFormat.bitsPerPixel / CHAR_BIT);
+	uint64_t traceStart = TRACE_START();
+	metrics_response_t *response;
+	int busy;
+
+	// The screen buffer is not updated in deep idle
+	if (deepIdle) {
+		queueText(conn, "503 Service Unavailable", "Deep idle, no current frame\n");
+		return;
+	}
+
+	if (scale < 1 || scale > SNAPSHOT_MAX_SCALE || quality < 1 || quality > 100) {
+		queueText(conn, "400 Bad Request", "Invalid scale or quality\n");
+		return;
+	}
+
+	pthread_mutex_lock(&responseLock);
+	busy = snapshotBusy;
+	snapshotBusy = 1;
+	pthread_mutex_unlock(&responseLock);
+
+	if (busy) {
+		queueText(conn, "503 Service Unavailable", "Another snapshot is in progress\n");
+		return;
+	}
+
+	// Only the copy runs on the main loop, the capture goes on while the responder thread encodes it
+	response = calloc(1, sizeof(metrics_response_t));
+	if (response)
+		response->frame = malloc(frameSize);
+	if (!response || !response->frame) {
+		free(response);
+		pthread_mutex_lock(&responseLock);
+		snapshotBusy = 0;
+		pthread_mutex_unlock(&responseLock);
+		queueText(conn, "500 Internal Server Error", "Out of memory\n");
+		return;
+	}
+	memcpy(response->frame, vncBuffer, frameSize);
+	TRACE_STOP("copySnapshot", traceStart);
+
+	response->conn = conn;
+	response->type = jpeg ? "image/jpeg" : "image/png";
+	response->timeout = SNAPSHOT_TIMEOUT; // The image is larger than a scrape, the reader gets more time
+	response->frameFormat = screenFormat;
+	response->format = jpeg ? SNAPSHOT_JPEG : SNAPSHOT_PNG;
+	response->scale = scale;
+	response->quality = quality;
+	queueResponse(response);
+}
+
+static void closeConn(metrics_conn_t *conn) {
+	close(conn->fd);
+	conn->fd = -1;
+}
+
+// Routes the request once its first line arrived, the connection then belongs to the responder thread (0: still waiting)
+static int handleRequest(metrics_conn_t *conn, uint64_t timeNow) {
+	int expired = timeNow - conn->acceptTime > METRICS_TIMEOUT * 1000;
+	char path[256], *body = NULL;
+	size_t bodySize;
+	ssize_t length;
+	FILE *out;
+
+	length = recv(conn->fd, conn->request + conn->length, sizeof(conn->request) - 1 - conn->length, 0);
+	if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && !expired)
+		return 0;
+	if (length <= 0 && !conn->length) {
+		closeConn(conn);
+		return 1;
+	}
+
+	conn->length += MAX(length, 0);
+	conn->request[conn->length] = '\0';
+
+	// A partial first line is answered as it is after the timeout
+	if (!strchr(conn->request, '\n') && conn->length < (int)sizeof(conn->request) - 1 && length > 0 && !expired)
+		return 0;
+
+	// Only the snapshot path is routed, every other request gets the full metrics
+	if (sscanf(conn->request, "GET %255s", path) == 1 && !strncmp(path, "/snapshot", 9)) {
+		serveSnapshot(conn->fd, path);
+	} else {
+		out = open_memstream(&body, &bodySize);
+		if (out) {
+			writeMetrics(out);
+			fclose(out);
+			queueBody(conn->fd, "200 OK", "text/plain; version=0.0.4", body, bodySize);
+		} else {
+			close(conn->fd);
+		}
+	}
+
+	conn->fd = -1;
+	return 1;
+}
+
+void serveMetrics(void) {
+	uint64_t timeNow = getMonotonicTime();
+	int fd, slot, changed = 0, i;
+
+	if (metricsSock < 0)
+		return;
+
+	while ((fd = accept4(metricsSock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		// A free slot, or the connection which waits for its request the longest
+		slot = 0;
+		for (i = 0; i < METRICS_MAX_CONNS; i++) {
+			if (metricsConns[i].fd < 0) {
+				slot = i;
+				break;
+			}
+			if (metricsConns[i].acceptTime < metricsConns[slot].acceptTime)
+				slot = i;
+		}
+		if (metricsConns[slot].fd >= 0)
+			closeConn(&metricsConns[slot]);
+
+		metricsConns[slot].fd = fd;
+		metricsConns[slot].key = -2 - (int)(connSerial++ & 0x3fffffff);
+		metricsConns[slot].acceptTime = timeNow;
+		metricsConns[slot].length = 0;
+		changed = 1;
+	}
+
+	// Silent connections are dropped on the next socket event after the timeout
+	for (i = 0; i < METRICS_MAX_CONNS; i++) {
+		if (metricsConns[i].fd >= 0 && handleRequest(&metricsConns[i], timeNow))
+			changed = 1;
+	}
+
+	if (changed)
+		syncEventSources();
+}
+
+void closeMetrics(void) {
+	int i;
+
+	if (metricsSock < 0)
+		return;
+
+	for (i = 0; i < METRICS_MAX_CONNS; i++) {
+		if (metricsConns[i].fd >= 0)
+			closeConn(&metricsConns[i]);
+	}
+
+	if (responderRunning) {
+		pthread_mutex_lock(&responseLock);
+		responderExit = 1;
+		pthread_cond_signal(&responseCond);
+		pthread_mutex_unlock(&responseLock);
+		pthread_join(responderThread, NULL);
+		responderRunning = 0;
+	}
+
+	close(metricsSock);
+	unlink(metricsPath);
+	metricsSock = -1;
+}
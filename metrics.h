@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for the metrics endpoint
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "common.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+
+// Reinit causes (one for every state change check of the backends)
+enum {
+	REINIT_STATE_LOST,
+	REINIT_NO_FRAMEBUFFER,
+	REINIT_SCAN_MODE,
+	REINIT_REFRESH_RATE,
+	REINIT_PIXEL_FORMAT,
+	REINIT_COLOR_GROUP,
+	REINIT_MODIFIER,
+	REINIT_MULTI_BUFFER,
+	REINIT_BUFFER_COUNT,
+	REINIT_MAP_FAILED,
+	REINIT_RESOLUTION,
+	REINIT_BUFFER_SIZE,
+	REINIT_DESKTOP_SIZE,
+	REINIT_CAUSES
+};
+
+typedef struct {
+	uint64_t frames; // Screen updates performed
+	uint64_t changedFrames; // Screen updates with a detected change
+	uint64_t capturedPixels;
+	uint64_t dirtyPixels;
+	uint64_t translatedPixels; // Pixels written to the shared translation buffers
+	uint64_t videoUpdates; // Rate limited updates of the video tiles
+	uint64_t h264Frames; // Frames sent as Open H.264
+	uint64_t h264Bytes;
+	uint64_t recordDrops; // Recorded messages dropped on a full writer queue
+	uint64_t recordBytes;
+	uint64_t updateTime; // Time spent in updateScreen() in us
+	uint64_t stateCheckTime; // Time spent in checkBufferStateChange() in us
+	uint64_t eventTime; // Time spent in rfbProcessEvents() in us
+	uint64_t softReinits;
+	uint64_t hardReinits;
+	uint64_t reinitCauses[REINIT_CAUSES];
+} server_metrics_t;
+
+#define METRICS_MAX_CONNS 8 // Connections waiting for their request
+
+// A connection of the metrics socket until its request arrived
+typedef struct {
+	int fd;
+	int key; // Event source key (negative, apart from the client sessions)
+	uint64_t acceptTime;
+	char request[512]; // Received part of the request
+	int length;
+} metrics_conn_t;
+
+extern server_metrics_t metrics;
+extern char *metricsPath;
+extern int metricsSock;
+extern metrics_conn_t metricsConns[METRICS_MAX_CONNS];
+
+static inline void metricsReinit(int cause) {
+	metrics.reinitCauses[cause]++;
+}
+
+void metricsClientBytes(rfbClientPtr cl);
+void initMetrics(void);
+void serveMetrics(void);
+void closeMetrics(void);
+
+#endif
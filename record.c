@@ -0,0 +1,527 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Session recording: an internal client of the server is read into .fbs files by a writer thread
+
+#include "record.h"
+#include "client.h"
+#include "metrics.h"
+#include "updatescreen.h"
+
+#include <zlib.h>
+
+// Directory of the recordings (NULL disables the recording)
+char *recordDir = NULL;
+int recordCompress = 0;
+int recordSegmentSize = RECORD_SEGMENT_SIZE;
+
+enum {
+	CHUNK_BLOCK, // Server messages of one .fbs block
+	CHUNK_SEGMENT, // Starts the next file, the data is the stream preamble
+	CHUNK_EVENT, // Line of the input event log
+	CHUNK_CLOSE, // The recording client is gone
+	CHUNK_END
+};
+
+typedef struct record_chunk {
+	struct record_chunk *next;
+	int type;
+	uint32_t timestamp; // ms since the segment start
+	size_t size;
+	uint8_t data[];
+} record_chunk_t;
+
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+static record_chunk_t *queueHead = NULL, *queueTail = NULL;
+static size_t queueBytes = 0;
+
+typedef struct {
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+} record_message_t;
+
+static pthread_t writerThread;
+static int writerRunning = 0;
+static int segmentCount = 0; // Only used by the writer
+
+// Every segment is recorded by a client of its own, so its encoder state starts fresh with the file
+static pthread_t sessionThread;
+static int sessionRunning = 0;
+static int sessionDone = 0; // The session thread finished its segment
+static int sessionFailed = 0; // The client could not connect, the recording is given up
+static int recorderSock = -1; // Client end of the socket pair
+static int serverSock = -1; // Server end, only while rfbNewClient() runs
+static rfbClientPtr recordClient = NULL;
+static int recordWidth, recordHeight; // Screen size of the segment
+static uint64_t segmentStart; // Written by the session thread, read by the input events
+
+// Never waits for the writer: without room the chunk is dropped (-1), forced chunks always fit
+static int enqueue(int type, const void *data, size_t size, uint32_t timestamp, int force) {
+	record_chunk_t *chunk = malloc(sizeof(record_chunk_t) + size);
+
+	if (!chunk)
+		return -1;
+
+	chunk->next = NULL;
+	chunk->type = type;
+	chunk->timestamp = timestamp;
+	chunk->size = size;
+	memcpy(chunk->data, data, size);
+
+	pthread_mutex_lock(&queueLock);
+	if (!force && queueBytes + size > RECORD_QUEUE_SIZE) {
+		pthread_mutex_unlock(&queueLock);
+		free(chunk);
+		__atomic_add_fetch(&metrics.recordDrops, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	if (queueTail)
+		queueTail->next = chunk;
+	else
+		queueHead = chunk;
+	queueTail = chunk;
+	queueBytes += size;
+	pthread_cond_signal(&queueCond);
+	pthread_mutex_unlock(&queueLock);
+
+	return 0;
+}
+
+static uint32_t segmentTime(void) {
+	return (getMonotonicTime() - __atomic_load_n(&segmentStart, __ATOMIC_RELAXED)) / 1000;
+}
+
+static void put32(uint8_t *dst, uint32_t value) {
+	dst[0] = value >> 24;
+	dst[1] = value >> 16;
+	dst[2] = value >> 8;
+	dst[3] = value;
+}
+
+// Length, data padded to 4 bytes and the timestamp
+static void writeBlock(gzFile file, const uint8_t *data, size_t size, uint32_t timestamp) {
+	static const uint8_t padding[3];
+	uint8_t value[4];
+
+	put32(value, size);
+	gzwrite(file, value, 4);
+	gzwrite(file, data, size);
+	if (size % 4)
+		gzwrite(file, padding, 4 - size % 4);
+	put32(value, timestamp);
+	gzwrite(file, value, 4);
+
+	__atomic_add_fetch(&metrics.recordBytes, size, __ATOMIC_RELAXED);
+}
+
+static void openSegment(gzFile *file, FILE **events) {
+	char name[64], path[PATH_MAX];
+	time_t now = time(NULL);
+	struct tm local;
+
+	localtime_r(&now, &local);
+	strftime(name, sizeof(name), "session-%Y%m%d-%H%M%S", &local);
+	segmentCount++;
+
+	snprintf(path, sizeof(path), "%s/%s-%03d.fbs%s", recordDir, name, segmentCount, recordCompress ? ".gz" : "");
+	*file = gzopen(path, recordCompress ? "wb1" : "wbT");
+	if (!*file) {
+		LOGE(" Could not create recording '%s': %s.\n", path, strerror(errno));
+		return;
+	}
+	gzbuffer(*file, RECORD_BUFFER_SIZE);
+	gzwrite(*file, "FBS 001.000\n", 12);
+
+	snprintf(path, sizeof(path), "%s/%s-%03d.events", recordDir, name, segmentCount);
+	*events = fopen(path, "w");
+	if (!*events)
+		LOGE(" Could not create event log '%s': %s.\n", path, strerror(errno));
+}
+
+static void closeSegment(gzFile *file, FILE **events) {
+	if (*file)
+		gzclose(*file);
+	if (*events)
+		fclose(*events);
+	*file = NULL;
+	*events = NULL;
+}
+
+// The only thread which touches the disk
+static void *writeRecording(void *arg) {
+	record_chunk_t *chunk;
+	gzFile file = NULL;
+	FILE *events = NULL;
+	int type;
+
+	do {
+		pthread_mutex_lock(&queueLock);
+		while (!queueHead)
+			pthread_cond_wait(&queueCond, &queueLock);
+		chunk = queueHead;
+		queueHead = chunk->next;
+		if (!queueHead)
+			queueTail = NULL;
+		queueBytes -= chunk->size;
+		pthread_mutex_unlock(&queueLock);
+
+		type = chunk->type;
+		switch (type) {
+		case CHUNK_SEGMENT:
+			closeSegment(&file, &events);
+			openSegment(&file, &events);
+			if (file)
+				writeBlock(file, chunk->data, chunk->size, 0);
+			break;
+		case CHUNK_BLOCK:
+			if (file)
+				writeBlock(file, chunk->data, chunk->size, chunk->timestamp);
+			break;
+		case CHUNK_EVENT:
+			if (events)
+				fwrite(chunk->data, 1, chunk->size, events);
+			break;
+		case CHUNK_CLOSE:
+		case CHUNK_END:
+			closeSegment(&file, &events);
+			break;
+		}
+		free(chunk);
+	} while (type != CHUNK_END);
+
+	return NULL;
+}
+
+static int readFull(void *buffer, size_t length) {
+	uint8_t *dst = buffer;
+	ssize_t n;
+
+	while (length) {
+		n = read(recorderSock, dst, length);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		dst += n;
+		length -= n;
+	}
+	return 0;
+}
+
+static int writeFull(const void *buffer, size_t length) {
+	return send(recorderSock, buffer, length, MSG_NOSIGNAL) == (ssize_t)length ? 0 : -1;
+}
+
+// Appends the next bytes of the stream to the message
+static int readMessage(record_message_t *message, size_t length) {
+	uint8_t *data;
+
+	if (message->size + length > message->capacity) {
+		data = realloc(message->data, message->size + length);
+		if (!data)
+			return -1;
+		message->data = data;
+		message->capacity = message->size + length;
+	}
+
+	if (readFull(message->data + message->size, length) < 0)
+		return -1;
+	message->size += length;
+	return 0;
+}
+
+static uint32_t get32(const uint8_t *src) {
+	return (uint32_t)src[0] << 24 | src[1] << 16 | src[2] << 8 | src[3];
+}
+
+// Protocol 3.8 towards the server (the version was sent up front), the recording starts like a
+// 3.3 stream without authentication
+static int handshake(record_message_t *preamble) {
+	uint8_t version[12], count, types[255], challenge[CHALLENGESIZE], result[4];
+	uint8_t type;
+
+	if (readFull(version, sizeof(version)) < 0 || readFull(&count, 1) < 0 || !count || readFull(types, count) < 0)
+		return -1;
+
+	if (memchr(types, rfbNoAuth, count)) {
+		type = rfbNoAuth;
+		if (writeFull(&type, 1) < 0)
+			return -1;
+	} else if (memchr(types, rfbVncAuth, count)) {
+		type = rfbVncAuth;
+		if (writeFull(&type, 1) < 0 || readFull(challenge, sizeof(challenge)) < 0)
+			return -1;
+		rfbEncryptBytes(challenge, serverPassword);
+		if (writeFull(challenge, sizeof(challenge)) < 0)
+			return -1;
+	} else {
+		return -1;
+	}
+
+	// Security result, then a shared ClientInit
+	type = 1;
+	if (readFull(result, sizeof(result)) < 0 || get32(result) != 0 || writeFull(&type, 1) < 0)
+		return -1;
+
+	preamble->size = 0;
+	if (readMessage(preamble, 12 + 4) < 0)
+		return -1;
+	memcpy(preamble->data, "RFB 003.003\n", 12);
+	put32(preamble->data + 12, rfbNoAuth);
+
+	// ServerInit: size, pixel format and the name
+	if (readMessage(preamble, 24) < 0 || readMessage(preamble, get32(preamble->data + 16 + 20)) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int requestUpdate(const uint8_t *serverInit, int incremental) {
+	uint8_t request[10];
+
+	request[0] = rfbFramebufferUpdateRequest;
+	request[1] = incremental;
+	memset(request + 2, 0, 4);
+	memcpy(request + 6, serverInit, 4);
+	return writeFull(request, sizeof(request));
+}
+
+// One complete server message (only the encodings the recorder asked for are expected)
+static int readServerMessage(record_message_t *message, int pixelBytes) {
+	uint32_t encoding, rects, i;
+	const uint8_t *rect;
+
+	message->size = 0;
+	if (readMessage(message, 1) < 0)
+		return -1;
+
+	switch (message->data[0]) {
+	case rfbFramebufferUpdate:
+		if (readMessage(message, 3) < 0)
+			return -1;
+		rects = message->data[2] << 8 | message->data[3];
+		for (i = 0; i < rects; i++) {
+			if (readMessage(message, 12) < 0)
+				return -1;
+			rect = message->data + message->size - 12;
+			encoding = get32(rect + 8);
+			switch (encoding) {
+			case rfbEncodingRaw:
+				if (readMessage(message, (size_t)(rect[4] << 8 | rect[5]) * (rect[6] << 8 | rect[7]) * pixelBytes) < 0)
+					return -1;
+				break;
+			case rfbEncodingCopyRect:
+				if (readMessage(message, 4) < 0)
+					return -1;
+				break;
+			case rfbEncodingZRLE:
+				if (readMessage(message, 4) < 0 || readMessage(message, get32(message->data + message->size - 4)) < 0)
+					return -1;
+				break;
+			default:
+				LOGE(" Recording segment ended, unexpected encoding: %d.\n", (int)encoding);
+				return -1;
+			}
+		}
+		return 0;
+	case rfbBell:
+		return 0;
+	case rfbServerCutText:
+		if (readMessage(message, 7) < 0 || readMessage(message, get32(message->data + 4)) < 0)
+			return -1;
+		return 0;
+	}
+
+	LOGE(" Recording segment ended, unexpected message: %d.\n", message->data[0]);
+	return -1;
+}
+
+// The recording client of one segment: updates are requested one after another and queued message
+// by message. A full segment or a dropped message ends the client, the next segment is recorded by
+// a new one (the zlib stream of ZRLE can not be restarted within a connection).
+static void *recordSession(void *arg) {
+	static const uint8_t encodings[16] = {
+		rfbSetEncodings, 0, 0, 3,
+		0, 0, 0, rfbEncodingZRLE,
+		0, 0, 0, rfbEncodingCopyRect,
+		0, 0, 0, rfbEncodingRaw
+	};
+	record_message_t preamble = { 0 }, message = { 0 };
+	size_t segmentBytes = 0;
+	int pixelBytes;
+
+	if (handshake(&preamble) < 0 || writeFull(encodings, sizeof(encodings)) < 0 || requestUpdate(preamble.data + 16, 0) < 0) {
+		LOGE(" Recording client could not connect, recording stopped.\n");
+		__atomic_store_n(&sessionFailed, 1, __ATOMIC_RELAXED);
+		goto done;
+	}
+	pixelBytes = preamble.data[16 + 4] / CHAR_BIT;
+
+	__atomic_store_n(&segmentStart, getMonotonicTime(), __ATOMIC_RELAXED);
+	enqueue(CHUNK_SEGMENT, preamble.data, preamble.size, 0, 1);
+
+	while (readServerMessage(&message, pixelBytes) == 0) {
+		// A dropped message leaves a gap, the segment ends before it
+		if (enqueue(CHUNK_BLOCK, message.data, message.size, segmentTime(), 0) < 0)
+			break;
+		segmentBytes += message.size;
+
+		if (message.data[0] != rfbFramebufferUpdate)
+			continue;
+
+		if (segmentBytes >= (size_t)recordSegmentSize * 1024 * 1024 || requestUpdate(preamble.data + 16, 1) < 0)
+			break;
+	}
+	enqueue(CHUNK_CLOSE, NULL, 0, 0, 1);
+
+done:
+	// The server sees the end of the connection and drops the client
+	shutdown(recorderSock, SHUT_RDWR);
+	free(preamble.data);
+	free(message.data);
+	__atomic_store_n(&sessionDone, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void startSession(void) {
+	int sv[2], size = RECORD_SOCKET_BUFFER;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		LOGE(" Could not create the recording socket: %s.\n", strerror(errno));
+		__atomic_store_n(&sessionFailed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	// A short stall of the recorder does not block the server
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	// The client version is already waiting, libvncserver does not wait for a WebSocket request then
+	send(sv[1], "RFB 003.008\n", 12, MSG_NOSIGNAL);
+
+	recorderSock = sv[1];
+	recordWidth = vncScreen->width;
+	recordHeight = vncScreen->height;
+	sessionDone = 0;
+	pthread_create(&sessionThread, NULL, recordSession, NULL);
+	sessionRunning = 1;
+
+	serverSock = sv[0];
+	rfbNewClient(vncScreen, sv[0]);
+	serverSock = -1;
+}
+
+// The client end is shut down first, the session thread sees the end of its stream
+static void stopSession(void) {
+	if (!sessionRunning)
+		return;
+
+	shutdown(recorderSock, SHUT_RDWR);
+	pthread_join(sessionThread, NULL);
+	close(recorderSock);
+	recorderSock = -1;
+	sessionRunning = 0;
+}
+
+// Called by newClientHook, the client connected by startSession() is the recorder
+int recordConnect(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+
+	if (serverSock < 0 || cl->sock != serverSock)
+		return 0;
+
+	info->recorder = 1;
+	recordClient = cl;
+	return 1;
+}
+
+int isRecordClient(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+
+	return info && info->recorder;
+}
+
+void recordClientGone(rfbClientPtr cl) {
+	if (cl == recordClient)
+		recordClient = NULL;
+}
+
+// Called from the main loop after the libvncserver events: a segment is recorded while an
+// authenticated client is connected, the recorder itself does not keep the recording alive
+void syncRecording(void) {
+	rfbClientPtr cl;
+	int clients = 0;
+
+	if (!writerRunning || __atomic_load_n(&sessionFailed, __ATOMIC_RELAXED))
+		return;
+
+	for (cl = vncScreen->clientHead; cl; cl = cl->next) {
+		if (cl->state == RFB_NORMAL && cl->sock != RFB_INVALID_SOCKET && !isRecordClient(cl))
+			clients++;
+	}
+
+	// The screen size is only part of the file preamble, a resized screen starts the next segment
+	if (recordClient && (!clients || recordWidth != vncScreen->width || recordHeight != vncScreen->height)) {
+		rfbCloseClient(recordClient);
+		stopSession();
+	}
+
+	// A finished segment (full, dropped message or a closed client)
+	if (sessionRunning && __atomic_load_n(&sessionDone, __ATOMIC_ACQUIRE))
+		stopSession();
+
+	if (clients && !sessionRunning)
+		startSession();
+}
+
+void initRecording(void) {
+	if (!recordDir || writerRunning)
+		return;
+
+	if (access(recordDir, W_OK) < 0) {
+		LOGE(" Recording directory is not writable: %s.\n", recordDir);
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_create(&writerThread, NULL, writeRecording, NULL);
+	writerRunning = 1;
+	LOG(" Sessions are recorded to '%s'%s.\n", recordDir, recordCompress ? " (compressed)" : "");
+}
+
+void closeRecording(void) {
+	if (!writerRunning)
+		return;
+
+	stopSession();
+
+	enqueue(CHUNK_END, NULL, 0, 0, 1);
+	pthread_join(writerThread, NULL);
+	writerRunning = 0;
+	LOG(" Recording finished, %llu messages dropped.\n", (unsigned long long)metrics.recordDrops);
+}
+
+static void recordEvent(const char *line, int length) {
+	if (length > 0)
+		enqueue(CHUNK_EVENT, line, length, 0, 0);
+}
+
+void recordKeyEvent(rfbClientPtr cl, rfbBool down, rfbKeySym key) {
+	client_info_t *info = cl->clientData;
+	char line[64];
+
+	if (!sessionRunning)
+		return;
+
+	recordEvent(line, snprintf(line, sizeof(line), "%u [%d] key %s 0x%04x\n", segmentTime(),
+		info ? info->session : 0, down ? "down" : "up", (unsigned int)key));
+}
+
+void recordPointerEvent(rfbClientPtr cl, int buttonMask, int x, int y) {
+	client_info_t *info = cl->clientData;
+	char line[64];
+
+	if (!sessionRunning)
+		return;
+
+	recordEvent(line, snprintf(line, sizeof(line), "%u [%d] pointer 0x%02x %d %d\n", segmentTime(),
+		info ? info->session : 0, buttonMask, x, y));
+}
@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for the session recording (.fbs files with an input event log)
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include "common.h"
+
+#include <pthread.h>
+
+#define RECORD_SEGMENT_SIZE 256 // Default size of a recording file in MiB before the next one is started
+#define RECORD_QUEUE_SIZE (64 * 1024 * 1024) // Bytes waiting for the writer, messages beyond it are dropped
+#define RECORD_BUFFER_SIZE (1024 * 1024) // Write buffer of the files
+#define RECORD_SOCKET_BUFFER (4 * 1024 * 1024) // Send buffer of the server towards the recording client
+
+extern char *recordDir;
+extern int recordCompress;
+extern int recordSegmentSize;
+
+void initRecording(void);
+void closeRecording(void);
+void syncRecording(void);
+int recordConnect(rfbClientPtr cl);
+int isRecordClient(rfbClientPtr cl);
+void recordClientGone(rfbClientPtr cl);
+void recordKeyEvent(rfbClientPtr cl, rfbBool down, rfbKeySym key);
+void recordPointerEvent(rfbClientPtr cl, int buttonMask, int x, int y);
+
+#endif
@@ -0,0 +1,482 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Server-side downscaling of the captured heads
+
+#include "scale.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SCALE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCALE_SSE2
+#endif
+
+#define SCALE_MAX_FACTOR 8 // Larger integer steps use the bilinear filter
+#define SCALE_CHUNK 32 // Served pixels per SIMD pass of the box filter
+
+// Options (a divisor or a size to fit the desktop into)
+int scaleDivisor = 1;
+uint32_t scaleWidth = 0;
+uint32_t scaleHeight = 0;
+
+// Converted source lines of every head (only for capture-side conversion)
+static uint32_t *lineBuffers[MAX_HEADS];
+
+int parseScale(const char *spec) {
+	char *end;
+	long divisor, width, height;
+
+	scaleDivisor = 1;
+	scaleWidth = 0;
+	scaleHeight = 0;
+
+	// "1/N" and "N" both mean a divisor of N
+	if (!strncmp(spec, "1/", 2))
+		spec += 2;
+
+	width = strtol(spec, &end, 10);
+	if (end == spec || width < 1)
+		return -1;
+
+	if (*end == '\0') {
+		divisor = width;
+		if (divisor > SCALE_MAX_FACTOR)
+			return -1;
+		scaleDivisor = divisor;
+		return 0;
+	}
+
+	// "WxH" fits the desktop into the given size
+	if (*end != 'x')
+		return -1;
+	spec = end + 1;
+	height = strtol(spec, &end, 10);
+	if (end == spec || *end != '\0' || height < 1 || width > UINT16_MAX || height > UINT16_MAX)
+		return -1;
+
+	scaleWidth = width;
+	scaleHeight = height;
+	return 0;
+}
+
+void applyScale(void) {
+	screen_head_t *head;
+	uint32_t step = SCALE_ONE, width = 0, height = 0, nativeWidth = 0, nativeHeight = 0;
+	uint64_t fitX, fitY;
+	size_t lines;
+	int i;
+
+	for (i = 0; i < screenHeadCount; i++) {
+		nativeWidth += screenHeads[i].info.width;
+		nativeHeight = MAX(nativeHeight, screenHeads[i].info.height);
+	}
+
+	if (scaleDivisor > 1) {
+		step = scaleDivisor * SCALE_ONE;
+	} else if (scaleWidth && scaleHeight) {
+		// The same step is used on both axes, so the aspect ratio is kept (no upscaling)
+		fitX = (((uint64_t)nativeWidth << 16) + scaleWidth - 1) / scaleWidth;
+		fitY = (((uint64_t)nativeHeight << 16) + scaleHeight - 1) / scaleHeight;
+		step = MAX(SCALE_ONE, MAX(fitX, fitY));
+	}
+
+	// The filters average 8-bit components of 32-bit pixels
+	if (step != SCALE_ONE && screenFormat.bitsPerPixel != 32) {
+		LOGW(" Scaling requires a 32-bit pixel format, the screen is served unscaled.\n");
+		step = SCALE_ONE;
+	}
+
+	closeScale();
+
+	// Heads stay side by side on the served desktop, with their scaled widths
+	nativeWidth = 0;
+	for (i = 0; i < screenHeadCount; i++) {
+		head = &screenHeads[i];
+
+		head->nativeX = nativeWidth;
+		head->x = width;
+		head->scale.step = step;
+		head->scale.factor = (step & (SCALE_ONE - 1)) || (step >> 16) > SCALE_MAX_FACTOR ? 0 : step >> 16;
+		head->scale.width = MAX(1, ((uint64_t)head->info.width << 16) / step);
+		head->scale.height = MAX(1, ((uint64_t)head->info.height << 16) / step);
+
+		if (step != SCALE_ONE && head->info.convert != CONVERT_NONE) {
+			lines = head->scale.factor ? head->scale.factor : 2;
+			lineBuffers[i] = malloc(lines * head->info.width * sizeof(uint32_t));
+			assert(lineBuffers[i] != NULL);
+		}
+
+		nativeWidth += head->info.width;
+		width += head->scale.width;
+		height = MAX(height, head->scale.height);
+	}
+
+	if (step != SCALE_ONE) {
+		LOG(" Served resolution: %ux%u (scaled from %ux%u, %s filter).\n", width, height, nativeWidth, nativeHeight,
+			screenHeads[0].scale.factor ? "box" : "bilinear");
+	}
+
+	screenFormat.width = width;
+	screenFormat.height = height;
+	screenFormat.size = width * height * (screenFormat.bitsPerPixel / CHAR_BIT);
+}
+
+void closeScale(void) {
+	int i;
+
+	for (i = 0; i < MAX_HEADS; i++) {
+		free(lineBuffers[i]);
+		lineBuffers[i] = NULL;
+	}
+}
+
+// Captured rows which contribute to served rows, mapped from captured damage
+void scaleDamage(const scale_t *scale, int *yMin, int *yMax) {
+	if (scale->factor) {
+		*yMin = *yMin / (int)scale->factor;
+		*yMax = *yMax / (int)scale->factor;
+	} else {
+		// The bilinear filter reads a neighbouring row on both sides
+		*yMin = (int)(((uint64_t)*yMin << 16) / scale->step) - 1;
+		*yMax = (int)(((uint64_t)(*yMax + 1) << 16) / scale->step) + 1;
+	}
+
+	*yMin = MAX(0, *yMin);
+	*yMax = MIN((int)scale->height - 1, *yMax);
+}
+
+static inline void accumulatePixel(uint32_t *sums, uint32_t pixel) {
+	sums[0] += pixel & 0xff;
+	sums[1] += (pixel >> 8) & 0xff;
+	sums[2] += (pixel >> 16) & 0xff;
+	sums[3] += pixel >> 24;
+}
+
+// Rounded average of the components (identical to the SIMD variants for a factor of 2)
+static inline uint32_t averagePixel(const uint32_t *sums, uint32_t area) {
+	uint32_t half = area / 2;
+
+	return ((sums[0] + half) / area) | (((sums[1] + half) / area) << 8) |
+		(((sums[2] + half) / area) << 16) | (((sums[3] + half) / area) << 24);
+}
+
+// Columns are blended first, the same order and rounding as the SIMD variants
+static inline uint32_t blendPixel(uint32_t p00, uint32_t p01, uint32_t p10, uint32_t p11, uint32_t fx, uint32_t fy) {
+	uint32_t left, right, pixel = 0;
+	int shift;
+
+	for (shift = 0; shift < 32; shift += 8) {
+		left = ((p00 >> shift) & 0xff) * (128 - fy) + ((p10 >> shift) & 0xff) * fy;
+		right = ((p01 >> shift) & 0xff) * (128 - fy) + ((p11 >> shift) & 0xff) * fy;
+		pixel |= ((left * (128 - fx) + right * fx + 8192) >> 14) << shift;
+	}
+
+	return pixel;
+}
+
+// Pixel centers are aligned, the fraction has 7 bits (the blended columns fit signed 16-bit SIMD lanes)
+static inline void bilinearSource(uint32_t step, uint32_t pos, uint32_t size, uint32_t *p0, uint32_t *p1, uint32_t *frac) {
+	uint64_t s = (uint64_t)pos * step + step / 2 - SCALE_ONE / 2;
+
+	*p0 = MIN(s >> 16, size - 1);
+	*p1 = MIN(*p0 + 1, size - 1);
+	*frac = (s >> 9) & 0x7f;
+}
+
+static inline uint32_t sourcePixel(const screen_head_t *head, uint32_t x, uint32_t y) {
+	return convertPixel(head->info.convert,
+		head->buffer + (size_t)(head->info.start + y) * head->info.stride + x * head->info.pixelBytes);
+}
+
+// A single served pixel, used by the sampled diff
+uint32_t scalePixel(const screen_head_t *head, uint32_t x, uint32_t y) {
+	uint32_t sums[4] = { 0, 0, 0, 0 };
+	uint32_t factor = head->scale.factor;
+	uint32_t i, j, x0, x1, y0, y1, fx, fy;
+
+	if (factor) {
+		for (j = 0; j < factor; j++) {
+			for (i = 0; i < factor; i++)
+				accumulatePixel(sums, sourcePixel(head, x * factor + i, y * factor + j));
+		}
+		return averagePixel(sums, factor * factor);
+	}
+
+	bilinearSource(head->scale.step, x, head->info.width, &x0, &x1, &fx);
+	bilinearSource(head->scale.step, y, head->info.height, &y0, &y1, &fy);
+
+	return blendPixel(sourcePixel(head, x0, y0), sourcePixel(head, x1, y0),
+		sourcePixel(head, x0, y1), sourcePixel(head, x1, y1), fx, fy);
+}
+
+static const uint32_t *sourceLine(const screen_head_t *head, uint32_t *buffer, uint32_t y) {
+	const uint8_t *src = head->buffer + (size_t)(head->info.start + y) * head->info.stride;
+
+	if (head->info.convert == CONVERT_NONE)
+		return (const uint32_t *)src;
+
+	convertLine(head->info.convert, buffer, src, head->info.width);
+	return buffer;
+}
+
+static void box2Line(uint32_t *dst, const uint32_t *row0, const uint32_t *row1, uint32_t width) {
+	uint32_t sums[4], x = 0;
+
+#if defined(SCALE_NEON)
+	// 4 served pixels per iteration: even and odd source pixels are deinterleaved and summed in 16 bits
+	for (; x + 4 <= width; x += 4) {
+		uint32x4x2_t a = vld2q_u32(row0 + x * 2);
+		uint32x4x2_t b = vld2q_u32(row1 + x * 2);
+		uint16x8_t lo, hi;
+
+		lo = vaddl_u8(vget_low_u8(vreinterpretq_u8_u32(a.val[0])), vget_low_u8(vreinterpretq_u8_u32(a.val[1])));
+		lo = vaddw_u8(lo, vget_low_u8(vreinterpretq_u8_u32(b.val[0])));
+		lo = vaddw_u8(lo, vget_low_u8(vreinterpretq_u8_u32(b.val[1])));
+		hi = vaddl_u8(vget_high_u8(vreinterpretq_u8_u32(a.val[0])), vget_high_u8(vreinterpretq_u8_u32(a.val[1])));
+		hi = vaddw_u8(hi, vget_high_u8(vreinterpretq_u8_u32(b.val[0])));
+		hi = vaddw_u8(hi, vget_high_u8(vreinterpretq_u8_u32(b.val[1])));
+		vst1q_u32(dst + x, vreinterpretq_u32_u8(vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2))));
+	}
+#elif defined(SCALE_SSE2)
+	// 4 served pixels per iteration: rows are summed in 16 bits, then neighbouring pixels
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi16(2);
+
+	for (; x + 4 <= width; x += 4) {
+		__m128i a0 = _mm_loadu_si128((const __m128i *)(row0 + x * 2));
+		__m128i a1 = _mm_loadu_si128((const __m128i *)(row0 + x * 2 + 4));
+		__m128i b0 = _mm_loadu_si128((const __m128i *)(row1 + x * 2));
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(row1 + x * 2 + 4));
+		__m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+		__m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+		__m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+		__m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+
+		s0 = _mm_add_epi16(s0, _mm_srli_si128(s0, 8));
+		s1 = _mm_add_epi16(s1, _mm_srli_si128(s1, 8));
+		s2 = _mm_add_epi16(s2, _mm_srli_si128(s2, 8));
+		s3 = _mm_add_epi16(s3, _mm_srli_si128(s3, 8));
+
+		s0 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s0, s1), round), 2);
+		s2 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(s2, s3), round), 2);
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(s0, s2));
+	}
+#endif
+
+	for (; x < width; x++) {
+		memset(sums, 0, sizeof(sums));
+		accumulatePixel(sums, row0[x * 2]);
+		accumulatePixel(sums, row0[x * 2 + 1]);
+		accumulatePixel(sums, row1[x * 2]);
+		accumulatePixel(sums, row1[x * 2 + 1]);
+		dst[x] = averagePixel(sums, 4);
+	}
+}
+
+#if defined(SCALE_NEON) || defined(SCALE_SSE2)
+// Rounded division of the component sums by the box area: (sum * multiplier) >> (16 + shift) is exact
+// for every sum of factor * factor 8-bit components
+static const uint16_t boxMultipliers[SCALE_MAX_FACTOR + 1][2] = {
+	{ 0, 0 }, { 0, 0 }, { 16384, 0 },
+	{ 58255, 3 }, { 32768, 3 }, { 41944, 4 }, { 58255, 5 }, { 42800, 5 }, { 32768, 5 }
+};
+#endif
+
+static void boxLine(uint32_t *dst, const uint32_t **rows, uint32_t factor, uint32_t width) {
+	uint32_t sums[4], x = 0, i, j;
+
+#if defined(SCALE_NEON) || defined(SCALE_SSE2)
+	// Component sums of the source columns of one chunk (16 bits hold 8 * 8 components)
+	uint16_t columns[SCALE_CHUNK * SCALE_MAX_FACTOR * 4];
+	uint32_t count = SCALE_CHUNK * factor;
+	uint32_t k;
+#endif
+#if defined(SCALE_NEON)
+	const uint16x8_t half = vdupq_n_u16(factor * factor / 2);
+	const uint16_t multiplier = boxMultipliers[factor][0];
+	const int32x4_t shift = vdupq_n_s32(-16 - boxMultipliers[factor][1]);
+
+	for (; x + SCALE_CHUNK <= width; x += SCALE_CHUNK) {
+		// The rows are summed 4 source pixels at a time
+		for (i = 0; i < count; i += 4) {
+			uint16x8_t lo = vdupq_n_u16(0), hi = vdupq_n_u16(0);
+
+			for (j = 0; j < factor; j++) {
+				uint8x16_t p = vld1q_u8((const uint8_t *)(rows[j] + x * factor + i));
+				lo = vaddw_u8(lo, vget_low_u8(p));
+				hi = vaddw_u8(hi, vget_high_u8(p));
+			}
+			vst1q_u16(columns + i * 4, lo);
+			vst1q_u16(columns + i * 4 + 8, hi);
+		}
+
+		// Then the columns of 2 served pixels, divided in 32 bits
+		for (k = 0; k < SCALE_CHUNK; k += 2) {
+			uint16x4_t a = vld1_u16(columns + k * factor * 4);
+			uint16x4_t b = vld1_u16(columns + (k + 1) * factor * 4);
+			uint16x8_t sum;
+
+			for (i = 1; i < factor; i++) {
+				a = vadd_u16(a, vld1_u16(columns + (k * factor + i) * 4));
+				b = vadd_u16(b, vld1_u16(columns + ((k + 1) * factor + i) * 4));
+			}
+			sum = vaddq_u16(vcombine_u16(a, b), half);
+			sum = vcombine_u16(vmovn_u32(vshlq_u32(vmull_n_u16(vget_low_u16(sum), multiplier), shift)),
+				vmovn_u32(vshlq_u32(vmull_n_u16(vget_high_u16(sum), multiplier), shift)));
+			vst1_u8((uint8_t *)(dst + x + k), vmovn_u16(sum));
+		}
+	}
+#elif defined(SCALE_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i half = _mm_set1_epi16(factor * factor / 2);
+	const __m128i multiplier = _mm_set1_epi16(boxMultipliers[factor][0]);
+	const __m128i shift = _mm_cvtsi32_si128(boxMultipliers[factor][1]);
+
+	for (; x + SCALE_CHUNK <= width; x += SCALE_CHUNK) {
+		// The rows are summed 4 source pixels at a time
+		for (i = 0; i < count; i += 4) {
+			__m128i lo = zero, hi = zero;
+
+			for (j = 0; j < factor; j++) {
+				__m128i p = _mm_loadu_si128((const __m128i *)(rows[j] + x * factor + i));
+				lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(p, zero));
+				hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(p, zero));
+			}
+			_mm_storeu_si128((__m128i *)(columns + i * 4), lo);
+			_mm_storeu_si128((__m128i *)(columns + i * 4 + 8), hi);
+		}
+
+		// Then the columns of 4 served pixels, divided by a high multiply
+		for (k = 0; k < SCALE_CHUNK; k += 4) {
+			__m128i sum[4];
+
+			for (j = 0; j < 4; j++) {
+				sum[j] = _mm_loadl_epi64((const __m128i *)(columns + (k + j) * factor * 4));
+				for (i = 1; i < factor; i++)
+					sum[j] = _mm_add_epi16(sum[j], _mm_loadl_epi64((const __m128i *)(columns + ((k + j) * factor + i) * 4)));
+			}
+			sum[0] = _mm_srl_epi16(_mm_mulhi_epu16(_mm_add_epi16(_mm_unpacklo_epi64(sum[0], sum[1]), half), multiplier), shift);
+			sum[2] = _mm_srl_epi16(_mm_mulhi_epu16(_mm_add_epi16(_mm_unpacklo_epi64(sum[2], sum[3]), half), multiplier), shift);
+			_mm_storeu_si128((__m128i *)(dst + x + k), _mm_packus_epi16(sum[0], sum[2]));
+		}
+	}
+#endif
+
+	for (; x < width; x++) {
+		memset(sums, 0, sizeof(sums));
+		for (j = 0; j < factor; j++) {
+			for (i = 0; i < factor; i++)
+				accumulatePixel(sums, rows[j][x * factor + i]);
+		}
+		dst[x] = averagePixel(sums, factor * factor);
+	}
+}
+
+static void bilinearLine(uint32_t *dst, const uint32_t *row0, const uint32_t *row1, uint32_t fy,
+	uint32_t step, uint32_t srcWidth, uint32_t width) {
+	uint32_t x = 0, x0, x1, fx;
+
+#if defined(SCALE_NEON)
+	const uint16x8_t weightY = vdupq_n_u16(fy);
+	const uint16x8_t weightY0 = vdupq_n_u16(128 - fy);
+
+	// One served pixel per iteration: both source columns are blended in one vector, then weighted
+	for (; x < width; x++) {
+		uint32x2_t top, bottom;
+		uint16x8_t columns;
+		uint32x4_t blend;
+
+		bilinearSource(step, x, srcWidth, &x0, &x1, &fx);
+		top = vset_lane_u32(row0[x1], vdup_n_u32(row0[x0]), 1);
+		bottom = vset_lane_u32(row1[x1], vdup_n_u32(row1[x0]), 1);
+		columns = vmlaq_u16(vmulq_u16(vmovl_u8(vreinterpret_u8_u32(top)), weightY0),
+			vmovl_u8(vreinterpret_u8_u32(bottom)), weightY);
+		blend = vmlal_n_u16(vmull_n_u16(vget_low_u16(columns), 128 - fx), vget_high_u16(columns), fx);
+		dst[x] = vget_lane_u32(vreinterpret_u32_u8(vmovn_u16(vcombine_u16(vrshrn_n_u32(blend, 14), vdup_n_u16(0)))), 0);
+	}
+#elif defined(SCALE_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i weightY = _mm_set1_epi16(fy);
+	const __m128i weightY0 = _mm_set1_epi16(128 - fy);
+	const __m128i round = _mm_set1_epi32(8192);
+
+	// 2 served pixels per iteration: the source columns are blended in 16 bits (at most 255 * 128),
+	// left and right column are interleaved and weighted by one multiply-add
+	for (; x + 2 <= width; x += 2) {
+		__m128i top, bottom, columns[2], weights[2];
+		uint32_t x2, x3, fx2;
+
+		bilinearSource(step, x, srcWidth, &x0, &x1, &fx);
+		bilinearSource(step, x + 1, srcWidth, &x2, &x3, &fx2);
+		top = _mm_set_epi32(row0[x3], row0[x2], row0[x1], row0[x0]);
+		bottom = _mm_set_epi32(row1[x3], row1[x2], row1[x1], row1[x0]);
+
+		columns[0] = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(top, zero), weightY0),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(bottom, zero), weightY));
+		columns[1] = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(top, zero), weightY0),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(bottom, zero), weightY));
+		columns[0] = _mm_unpacklo_epi16(columns[0], _mm_srli_si128(columns[0], 8));
+		columns[1] = _mm_unpacklo_epi16(columns[1], _mm_srli_si128(columns[1], 8));
+
+		weights[0] = _mm_set1_epi32((fx << 16) | (128 - fx));
+		weights[1] = _mm_set1_epi32((fx2 << 16) | (128 - fx2));
+		columns[0] = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(columns[0], weights[0]), round), 14);
+		columns[1] = _mm_srli_epi32(_mm_add_epi32(_mm_madd_epi16(columns[1], weights[1]), round), 14);
+
+		columns[0] = _mm_packs_epi32(columns[0], columns[1]);
+		_mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(columns[0], columns[0]));
+	}
+#endif
+
+	for (; x < width; x++) {
+		bilinearSource(step, x, srcWidth, &x0, &x1, &fx);
+		dst[x] = blendPixel(row0[x0], row0[x1], row1[x0], row1[x1], fx, fy);
+	}
+}
+
+// Rescales the served rows yMin..yMax of a head into the screen buffer
+void scaleLines(int index, uint8_t *dst, size_t dstStride, int yMin, int yMax) {
+	const screen_head_t *head = &screenHeads[index];
+	const uint32_t *rows[SCALE_MAX_FACTOR];
+	uint32_t factor = head->scale.factor;
+	uint32_t *buffer = lineBuffers[index];
+	uint32_t width = head->info.width;
+	uint32_t j, y0, y1, fy;
+	int y;
+
+	for (y = yMin; y <= yMax; y++) {
+		uint32_t *line = (uint32_t *)(dst + (size_t)y * dstStride);
+
+		if (factor) {
+			for (j = 0; j < factor; j++)
+				rows[j] = sourceLine(head, buffer + j * width, y * factor + j);
+
+			if (factor == 2)
+				box2Line(line, rows[0], rows[1], head->scale.width);
+			else
+				boxLine(line, rows, factor, head->scale.width);
+		} else {
+			bilinearSource(head->scale.step, y, head->info.height, &y0, &y1, &fy);
+			rows[0] = sourceLine(head, buffer, y0);
+			rows[1] = sourceLine(head, buffer + width, y1);
+			bilinearLine(line, rows[0], rows[1], fy, head->scale.step, width, head->scale.width);
+		}
+	}
+}
+
+// Maps a position on the served desktop to the captured desktop
+void scalePointer(int *x, int *y) {
+	const screen_head_t *head;
+	uint32_t step;
+	int i;
+
+	for (i = screenHeadCount - 1; i > 0 && *x < (int)screenHeads[i].x; i--);
+	head = &screenHeads[i];
+	step = head->scale.step;
+
+	if (step == SCALE_ONE)
+		return;
+
+	*x = head->nativeX + MIN(((uint64_t)MAX(0, *x - (int)head->x) * step + step / 2) >> 16, head->info.width - 1);
+	*y = MIN(((uint64_t)MAX(0, *y) * step + step / 2) >> 16, head->info.height - 1);
+}
@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for server-side downscaling
+
+#ifndef SCALE_H
+#define SCALE_H
+
+#include "common.h"
+#include "framebuffer.h"
+
+#define SCALE_ONE 0x10000 // Step of an unscaled head
+
+extern int scaleDivisor;
+extern uint32_t scaleWidth;
+extern uint32_t scaleHeight;
+
+int parseScale(const char *spec);
+void applyScale(void);
+void closeScale(void);
+void scaleDamage(const scale_t *scale, int *yMin, int *yMax);
+uint32_t scalePixel(const screen_head_t *head, uint32_t x, uint32_t y);
+void scaleLines(int index, uint8_t *dst, size_t dstStride, int yMin, int yMax);
+void scalePointer(int *x, int *y);
+
+#endif
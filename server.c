@@ -5,14 +5,25 @@
 #include "version.h"
 #include "framebuffer.h"
 #include "input.h"
+#include "cursor.h"
+#include "client.h"
+#include "latency.h"
+#include "metrics.h"
+#include "trace.h"
+#include "loop.h"
+#include "bufferpool.h"
+#include "unixsock.h"
+#include "record.h"
 #include "updatescreen.h"
 
+#include <poll.h>
+
 // State variables
 int idle = 1;
 int suspend = 0;
 
-// Update loop signal flag
-volatile sig_atomic_t updateLoop = 1;
+// Update loop flag
+int updateLoop = 1;
 
 // Connection variables
 char serverHostname[256] = "";
@@ -21,38 +32,113 @@ int serverPort = 5900;
 char *reverseTarget = NULL;
 int reversePort = 5500;
 int clientSession = 0;
+int disableTcp = 0;
+
+// Listening sockets opened before the framebuffer probe
+rfbSocket listenSock = RFB_INVALID_SOCKET;
+rfbSocket listen6Sock = RFB_INVALID_SOCKET;
 
 // Maximum FPS
 int targetFps = 20;
 
 // Options
 int disablePointer = 0;
+int disableDeepIdle = 0;
+
+// Framebuffer and input devices are released while no client is connected
+int deepIdle = 0;
 #ifdef HAVE_LIBDRM
 int forceFbdevBackend = 0;
+int multiHead = 0;
 #endif
 int printVncDebug = 0;
 
 void clientDisconnect(rfbClientPtr cl) {
-	if (!printVncDebug)
-		LOG(" [%d] Client disconnected.\n", (int)(intptr_t)cl->clientData);
+	client_info_t *info = cl->clientData;
+
+	if (!printVncDebug && !info->recorder) {
+		LOG(" [%d] Client disconnected.\n", info->session);
+		logLatency(cl);
+	}
+
+	releaseSharedFormat(cl);
+	videoCloseClient(cl);
+	recordClientGone(cl);
+#ifdef HAVE_OPENH264
+	h264CloseClient(cl);
+#endif
+	free(info);
+	cl->clientData = NULL;
+}
+
+void clientDisplay(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+
+	if (info)
+		info->sendStart = TRACE_START();
+
+	// Pixel format and encoding changes decide whether the shared buffers can be used
+	syncSharedFormat(cl);
+#ifdef HAVE_OPENH264
+	// Mostly moving content is sent as one H.264 frame instead of the changed rectangles
+	h264SendUpdate(cl);
+#endif
+	videoPrepareUpdate(cl);
+}
+
+void clientDisplayFinished(rfbClientPtr cl, int result) {
+	client_info_t *info = cl->clientData;
+
+	// Encoding and sending of one framebuffer update
+	if (info)
+		TRACE_STOP("rfbSendFramebufferUpdate", info->sendStart);
+
+	videoFinishUpdate(cl);
+
+	// Pushed updates are requested again by the server
+	continuousUpdateSent(cl);
+
+	latencyUpdateSent(cl, result);
+	metricsClientBytes(cl);
 }
 
 enum rfbNewClientAction clientConnect(rfbClientPtr cl) {
-	cl->clientData = (void*)(intptr_t)(++clientSession);
+	client_info_t *info = calloc(1, sizeof(client_info_t));
+	assert(info != NULL);
+
+	info->session = ++clientSession;
+	cl->clientData = info;
+
+	// The internal recording client is not announced
+	if (recordConnect(cl)) {
+		cl->clientGoneHook = clientDisconnect;
+		return RFB_CLIENT_ACCEPT;
+	}
+
+	// Local clients are named by their credentials, other users are refused
+	if (checkUnixPeer(cl) < 0) {
+		LOG(" [%d] Client refused on Unix socket: %s.\n", info->session, cl->host);
+		free(info);
+		cl->clientData = NULL;
+		return RFB_CLIENT_REFUSE;
+	}
+
 	if (!printVncDebug)
-		LOG(" [%d] Client connected from %s.\n", (int)(intptr_t)cl->clientData, cl->host);
+		LOG(" [%d] Client connected from %s.\n", info->session, cl->host);
 	cl->clientGoneHook = clientDisconnect;
 	return RFB_CLIENT_ACCEPT;
 }
 
 rfbBool checkPassword(rfbClientPtr cl, const char* response, int len) {
+	client_info_t *info = cl->clientData;
+
 	if (rfbCheckPasswordByList(cl, response, len)) {
-		if (!printVncDebug)
-			LOG(" [%d] Client authentication successful.\n", (int)(intptr_t)cl->clientData);
+		if (!printVncDebug && !info->recorder)
+			LOG(" [%d] Client authentication successful.\n", info->session);
 		return TRUE;
 	} else {
 		if (!printVncDebug)
-			LOG(" [%d] Client authentication failed.\n", (int)(intptr_t)cl->clientData);
+			LOG(" [%d] Client authentication failed.\n", info->session);
 		return FALSE;
 	}
 }
@@ -71,7 +157,7 @@ void initReverseConnection(char *target) {
 		host[len] = '\0';
 		reversePort = atoi(separator + 1);
 		if (reversePort <= 0 || reversePort > 65535) {
-			LOG("Invalid reverse port: TCP #%s.\n", separator + 1);
+			LOGE("Invalid reverse port: TCP #%s.\n", separator + 1);
 			exit(EXIT_FAILURE);
 		}
 	} else {
@@ -80,7 +166,7 @@ void initReverseConnection(char *target) {
 
 	cl = rfbReverseConnection(vncScreen, host, reversePort);
 	if (!cl) {
-		LOG("Failed to connect to reverse host: %s:%d.\n", host, reversePort);
+		LOGE("Failed to connect to reverse host: %s:%d.\n", host, reversePort);
 		exit(EXIT_FAILURE);
 	}
 
@@ -88,12 +174,23 @@ void initReverseConnection(char *target) {
 	rfbStartOnHoldClient(cl);
 }
 
-void initServer(void) {
+void initListen(void) {
+	// Local proxies connect without the TCP stack
+	initUnixSocket();
+	if (disableTcp)
+		return;
+
 	if (serverPort <= 0 || serverPort > 65535) {
-		LOG("Invalid server port: TCP #%d.\n", serverPort);
+		LOGE("Invalid server port: TCP #%d.\n", serverPort);
 		exit(EXIT_FAILURE);
 	}
 
+	// The port accepts connections (in the backlog) while the backend is still probed
+	listenSock = rfbListenOnTCPPort(serverPort, htonl(INADDR_ANY));
+	listen6Sock = rfbListenOnTCP6Port(serverPort, NULL);
+}
+
+void initServer(void) {
 	LOG("-- Initializing VNC server --\n");
 	LOG(" Screen resolution: %dx%d, bit depth: %d bpp.\n",
 		(int)screenFormat.width, (int)screenFormat.height, (int)screenFormat.bitsPerPixel);
@@ -102,22 +199,34 @@ void initServer(void) {
 		screenFormat.redMax, screenFormat.greenMax, screenFormat.blueMax);
 	LOG(" Screen buffer size: %d bytes.\n", (int)(screenFormat.size));
 
-	vncBuffer = calloc(screenFormat.width * screenFormat.height, screenFormat.bitsPerPixel / CHAR_BIT);
+	// The buffer of the previous screen is reused when the new one fits into it
+	vncBuffer = getPoolBuffer(screenFormat.size);
 	assert(vncBuffer != NULL);
 
+	initVideo();
+	initExport();
+#ifdef HAVE_OPENH264
+	initH264();
+#endif
+
 	vncScreen = rfbGetScreen(NULL, NULL, screenFormat.width, screenFormat.height, 8, 3,  screenFormat.bitsPerPixel / CHAR_BIT);
 	assert(vncScreen != NULL);
 
 	vncScreen->desktopName = serverHostname;
 	vncScreen->frameBuffer = (char *)vncBuffer;
-	vncScreen->port = serverPort;
-	vncScreen->ipv6port = serverPort;
+	vncScreen->port = disableTcp ? 0 : serverPort;
+	vncScreen->ipv6port = disableTcp ? 0 : serverPort;
 	vncScreen->kbdAddEvent = addKeyboardEvent;
 
 	if (!disablePointer)
 		vncScreen->ptrAddEvent = addPointerEvent;
 
 	vncScreen->newClientHook = clientConnect;
+	vncScreen->displayHook = clientDisplay;
+	vncScreen->displayFinishedHook = clientDisplayFinished;
+
+	// Clients of the TigerVNC family receive the updates without requesting them
+	initContinuousUpdates();
 
 	if (strcmp(serverPassword, "") != 0) {
 		char **passwords = malloc(2 * sizeof(char *));
@@ -137,48 +246,215 @@ void initServer(void) {
 
 	vncScreen->serverFormat.trueColour = TRUE;
 	vncScreen->serverFormat.bitsPerPixel = screenFormat.bitsPerPixel;
+	vncScreen->serverFormat.depth = screenFormat.redMax + screenFormat.greenMax + screenFormat.blueMax;
 
 	vncScreen->alwaysShared = TRUE;
 
+	// Updates are paced by the frame timer, libvncserver sends them without further delay
+	vncScreen->deferUpdateTime = 0;
+
 	rfbLogEnable(printVncDebug);
 
+	// Hand over the early (or kept) listening sockets, libvncserver opens its own after any other reinit
+	if (listenSock != RFB_INVALID_SOCKET || listen6Sock != RFB_INVALID_SOCKET) {
+		vncScreen->listenSock = listenSock;
+		vncScreen->listen6Sock = listen6Sock;
+		if (listenSock != RFB_INVALID_SOCKET)
+			FD_SET(listenSock, &vncScreen->allFds);
+		if (listen6Sock != RFB_INVALID_SOCKET)
+			FD_SET(listen6Sock, &vncScreen->allFds);
+		vncScreen->maxFd = MAX(vncScreen->maxFd, MAX(listenSock, listen6Sock));
+		vncScreen->socketState = RFB_SOCKET_READY;
+		listenSock = listen6Sock = RFB_INVALID_SOCKET;
+	}
+
 	LOG("-- Starting the server --\n");
 	rfbInitServer(vncScreen);
 
 	if (reverseTarget)
 		initReverseConnection(reverseTarget);
 
+	initRecording();
+
 	if (!printVncDebug)
 		LOG(" Debug output from libvncserver has been disabled.\n");
 }
 
-void sigHandler(int sig) {
-	updateLoop = 0;
+// The internal recording client does not count as a connected client
+static int clientsConnected(void) {
+	rfbClientPtr cl;
+
+	for (cl = vncScreen->clientHead; cl; cl = cl->next) {
+		if (!isRecordClient(cl))
+			return 1;
+	}
+
+	return 0;
+}
+
+void enterDeepIdle(void) {
+	LOG("-- Entering deep idle, no clients connected --\n");
+
+	// Nothing is polled until the next client connects
+	armFrameTimer(0);
+	waitInputDevices();
+	closeFrameBuffer();
+	closeVirtualKeyboard();
+	if (!disablePointer)
+		closeVirtualPointer();
+
+	deepIdle = 1;
+	syncEventSources();
+}
+
+// A client waits in the backlog of a listening socket (it is not accepted yet)
+static int connectionPending(void) {
+	struct pollfd fds[] = {
+		{ .fd = vncScreen->listenSock, .events = POLLIN },
+		{ .fd = vncScreen->listen6Sock, .events = POLLIN },
+		{ .fd = unixSocket, .events = POLLIN },
+	};
+
+	return poll(fds, sizeof(fds) / sizeof(fds[0]), 0) > 0;
+}
+
+// The listening sockets (and the connections in their backlog) are handed over to the next server
+static void keepListenSockets(void) {
+	listenSock = vncScreen->listenSock;
+	listen6Sock = vncScreen->listen6Sock;
+	vncScreen->listenSock = RFB_INVALID_SOCKET;
+	vncScreen->listen6Sock = RFB_INVALID_SOCKET;
+}
+
+int leaveDeepIdle(void) {
+	screen_format_t lastFormat = screenFormat;
+
+	LOG("-- Leaving deep idle, client connected --\n");
+
+	initFrameBuffer();
+	initInputDevices(1, !disablePointer);
+
+	deepIdle = 0;
+	syncEventSources();
+
+	// The served format can only be changed by a server reinit
+	if (screenFormat.width != lastFormat.width || screenFormat.height != lastFormat.height ||
+	    screenFormat.bitsPerPixel != lastFormat.bitsPerPixel ||
+	    screenFormat.redMax != lastFormat.redMax || screenFormat.redShift != lastFormat.redShift ||
+	    screenFormat.greenMax != lastFormat.greenMax || screenFormat.greenShift != lastFormat.greenShift ||
+	    screenFormat.blueMax != lastFormat.blueMax || screenFormat.blueShift != lastFormat.blueShift) {
+		LOG(" Screen format changed during deep idle.\n");
+		return 1;
+	}
+
+	// The screen content may have changed completely in the meantime
+	forceRefresh = 1;
+
+	return 0;
+}
+
+void processEvents(void) {
+	uint64_t timeStart = getMonotonicTime();
+
+	// Only ready sockets are handled, the event loop does the waiting
+	rfbProcessEvents(vncScreen, 0);
+	metrics.eventTime += getMonotonicTime() - timeStart;
+	TRACE_STOP("rfbProcessEvents", timeStart);
+
+	// Follow connected and disconnected clients (the recording client as well)
+	syncRecording();
+	syncEventSources();
+}
+
+void captureFrame(void) {
+	uint64_t timeStart = getMonotonicTime();
+
+	// Perform a screen update
+	updateScreen();
+	metrics.updateTime += getMonotonicTime() - timeStart;
+	TRACE_STOP("updateScreen", timeStart);
+
+	// Translate the changes once for every client pixel format
+	updateTranslations();
+#ifdef HAVE_OPENH264
+	h264UpdateFrame();
+#endif
+
+	// Local consumers read the same capture
+	exportFrame();
+
+	// Video tiles are sent at their own rate
+	if (videoRate)
+		videoFlush();
+
+	// Send the changes right away
+	processEvents();
 }
 
 void printUsage(char *str) {
-	LOG("\nUsage: %s [options]\n"
+	fprintf(stderr, "\nUsage: %s [options]\n"
 		"-h | -?          - Print this help\n"
 		"-P <port>        - Listening port\n"
 		"-n <name>        - Server name\n"
 		"-p <password>    - Password to access server\n"
+		"-u <path>        - Listen on a Unix domain socket (mode 0660) in addition to TCP\n"
+		"-U               - Do not listen on TCP (requires -u)\n"
 		"-R <host[:port]> - Host for reverse connection (default port: 5500)\n"
+		"-k <file>        - Keymap file for non-US layouts (lines of \"<keysym> <scancode>\")\n"
 		"-m               - Mouseless mode (disable virtual pointer)\n"
+		"-i               - Disable deep idle (keep devices open without clients)\n"
+		"-r <rate>        - Pointer motion rate in Hz, faster motion is coalesced (default: 120, 0: off)\n"
+		"-V <rate>        - Detect video regions and send them lossy at this rate in Hz (default: 0, off)\n"
+#ifdef HAVE_OPENH264
+		"-x <kbps>        - Send full-motion content as H.264 at this bitrate to supporting clients (default: 0, off)\n"
+#endif
+		"-s <scale>       - Serve a downscaled screen: divisor (2, 1/3, ...) or size to fit (e.g. 1920x1080)\n"
 #ifdef HAVE_LIBDRM
 		"-F               - Force FBDEV backend (ignore DRM initialization)\n"
+		"-M               - Multi-head mode (combine all active DRM outputs side by side)\n"
 #endif
-		"-d               - Print libvncserver debug output\n", str);
+		"-H               - Allocate the screen buffers in huge pages\n"
+		"-L               - Lock the screen buffers in memory\n"
+		"-e <name>        - Export the captured frames to this POSIX shared memory object (e.g. /aml-vnc)\n"
+		"-A <dir>         - Record the screen to .fbs files with an input event log in this directory while clients are connected\n"
+		"-z               - Compress the recordings (gzip)\n"
+		"-Z <MiB>         - Size of a recording file before the next one is started (default: 256)\n"
+		"-T <file>        - Enable tracing, SIGUSR2 writes the trace (Chrome trace JSON) to the file\n"
+		"-S <path>        - Serve metrics (Prometheus text format) and snapshots (/snapshot.png, /snapshot.jpg) on a Unix socket\n"
+		"-d               - Print libvncserver debug output\n"
+		"--startup-report - Print the time spent in each startup phase\n", str);
 }
 
 void serverStateChange(int state) {
+	uint64_t timeStart;
+
 	if (state == SERVER_STOP || state == SERVER_REINIT) {
+		waitInputDevices();
 		rfbShutdownServer(vncScreen, TRUE);
-		free(vncScreen->frameBuffer);
+		closeCursor();
+		putPoolBuffer(vncScreen->frameBuffer);
 		rfbScreenCleanup(vncScreen);
-		closeFrameBuffer();
-		if (state == SERVER_STOP)
-			closeVirtualKeyboard();
-		if (!disablePointer)
+		closeVideo();
+		closeExport();
+#ifdef HAVE_OPENH264
+		closeH264();
+#endif
+		if (!deepIdle)
+			closeFrameBuffer();
+		if (state == SERVER_STOP) {
+			logInputStats();
+			if (!deepIdle)
+				closeVirtualKeyboard();
+			closeKeymap();
+			closeMetrics();
+			closeRecording();
+			closeUnixSocket();
+			closeTrace();
+			closeBufferPool();
+			closeEventLoop();
+			closeWorkers();
+		}
+		if (!disablePointer && !deepIdle)
 			closeVirtualPointer();
 	}
 
@@ -186,20 +462,40 @@ void serverStateChange(int state) {
 		usleep(reinitDelay * 1000);
 
 	if (state == SERVER_INIT || state == SERVER_REINIT) {
+		timeStart = getMonotonicTime();
 		initFrameBuffer();
-		if (state == SERVER_INIT)
-			initVirtualKeyboard();
-		if (!disablePointer)
-			initVirtualPointer();
+		startupPhase("framebuffer", timeStart);
+
+		if (state == SERVER_INIT) {
+			timeStart = getMonotonicTime();
+			initTrace();
+			initMetrics();
+			initKeymap();
+			startupPhase("trace, metrics and keymap", timeStart);
+		}
+
+		// Input devices are created in the background while the server starts
+		if (state == SERVER_INIT || !disablePointer)
+			initInputDevices(state == SERVER_INIT, !disablePointer);
+
+		timeStart = getMonotonicTime();
 		initServer();
+		startupPhase("server", timeStart);
 	}
 }
 
 int main(int argc, char **argv) {
-	struct timespec tsNow;
-	uint64_t timeLimit, timeLast, timeNow;
+	uint64_t timeLimit, timeLast, timeStart;
 	char header[128];
-	int i;
+	int stateChange, events, frameWait, generation, i;
+
+	startupTime = getMonotonicTime();
+
+	// Block the signals before any thread is started, they are read from the event loop
+	initEventLoop();
+
+	// Start the logger first, everything below may already log
+	initLog();
 
 	// Set the default server name based on the hostname
 	gethostname(serverHostname, sizeof(serverHostname));
@@ -211,12 +507,52 @@ int main(int argc, char **argv) {
 		snprintf(serverPassword, sizeof(serverPassword), "%s", getenv("VNC_PASSWORD"));
 	if (getenv("VNC_PORT"))
 		serverPort = atoi(getenv("VNC_PORT"));
+	if (getenv("VNC_UNIXSOCKET"))
+		unixSocketPath = getenv("VNC_UNIXSOCKET");
+	if (getenv("VNC_NOTCP") && !strcasecmp(getenv("VNC_NOTCP"), "true"))
+		disableTcp = 1;
 	if (getenv("VNC_NOMOUSE") && !strcasecmp(getenv("VNC_NOMOUSE"), "true"))
 		disablePointer = 1;
+	if (getenv("VNC_KEYMAP"))
+		keymapFile = getenv("VNC_KEYMAP");
+	if (getenv("VNC_NODEEPIDLE") && !strcasecmp(getenv("VNC_NODEEPIDLE"), "true"))
+		disableDeepIdle = 1;
+	if (getenv("VNC_POINTERRATE"))
+		pointerRate = atoi(getenv("VNC_POINTERRATE"));
+	if (getenv("VNC_VIDEORATE"))
+		videoRate = atoi(getenv("VNC_VIDEORATE"));
+#ifdef HAVE_OPENH264
+	if (getenv("VNC_H264"))
+		h264Bitrate = atoi(getenv("VNC_H264"));
+#endif
+	if (getenv("VNC_SCALE") && parseScale(getenv("VNC_SCALE")) < 0) {
+		LOGE("Invalid scale: %s\n", getenv("VNC_SCALE"));
+		exit(EXIT_FAILURE);
+	}
 #ifdef HAVE_LIBDRM
 	if (getenv("VNC_FORCEFBDEV") && !strcasecmp(getenv("VNC_FORCEFBDEV"), "true"))
 		forceFbdevBackend = 1;
+	if (getenv("VNC_MULTIHEAD") && !strcasecmp(getenv("VNC_MULTIHEAD"), "true"))
+		multiHead = 1;
 #endif
+	if (getenv("VNC_HUGEPAGES") && !strcasecmp(getenv("VNC_HUGEPAGES"), "true"))
+		useHugePages = 1;
+	if (getenv("VNC_LOCKBUFFERS") && !strcasecmp(getenv("VNC_LOCKBUFFERS"), "true"))
+		lockBuffers = 1;
+	if (getenv("VNC_SHMEXPORT"))
+		exportName = getenv("VNC_SHMEXPORT");
+	if (getenv("VNC_RECORD"))
+		recordDir = getenv("VNC_RECORD");
+	if (getenv("VNC_RECORDCOMPRESS") && !strcasecmp(getenv("VNC_RECORDCOMPRESS"), "true"))
+		recordCompress = 1;
+	if (getenv("VNC_RECORDSIZE"))
+		recordSegmentSize = atoi(getenv("VNC_RECORDSIZE"));
+	if (getenv("VNC_METRICS"))
+		metricsPath = getenv("VNC_METRICS");
+	if (getenv("VNC_TRACE"))
+		traceFile = getenv("VNC_TRACE");
+	if (getenv("VNC_STARTUPREPORT") && !strcasecmp(getenv("VNC_STARTUPREPORT"), "true"))
+		startupReport = 1;
 	if (getenv("VNC_DEBUGLOG") && !strcasecmp(getenv("VNC_DEBUGLOG"), "true"))
 		printVncDebug = 1;
 
@@ -236,7 +572,7 @@ int main(int argc, char **argv) {
 				break;
 			case 'n':
 				if (++i >= argc || argv[i][0] == '-') {
-					LOG("Missing argument for '%s'.\n", argv[i-1]);
+					LOGE("Missing argument for '%s'.\n", argv[i-1]);
 					printUsage(argv[0]);
 					exit(EXIT_FAILURE);
 				}
@@ -244,7 +580,7 @@ int main(int argc, char **argv) {
 				break;
 			case 'p':
 				if (++i >= argc || argv[i][0] == '-') {
-					LOG("Missing argument for '%s'.\n", argv[i-1]);
+					LOGE("Missing argument for '%s'.\n", argv[i-1]);
 					printUsage(argv[0]);
 					exit(EXIT_FAILURE);
 				}
@@ -252,81 +588,343 @@ int main(int argc, char **argv) {
 				break;
 			case 'P':
 				if (++i >= argc || argv[i][0] == '-') {
-					LOG("Missing argument for '%s'.\n", argv[i-1]);
+					LOGE("Missing argument for '%s'.\n", argv[i-1]);
 					printUsage(argv[0]);
 				exit(EXIT_FAILURE);
 				}
 				serverPort = atoi(argv[i]);
 				break;
+			case 'u':
+				if (++i >= argc || argv[i][0] == '-') {
+					LOGE("Missing argument for '%s'.\n", argv[i-1]);
+					printUsage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				unixSocketPath = argv[i];
+				break;
+			case 'U':
+				disableTcp = 1;
+				break;
 			case 'R':
 				if (++i >= argc || argv[i][0] == '-') {
-					LOG("Missing argument for '%s'.\n", argv[i-1]);
+					LOGE("Missing argument for '%s'.\n", argv[i-1]);
 					printUsage(argv[0]);
 					exit(EXIT_FAILURE);
 				}
 				reverseTarget = argv[i];
 				break;
+			case 'k':
+				if (++i >= argc || argv[i][0] == '-') {
+					LOGE("Missing argument for '%s'.\n", argv[i-1]);
+					printUsage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				keymapFile = argv[i];
+				break;
 			case 'm':
 				disablePointer = 1;
 				break;
+			case 'i':
+				disableDeepIdle = 1;
+				break;
+			case 'r':
+				if (++i >= argc || argv[i][0] == '-') {
+					LOGE("Missing argument for '%s'.\n", argv[i-1]);
+					printUsage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				pointerRate = atoi(argv[i]);
+				break;
+			case 'V':
+				if (++i >= argc || argv[i][0] == '-') {
+					LOGE("Missing argument for '%s'.\n", argv[i-1]);
+					printUsage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				videoRate = atoi(argv[i]);
+				break;
+#ifdef HAVE_OPENH264
+			case 'x':
+				if (++i >= argc || argv[i][0] == '-') {
+					LOGE("Missing argument for '%s'.\n", argv[i-1]);
+					printUsage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				h264Bitrate = atoi(argv[i]);
+				break;
+#endif
+			case 's':
+				if (++i >= argc || argv[i][0] == '-') {
+					LOGE("Missing argument for '%s'.\n", argv[i-1]);
+					printUsage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				if (parseScale(argv[i]) < 0) {
+					LOGE("Invalid scale: %s\n", argv[i]);
+					printUsage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
 #ifdef HAVE_LIBDRM
 			case 'F':
 				forceFbdevBackend = 1;
 				break;
+			case 'M':
+				multiHead = 1;
+				break;
 #endif
+			case 'H':
+				useHugePages = 1;
+				break;
+			case 'L':
+				lockBuffers = 1;
+				break;
+			case 'e':
+				if (++i >= argc || argv[i][0] == '-') {
+					LOGE("Missing argument for '%s'.\n", argv[i-1]);
+					printUsage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				exportName = argv[i];
+				break;
+			case 'A':
+				if (++i >= argc || argv[i][0] == '-') {
+					LOGE("Missing argument for '%s'.\n", argv[i-1]);
+					printUsage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				recordDir = argv[i];
+				break;
+			case 'z':
+				recordCompress = 1;
+				break;
+			case 'Z':
+				if (++i >= argc || argv[i][0] == '-') {
+					LOGE("Missing argument for '%s'.\n", argv[i-1]);
+					printUsage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				recordSegmentSize = atoi(argv[i]);
+				break;
+			case 'S':
+				if (++i >= argc || argv[i][0] == '-') {
+					LOGE("Missing argument for '%s'.\n", argv[i-1]);
+					printUsage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				metricsPath = argv[i];
+				break;
+			case 'T':
+				if (++i >= argc || argv[i][0] == '-') {
+					LOGE("Missing argument for '%s'.\n", argv[i-1]);
+					printUsage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				traceFile = argv[i];
+				break;
 			case 'd':
 				printVncDebug = 1;
 				break;
+			case '-':
+				if (!strcmp(argv[i], "--startup-report")) {
+					startupReport = 1;
+					break;
+				}
+				LOGE("Unknown option: %s\n", argv[i]);
+				printUsage(argv[0]);
+				exit(EXIT_FAILURE);
 			default:
-				LOG("Unknown option: %s\n", argv[i]);
+				LOGE("Unknown option: %s\n", argv[i]);
 				printUsage(argv[0]);
 				exit(EXIT_FAILURE);
 			}
 		}
 	}
 
+	if (pointerRate < 0) {
+		LOGE("Invalid pointer rate: %d Hz.\n", pointerRate);
+		exit(EXIT_FAILURE);
+	}
+
+	if (disableTcp && !unixSocketPath) {
+		LOGE("TCP can only be disabled with a Unix socket (-u).\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (recordSegmentSize < 1) {
+		LOGE("Invalid recording size: %d MiB.\n", recordSegmentSize);
+		exit(EXIT_FAILURE);
+	}
+
+	if (videoRate < 0) {
+		LOGE("Invalid video rate: %d Hz.\n", videoRate);
+		exit(EXIT_FAILURE);
+	}
+
+#ifdef HAVE_OPENH264
+	if (h264Bitrate < 0 || h264Bitrate > H264_MAX_BITRATE) {
+		LOGE("Invalid H.264 bitrate: %d kbit/s.\n", h264Bitrate);
+		exit(EXIT_FAILURE);
+	}
+
+	// The full-motion content is found by the video detection
+	if (h264Bitrate && !videoRate)
+		videoRate = H264_VIDEO_RATE;
+#endif
+
 	// Start initialization
 	srand(time(NULL));
-	signal(SIGINT, sigHandler);
-	signal(SIGTERM, sigHandler);
+
+	timeStart = getMonotonicTime();
+	initListen();
+	startupPhase("listen", timeStart);
+
 	serverStateChange(SERVER_INIT);
-	if (vncScreen->listenSock < 0) {
+	if (!disableTcp && vncScreen->listenSock < 0) {
 		if (!printVncDebug)
-			LOG(" Server port already in use: TCP #%d.\n", serverPort);
+			LOGE(" Server port already in use: TCP #%d.\n", serverPort);
 		serverStateChange(SERVER_STOP);
 		return -1;
 	}
 
+	startupPhase("startup", startupTime);
+
 	// Set refresh cycle check values
 	timeLimit = 1000000ULL / targetFps;
-	timeLast = 0;
+	timeLast = getMonotonicTime();
+	frameWait = 0;
+
+	syncEventSources();
+	armFrameTimer(timeLast + timeLimit);
 
-	// Start the update loop
+	// Start the update loop (it blocks until a socket, the frame timer, a frame event or a signal is ready)
 	while (updateLoop) {
-		rfbProcessEvents(vncScreen, vncScreen->deferUpdateTime * 1000);
-
-		if (!checkBufferStateChange()) {
-			if (vncScreen->clientHead != NULL) {
-				// Ignore events if they arrive before the next frame expected
-				clock_gettime(CLOCK_MONOTONIC, &tsNow);
-				timeNow = (uint64_t)tsNow.tv_sec * 1000000ULL + tsNow.tv_nsec / 1000ULL;
-
-				// When idle, it only updates every fourth frame
-				if (timeNow - timeLast >= (idle ? timeLimit * 4 : timeLimit)) {
-					if (!suspend) {
-						// Perform a screen update
-						updateScreen();
-					} else {
-						// Perform a screen cleanup
-						clearScreen();
-					}
-					timeLast = timeNow;
+		events = waitEvents(getPointerFlushDelay());
+
+		if (events & EVENT_STOP)
+			break;
+
+		// Print the latency histograms on request (SIGUSR1)
+		if (events & EVENT_REPORT)
+			logLatencyReport();
+
+		// Write the trace ring buffer on request (SIGUSR2)
+		if (events & EVENT_DUMP)
+			dumpTrace();
+
+		if (events & EVENT_SOCKET) {
+			// A connecting client wakes the server before it is accepted, a changed format is served by a reinit first
+			if (deepIdle && connectionPending()) {
+				if (leaveDeepIdle()) {
+					LOG("-- Server reinitialization started --\n");
+					metrics.hardReinits++;
+					keepListenSockets();
+					resetEventSources();
+					serverStateChange(SERVER_REINIT);
+					syncEventSources();
+				}
+
+				frameWait = 0;
+				timeLast = getMonotonicTime();
+				armFrameTimer(timeLast);
+			}
+
+			// New local clients join the libvncserver client list first
+			acceptUnixClients();
+			processEvents();
+
+			// Answer the metrics scrapes
+			serveMetrics();
+		}
+
+		// Deep idle follows the client count
+		if (!disableDeepIdle) {
+			if (!deepIdle && !clientsConnected()) {
+				enterDeepIdle();
+				continue;
+			}
+
+			if (deepIdle && clientsConnected()) {
+				if (leaveDeepIdle()) {
+					LOG("-- Server reinitialization started --\n");
+					metrics.hardReinits++;
+					resetEventSources();
+					serverStateChange(SERVER_REINIT);
+					syncEventSources();
+				}
+
+				// Capture the first frame right away
+				frameWait = 0;
+				timeLast = getMonotonicTime();
+				armFrameTimer(timeLast);
+				continue;
+			}
+
+			if (deepIdle)
+				continue;
+		}
+
+		// Write the last coalesced pointer position
+		flushPointerMotion();
+
+		// The vertical blank after a frame deadline starts the capture
+		if (events & EVENT_FRAME) {
+			handleFrameEvent();
+			if (frameWait) {
+				frameWait = 0;
+				captureFrame();
+			}
+		}
+
+		if (!(events & EVENT_TIMER))
+			continue;
+
+		timeStart = getMonotonicTime();
+		generation = frameBufferGeneration;
+		stateChange = checkBufferStateChange();
+		metrics.stateCheckTime += getMonotonicTime() - timeStart;
+		TRACE_STOP("checkBufferStateChange", timeStart);
+
+		// A soft reinit reopened the backend, its frame event descriptor is watched again
+		if (!stateChange && frameBufferGeneration != generation)
+			syncEventSources();
+
+		if (!stateChange) {
+			if (clientsConnected()) {
+				// Publish hardware cursor shape and position
+				timeStart = TRACE_START();
+				updateCursor();
+				TRACE_STOP("updateCursor", timeStart);
+
+				if (suspend) {
+					// Perform a screen cleanup
+					clearScreen();
+					updateTranslations();
+#ifdef HAVE_OPENH264
+					h264UpdateFrame();
+#endif
+					exportFrame();
+					processEvents();
+				} else if (frameWait || !requestFrameEvent()) {
+					// Without a frame event (or if the last one never arrived) the deadline itself captures
+					frameWait = 0;
+					captureFrame();
+				} else {
+					frameWait = 1;
 				}
 			}
 		} else {
 			LOG("-- Server reinitialization started --\n");
+			metrics.hardReinits++;
+			resetEventSources();
 			serverStateChange(SERVER_REINIT);
+			syncEventSources();
+			frameWait = 0;
 		}
+
+		// When idle (or without clients), it only updates every fourth frame
+		timeLast = MAX(timeLast + (idle || !clientsConnected() ? timeLimit * 4 : timeLimit), getMonotonicTime());
+		armFrameTimer(timeLast);
 	}
 
 	LOG("-- Shutting down the server --\n");
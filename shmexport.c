@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Shared-memory frame export (a POSIX shm ring of captured frames with their damage)
+
+#include "shmexport.h"
+#include "updatescreen.h"
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+_Static_assert(sizeof(export_header_t) <= EXPORT_HEADER_SIZE, "export header exceeds its page");
+
+// Name of the shared memory object (NULL disables the export)
+char *exportName = NULL;
+
+static export_header_t *header = NULL;
+static size_t exportSize;
+static sraRegionPtr frameDamage = NULL; // Changed since the last published frame
+static sraRegionPtr slotDamage[EXPORT_SLOTS]; // Changed since the slot was written
+
+void initExport(void) {
+	int pixelBytes = screenFormat.bitsPerPixel / CHAR_BIT;
+	int fd, i;
+
+	if (!exportName)
+		return;
+
+	if (exportName[0] != '/' || strchr(exportName + 1, '/')) {
+		LOGE(" Invalid shared memory name: %s.\n", exportName);
+		exit(EXIT_FAILURE);
+	}
+
+	exportSize = EXPORT_HEADER_SIZE +
+		EXPORT_SLOTS * (((size_t)screenFormat.width * screenFormat.height * pixelBytes + 4095) & ~(size_t)4095);
+
+	// Readers of the previous server still map the old object, they see it closed
+	shm_unlink(exportName);
+	fd = shm_open(exportName, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, EXPORT_MODE);
+	if (fd < 0) {
+		LOGE(" Could not create shared memory '%s': %s.\n", exportName, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	fchmod(fd, EXPORT_MODE);
+
+	if (ftruncate(fd, exportSize) < 0) {
+		LOGE(" Could not size shared memory '%s': %s.\n", exportName, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	header = mmap(NULL, exportSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		LOGE(" Could not map shared memory '%s': %s.\n", exportName, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	header->version = EXPORT_VERSION;
+	header->slotCount = EXPORT_SLOTS;
+	header->slotSize = (exportSize - EXPORT_HEADER_SIZE) / EXPORT_SLOTS;
+	header->width = screenFormat.width;
+	header->height = screenFormat.height;
+	header->stride = screenFormat.width * pixelBytes;
+	header->bitsPerPixel = screenFormat.bitsPerPixel;
+	header->redShift = screenFormat.redShift;
+	header->greenShift = screenFormat.greenShift;
+	header->blueShift = screenFormat.blueShift;
+	header->redBits = screenFormat.redMax;
+	header->greenBits = screenFormat.greenMax;
+	header->blueBits = screenFormat.blueMax;
+	header->latest = EXPORT_SLOTS - 1;
+
+	// Every slot and the first frame start with the whole screen
+	frameDamage = sraRgnCreateRect(0, 0, screenFormat.width, screenFormat.height);
+	for (i = 0; i < EXPORT_SLOTS; i++)
+		slotDamage[i] = sraRgnCreateRect(0, 0, screenFormat.width, screenFormat.height);
+
+	// The magic is written last, the header is complete for readers which check it
+	__atomic_store_n(&header->magic, EXPORT_MAGIC, __ATOMIC_RELEASE);
+
+	LOG(" Frames are exported to shared memory '%s' (%d slots, %zu bytes).\n", exportName, EXPORT_SLOTS, exportSize);
+}
+
+void closeExport(void) {
+	int i;
+
+	if (!header)
+		return;
+
+	// Waiting readers wake up and open the object of the next server
+	__atomic_store_n(&header->closed, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&header->sequence, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &header->sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+	munmap(header, exportSize);
+	shm_unlink(exportName);
+	header = NULL;
+
+	sraRgnDestroy(frameDamage);
+	frameDamage = NULL;
+	for (i = 0; i < EXPORT_SLOTS; i++) {
+		sraRgnDestroy(slotDamage[i]);
+		slotDamage[i] = NULL;
+	}
+}
+
+// Inclusive bounds, like markTranslationDirty()
+void exportMarkDirty(int x1, int y1, int x2, int y2) {
+	sraRegionPtr rect;
+
+	if (!header)
+		return;
+
+	rect = sraRgnCreateRect(x1, y1, x2 + 1, y2 + 1);
+	sraRgnOr(frameDamage, rect);
+	sraRgnDestroy(rect);
+}
+
+static void copyRect(uint8_t *dst, const sraRect *rect) {
+	int pixelBytes = header->bitsPerPixel / CHAR_BIT;
+	size_t offset;
+	int y;
+
+	for (y = rect->y1; y < rect->y2; y++) {
+		offset = (size_t)y * header->stride + rect->x1 * pixelBytes;
+		memcpy(dst + offset, (uint8_t *)vncBuffer + offset, (rect->x2 - rect->x1) * pixelBytes);
+	}
+}
+
+// Publishes the changes of the last capture in the next slot of the ring
+void exportFrame(void) {
+	sraRectangleIterator *iterator;
+	export_slot_t *slot;
+	sraRect rect;
+	uint32_t next, count = 0;
+	int i, x1, y1, x2, y2;
+	uint8_t *data;
+	uint64_t traceStart;
+
+	if (!header || sraRgnEmpty(frameDamage))
+		return;
+
+	traceStart = TRACE_START();
+
+	next = (header->latest + 1) % EXPORT_SLOTS;
+	slot = &header->slots[next];
+	data = (uint8_t *)header + EXPORT_HEADER_SIZE + (size_t)next * header->slotSize;
+
+	for (i = 0; i < EXPORT_SLOTS; i++)
+		sraRgnOr(slotDamage[i], frameDamage);
+
+	// Readers see the odd sequence before any of the new content
+	__atomic_add_fetch(&slot->sequence, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	// The slot catches up with every change since it was written last
+	iterator = sraRgnGetIterator(slotDamage[next]);
+	while (sraRgnIteratorNext(iterator, &rect))
+		copyRect(data, &rect);
+	sraRgnReleaseIterator(iterator);
+	sraRgnMakeEmpty(slotDamage[next]);
+
+	// The readers get the damage against the previous frame
+	x1 = y1 = INT_MAX;
+	x2 = y2 = 0;
+	iterator = sraRgnGetIterator(frameDamage);
+	while (sraRgnIteratorNext(iterator, &rect)) {
+		if (count < EXPORT_MAX_RECTS) {
+			slot->rects[count].x = rect.x1;
+			slot->rects[count].y = rect.y1;
+			slot->rects[count].width = rect.x2 - rect.x1;
+			slot->rects[count].height = rect.y2 - rect.y1;
+		}
+		count++;
+		x1 = MIN(x1, rect.x1);
+		y1 = MIN(y1, rect.y1);
+		x2 = MAX(x2, rect.x2);
+		y2 = MAX(y2, rect.y2);
+	}
+	sraRgnReleaseIterator(iterator);
+	sraRgnMakeEmpty(frameDamage);
+
+	if (count > EXPORT_MAX_RECTS) {
+		slot->rects[0].x = x1;
+		slot->rects[0].y = y1;
+		slot->rects[0].width = x2 - x1;
+		slot->rects[0].height = y2 - y1;
+		count = 1;
+	}
+	slot->rectCount = count;
+	slot->frame = header->sequence + 1;
+	slot->timestamp = getMonotonicTime();
+
+	__atomic_add_fetch(&slot->sequence, 1, __ATOMIC_RELEASE);
+
+	// Readers waiting on the sequence find the new frame in the latest slot
+	__atomic_store_n(&header->latest, next, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&header->sequence, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &header->sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+	TRACE_STOP("exportFrame", traceStart);
+}
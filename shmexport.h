@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for the shared-memory frame export (also the layout read by the consumers)
+
+#ifndef SHMEXPORT_H
+#define SHMEXPORT_H
+
+#include "common.h"
+
+#define EXPORT_MAGIC 0x434e5641 // "AVNC"
+#define EXPORT_VERSION 1
+#define EXPORT_SLOTS 3 // Frames in the ring, a reader copying the latest one is not overwritten by the next
+#define EXPORT_MAX_RECTS 16 // Damage rectangles per frame, more are merged into their bounding box
+#define EXPORT_HEADER_SIZE 4096 // The slot data starts on the next page
+#define EXPORT_MODE 0640 // Consumers of the server group may map the frames read-only
+
+typedef struct {
+	uint32_t x, y, width, height;
+} export_rect_t;
+
+typedef struct {
+	uint32_t sequence; // Odd while the slot is written (seqlock)
+	uint32_t frame; // Frame number of the content (header sequence when it was published)
+	uint64_t timestamp; // Capture time in us (CLOCK_MONOTONIC)
+	uint32_t rectCount; // Damage against the previous frame
+	uint32_t reserved;
+	export_rect_t rects[EXPORT_MAX_RECTS];
+} export_slot_t;
+
+// Layout of the shared memory object: this header, then EXPORT_SLOTS frames of slotSize bytes
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t closed; // The server reinitialized or stopped, the object must be opened again
+	uint32_t sequence; // Published frames (futex, woken for every frame)
+	uint32_t latest; // Slot of the last published frame
+	uint32_t slotCount;
+	uint32_t slotSize; // Bytes from one slot to the next
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride; // Bytes per line
+	uint32_t bitsPerPixel;
+	uint8_t redShift, greenShift, blueShift;
+	uint8_t redBits, greenBits, blueBits;
+	uint8_t reserved[2];
+	export_slot_t slots[EXPORT_SLOTS];
+} export_header_t;
+
+extern char *exportName;
+
+void initExport(void);
+void closeExport(void);
+void exportMarkDirty(int x1, int y1, int x2, int y2);
+void exportFrame(void);
+
+#endif
@@ -0,0 +1,311 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// On-demand PNG and JPEG snapshots of a screen buffer copy (strips are converted and deflated in parallel)
+
+#include "snapshot.h"
+#include "workers.h"
+
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <zlib.h>
+
+typedef struct {
+	int first; // First line of the strip
+	int lines;
+	uint8_t *filtered; // Lines with their PNG filter byte
+	uint8_t *out;
+	size_t outSize;
+	uLong adler;
+	int failed;
+} snapshot_strip_t;
+
+// State of the running snapshot, shared with the strip threads
+static const uint8_t *source;
+static const screen_format_t *sourceFormat;
+static uint8_t *image; // RGB24
+static int imageWidth, imageHeight, imageScale;
+static snapshot_strip_t strips[WORKER_MAX];
+static int stripCount;
+
+typedef void (*strip_job_t)(int index);
+
+typedef struct {
+	pthread_t thread;
+	strip_job_t job;
+	int index;
+} strip_thread_t;
+
+static void *stripThread(void *arg) {
+	strip_thread_t *strip = arg;
+
+	strip->job(strip->index);
+	return NULL;
+}
+
+// Runs the job for every strip on threads of its own, the worker pool belongs to the main loop
+static void runStrips(strip_job_t job) {
+	strip_thread_t threads[WORKER_MAX];
+	int started[WORKER_MAX];
+	int i;
+
+	for (i = 1; i < stripCount; i++) {
+		threads[i].job = job;
+		threads[i].index = i;
+		started[i] = pthread_create(&threads[i].thread, NULL, stripThread, &threads[i]) == 0;
+		if (!started[i])
+			job(i);
+	}
+
+	job(0);
+
+	for (i = 1; i < stripCount; i++) {
+		if (started[i])
+			pthread_join(threads[i].thread, NULL);
+	}
+}
+
+// Box filtered RGB24 copy of one strip of the screen buffer (strip job)
+static void convertStrip(int index) {
+	const int pixelBytes = sourceFormat->bitsPerPixel / CHAR_BIT;
+	const int lineBytes = sourceFormat->width * pixelBytes;
+	const uint32_t redMask = (1 << sourceFormat->redMax) - 1;
+	const uint32_t greenMask = (1 << sourceFormat->greenMax) - 1;
+	const uint32_t blueMask = (1 << sourceFormat->blueMax) - 1;
+	const int area = imageScale * imageScale;
+	snapshot_strip_t *strip = &strips[index];
+	int x, y, i, j, r, g, b;
+	const uint8_t *src;
+	uint32_t pixel;
+	uint8_t *dst;
+
+	for (y = strip->first; y < strip->first + strip->lines; y++) {
+		dst = image + (size_t)y * imageWidth * 3;
+		for (x = 0; x < imageWidth; x++) {
+			r = g = b = 0;
+			for (j = 0; j < imageScale; j++) {
+				src = source + (size_t)(y * imageScale + j) * lineBytes + x * imageScale * pixelBytes;
+				for (i = 0; i < imageScale; i++, src += pixelBytes) {
+					pixel = pixelBytes == 4 ? *(const uint32_t *)src : *(const uint16_t *)src;
+					r += ((pixel >> sourceFormat->redShift) & redMask) << (8 - sourceFormat->redMax);
+					g += ((pixel >> sourceFormat->greenShift) & greenMask) << (8 - sourceFormat->greenMax);
+					b += ((pixel >> sourceFormat->blueShift) & blueMask) << (8 - sourceFormat->blueMax);
+				}
+			}
+			*dst++ = r / area;
+			*dst++ = g / area;
+			*dst++ = b / area;
+		}
+	}
+}
+
+// Sub or no filter, whichever has the smaller sum of absolute values (the libpng heuristic)
+static void filterLine(uint8_t *dst, const uint8_t *src, int bytes) {
+	unsigned int sumNone = 0, sumSub = 0;
+	int i;
+	uint8_t value;
+
+	for (i = 0; i < bytes; i++) {
+		value = i < 3 ? src[i] : src[i] - src[i - 3];
+		dst[i + 1] = value;
+		sumNone += src[i] < 128 ? src[i] : 256 - src[i];
+		sumSub += value < 128 ? value : 256 - value;
+	}
+
+	if (sumNone <= sumSub) {
+		dst[0] = 0;
+		memcpy(dst + 1, src, bytes);
+	} else {
+		dst[0] = 1;
+	}
+}
+
+// Filters and deflates one strip into a raw deflate fragment (strip job)
+static void deflateStrip(int index) {
+	snapshot_strip_t *strip = &strips[index];
+	const int lineBytes = imageWidth * 3;
+	const size_t filteredSize = (size_t)strip->lines * (lineBytes + 1);
+	z_stream stream;
+	int y;
+
+	strip->failed = 1;
+	strip->filtered = malloc(filteredSize);
+	if (!strip->filtered)
+		return;
+
+	for (y = 0; y < strip->lines; y++)
+		filterLine(strip->filtered + (size_t)y * (lineBytes + 1), image + (size_t)(strip->first + y) * lineBytes, lineBytes);
+	strip->adler = adler32(adler32(0, NULL, 0), strip->filtered, filteredSize);
+
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit2(&stream, SNAPSHOT_PNG_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return;
+
+	// The strips end on a byte boundary, only the last one closes the stream
+	strip->outSize = deflateBound(&stream, filteredSize) + 64;
+	strip->out = malloc(strip->outSize);
+	if (strip->out) {
+		stream.next_in = strip->filtered;
+		stream.avail_in = filteredSize;
+		stream.next_out = strip->out;
+		stream.avail_out = strip->outSize;
+		if (deflate(&stream, index == stripCount - 1 ? Z_FINISH : Z_SYNC_FLUSH) != Z_STREAM_ERROR && !stream.avail_in) {
+			strip->outSize = stream.total_out;
+			strip->failed = 0;
+		}
+	}
+	deflateEnd(&stream);
+}
+
+static void put32(uint8_t *dst, uint32_t value) {
+	dst[0] = value >> 24;
+	dst[1] = value >> 16;
+	dst[2] = value >> 8;
+	dst[3] = value;
+}
+
+// Chunk length and type are written before, the data is in place
+static uint8_t *finishChunk(uint8_t *chunk, uint32_t length) {
+	put32(chunk, length);
+	put32(chunk + 8 + length, crc32(crc32(0, NULL, 0), chunk + 4, length + 4));
+	return chunk + 12 + length;
+}
+
+// One IDAT chunk of the concatenated strips (a zlib stream like pigz writes it)
+static int encodePng(uint8_t **data, size_t *size) {
+	size_t compressed = 0;
+	uint8_t *png, *chunk, *idat;
+	uLong adler;
+	int i;
+
+	runStrips(deflateStrip);
+
+	adler = strips[0].adler;
+	for (i = 0; i < stripCount; i++) {
+		if (strips[i].failed)
+			return -1;
+		compressed += strips[i].outSize;
+		if (i)
+			adler = adler32_combine(adler, strips[i].adler, (z_off_t)strips[i].lines * (imageWidth * 3 + 1));
+	}
+
+	png = malloc(8 + 25 + 12 + 2 + compressed + 4 + 12);
+	if (!png)
+		return -1;
+
+	memcpy(png, "\x89PNG\r\n\x1a\n", 8);
+
+	chunk = png + 8;
+	memcpy(chunk + 4, "IHDR", 4);
+	put32(chunk + 8, imageWidth);
+	put32(chunk + 12, imageHeight);
+	memcpy(chunk + 16, "\x08\x02\x00\x00\x00", 5); // 8 bits, RGB, deflate, adaptive filters, no interlace
+	chunk = finishChunk(chunk, 13);
+
+	memcpy(chunk + 4, "IDAT", 4);
+	idat = chunk + 8;
+	idat[0] = 0x78;
+	idat[1] = 0x01;
+	idat += 2;
+	for (i = 0; i < stripCount; i++) {
+		memcpy(idat, strips[i].out, strips[i].outSize);
+		idat += strips[i].outSize;
+	}
+	put32(idat, adler);
+	chunk = finishChunk(chunk, 2 + compressed + 4);
+
+	memcpy(chunk + 4, "IEND", 4);
+	chunk = finishChunk(chunk, 0);
+
+	*data = png;
+	*size = chunk - png;
+	return 0;
+}
+
+typedef struct {
+	struct jpeg_error_mgr manager;
+	jmp_buf jump;
+} jpeg_error_t;
+
+static void jpegError(j_common_ptr cinfo) {
+	longjmp(((jpeg_error_t *)cinfo->err)->jump, 1);
+}
+
+static int encodeJpeg(int quality, uint8_t **data, size_t *size) {
+	struct jpeg_compress_struct cinfo;
+	jpeg_error_t error;
+	unsigned char *buffer = NULL;
+	unsigned long length = 0;
+	JSAMPROW row;
+
+	cinfo.err = jpeg_std_error(&error.manager);
+	error.manager.error_exit = jpegError;
+	if (setjmp(error.jump)) {
+		jpeg_destroy_compress(&cinfo);
+		free(buffer);
+		return -1;
+	}
+
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &buffer, &length);
+
+	cinfo.image_width = imageWidth;
+	cinfo.image_height = imageHeight;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+
+	// Fast integer DCT without Huffman optimization (libjpeg-turbo runs it in SIMD)
+	cinfo.dct_method = JDCT_IFAST;
+	cinfo.optimize_coding = FALSE;
+
+	jpeg_start_compress(&cinfo, TRUE);
+	while (cinfo.next_scanline < cinfo.image_height) {
+		row = image + (size_t)cinfo.next_scanline * imageWidth * 3;
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+
+	*data = buffer;
+	*size = length;
+	return 0;
+}
+
+// Encodes a copy of the screen buffer off the main loop, the caller frees the data (0: success)
+int encodeSnapshot(const uint8_t *frame, const screen_format_t *frameFormat, int format, int scale, int quality, uint8_t **data, size_t *size) {
+	int i, result;
+
+	source = frame;
+	sourceFormat = frameFormat;
+	imageScale = scale;
+	imageWidth = frameFormat->width / scale;
+	imageHeight = frameFormat->height / scale;
+	if (!imageWidth || !imageHeight)
+		return -1;
+
+	image = malloc((size_t)imageWidth * imageHeight * 3);
+	if (!image)
+		return -1;
+
+	stripCount = MIN(WORKER_MAX, imageHeight);
+	for (i = 0; i < stripCount; i++) {
+		memset(&strips[i], 0, sizeof(snapshot_strip_t));
+		strips[i].first = imageHeight * i / stripCount;
+		strips[i].lines = imageHeight * (i + 1) / stripCount - strips[i].first;
+	}
+	runStrips(convertStrip);
+
+	if (format == SNAPSHOT_JPEG)
+		result = encodeJpeg(quality, data, size);
+	else
+		result = encodePng(data, size);
+
+	for (i = 0; i < stripCount; i++) {
+		free(strips[i].filtered);
+		free(strips[i].out);
+	}
+	free(image);
+	image = NULL;
+
+	return result;
+}
@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for on-demand PNG and JPEG snapshots
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "common.h"
+#include "framebuffer.h"
+
+#define SNAPSHOT_QUALITY 80 // Default JPEG quality
+#define SNAPSHOT_MAX_SCALE 8 // Largest downscale divisor
+#define SNAPSHOT_PNG_LEVEL 1 // zlib level, speed matters more than size
+#define SNAPSHOT_TIMEOUT 2000 // Send timeout of a snapshot in ms
+
+enum {
+	SNAPSHOT_PNG,
+	SNAPSHOT_JPEG
+};
+
+int encodeSnapshot(const uint8_t *frame, const screen_format_t *frameFormat, int format, int scale, int quality, uint8_t **data, size_t *size);
+
+#endif
@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Startup timing report
+
+#include "startup.h"
+
+int startupReport = 0;
+uint64_t startupTime = 0;
+
+void startupPhase(const char *name, uint64_t start) {
+	uint64_t timeNow;
+
+	if (!startupReport)
+		return;
+
+	// Duration of the phase and its end relative to the process start
+	timeNow = getMonotonicTime();
+	LOGR(" Startup phase '%s': %.1f ms (done after %.1f ms).\n", name,
+		(timeNow - start) / 1000.0, (timeNow - startupTime) / 1000.0);
+}
@@ -0,0 +1,14 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for the startup timing report
+
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include "common.h"
+
+extern int startupReport;
+extern uint64_t startupTime;
+
+void startupPhase(const char *name, uint64_t start);
+
+#endif
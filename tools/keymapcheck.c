@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Keymap check: the lookup tables against the former keysym switch (equivalence and lookup time)
+
+#include "common.h"
+#include "keymap.h"
+
+#define CHECK_LOOKUPS 20000000 // Lookups of each timing run
+#define CHECK_MAX_REPORTS 20 // Mismatches which are printed
+
+// Keysym ranges of the equivalence check (end exclusive)
+static const struct {
+	uint32_t first, end;
+} checkRanges[] = {
+	{ 0x0, 0x20000 },
+	{ KEYMAP_UNICODE, KEYMAP_UNICODE + 0x110000 },
+};
+
+// Keysyms of typed text with modifiers and navigation, some without a scancode
+static const uint32_t typedKeys[] = {
+	XK_Shift_L, XK_H, XK_e, XK_l, XK_l, XK_o, XK_comma, XK_space, XK_w, XK_o, XK_r, XK_l, XK_d, XK_exclam,
+	XK_Return, XK_Control_L, XK_c, XK_Alt_R, XK_Tab, XK_1, XK_2, XK_plus, XK_BackSpace, XK_Left, XK_Up,
+	XK_KP_5, XK_F5, XK_Escape, XK_ISO_Level3_Shift, XK_adiaeresis, XK_EuroSign, KEYMAP_UNICODE | 0x20ac,
+};
+
+// The US layout switch which the tables replaced (from the former input.c), the reference of the check
+static int switchKeySym2Scancode(rfbKeySym key) {
+	switch (key) {
+
+	/* Modifiers */
+	case XK_Shift_L:	return KEY_LEFTSHIFT;
+	case XK_Shift_R:	return KEY_RIGHTSHIFT;
+	case XK_Control_L:	return KEY_LEFTCTRL;
+	case XK_Control_R:	return KEY_RIGHTCTRL;
+	case XK_Alt_L:		return KEY_LEFTALT;
+	case XK_Alt_R:
+	case XK_ISO_Level3_Shift:
+				return KEY_RIGHTALT;
+
+	/* Alphabetic keys */
+	case XK_a: case XK_A:	return KEY_A;
+	case XK_b: case XK_B:	return KEY_B;
+	case XK_c: case XK_C:	return KEY_C;
+	case XK_d: case XK_D:	return KEY_D;
+	case XK_e: case XK_E:	return KEY_E;
+	case XK_f: case XK_F:	return KEY_F;
+	case XK_g: case XK_G:	return KEY_G;
+	case XK_h: case XK_H:	return KEY_H;
+	case XK_i: case XK_I:	return KEY_I;
+	case XK_j: case XK_J:	return KEY_J;
+	case XK_k: case XK_K:	return KEY_K;
+	case XK_l: case XK_L:	return KEY_L;
+	case XK_m: case XK_M:	return KEY_M;
+	case XK_n: case XK_N:	return KEY_N;
+	case XK_o: case XK_O:	return KEY_O;
+	case XK_p: case XK_P:	return KEY_P;
+	case XK_q: case XK_Q:	return KEY_Q;
+	case XK_r: case XK_R:	return KEY_R;
+	case XK_s: case XK_S:	return KEY_S;
+	case XK_t: case XK_T:	return KEY_T;
+	case XK_u: case XK_U:	return KEY_U;
+	case XK_v: case XK_V:	return KEY_V;
+	case XK_w: case XK_W:	return KEY_W;
+	case XK_x: case XK_X:	return KEY_X;
+	case XK_y: case XK_Y:	return KEY_Y;
+	case XK_z: case XK_Z:	return KEY_Z;
+
+	/* Numeric keys */
+	case XK_1:		return KEY_1;
+	case XK_2:		return KEY_2;
+	case XK_3:		return KEY_3;
+	case XK_4:		return KEY_4;
+	case XK_5:		return KEY_5;
+	case XK_6:		return KEY_6;
+	case XK_7:		return KEY_7;
+	case XK_8:		return KEY_8;
+	case XK_9:		return KEY_9;
+	case XK_0:		return KEY_0;
+
+	/* System and navigation keys */
+	case XK_Escape:		return KEY_ESC;
+	case XK_BackSpace:	return KEY_BACKSPACE;
+	case XK_Tab:		return KEY_TAB;
+	case XK_Return:		return KEY_ENTER;
+	case XK_Insert:		return KEY_INSERT;
+	case XK_Delete:		return KEY_DELETE;
+	case XK_Home:		return KEY_HOME;
+	case XK_Left:		return KEY_LEFT;
+	case XK_Up:		return KEY_UP;
+	case XK_Right:		return KEY_RIGHT;
+	case XK_Down:		return KEY_DOWN;
+	case XK_Page_Up:	return KEY_PAGEUP;
+	case XK_Page_Down:	return KEY_PAGEDOWN;
+	case XK_End:		return KEY_END;
+
+	/* Function keys (F1-F12) */
+	case XK_F1:		return KEY_F1;
+	case XK_F2:		return KEY_F2;
+	case XK_F3:		return KEY_F3;
+	case XK_F4:		return KEY_F4;
+	case XK_F5:		return KEY_F5;
+	case XK_F6:		return KEY_F6;
+	case XK_F7:		return KEY_F7;
+	case XK_F8:		return KEY_F8;
+	case XK_F9:		return KEY_F9;
+	case XK_F10:		return KEY_F10;
+	case XK_F11:		return KEY_F11;
+	case XK_F12:		return KEY_F12;
+
+	/* Physical punctuation keys */
+	case XK_space:		return KEY_SPACE;
+	case XK_minus:		return KEY_MINUS;
+	case XK_equal:		return KEY_EQUAL;
+	case XK_bracketleft:	return KEY_LEFTBRACE;
+	case XK_bracketright:	return KEY_RIGHTBRACE;
+	case XK_semicolon:	return KEY_SEMICOLON;
+	case XK_apostrophe:	return KEY_APOSTROPHE;
+	case XK_grave:		return KEY_GRAVE;
+	case XK_backslash:	return KEY_BACKSLASH;
+	case XK_comma:		return KEY_COMMA;
+	case XK_period:		return KEY_DOT;
+	case XK_slash:		return KEY_SLASH;
+
+	/* Layout dependent keys - Used together with modifiers (US) */
+	case XK_exclam:		return KEY_1;
+	case XK_at:		return KEY_2;
+	case XK_numbersign:	return KEY_3;
+	case XK_dollar:		return KEY_4;
+	case XK_percent:	return KEY_5;
+	case XK_asciicircum:	return KEY_6;
+	case XK_ampersand:	return KEY_7;
+	case XK_parenleft:	return KEY_9;
+	case XK_parenright:	return KEY_0;
+	case XK_underscore:	return KEY_MINUS;
+	case XK_colon:		return KEY_SEMICOLON;
+	case XK_quotedbl:	return KEY_APOSTROPHE;
+	case XK_asciitilde:	return KEY_GRAVE;
+	case XK_bar:		return KEY_BACKSLASH;
+	case XK_less:		return KEY_COMMA;
+	case XK_greater:	return KEY_DOT;
+	case XK_question:	return KEY_SLASH;
+
+	/* Numeric keypad - Independent of server-side Num Lock state */
+	case XK_KP_Divide:	return KEY_KPSLASH;
+	case XK_KP_Multiply:	return KEY_KPASTERISK;
+	case XK_KP_Add:		return KEY_KPPLUS;
+	case XK_KP_Subtract:	return KEY_KPMINUS;
+	case XK_KP_Enter:	return KEY_KPENTER;
+	case XK_KP_Decimal:	return KEY_KPDOT;
+	case XK_KP_0:		return KEY_0;
+	case XK_KP_1:		return KEY_1;
+	case XK_KP_2:		return KEY_2;
+	case XK_KP_3:		return KEY_3;
+	case XK_KP_4:		return KEY_4;
+	case XK_KP_5:		return KEY_5;
+	case XK_KP_6:		return KEY_6;
+	case XK_KP_7:		return KEY_7;
+	case XK_KP_8:		return KEY_8;
+	case XK_KP_9:		return KEY_9;
+	case XK_KP_Home:	return KEY_HOME;
+	case XK_KP_End:		return KEY_END;
+	case XK_KP_Page_Up:	return KEY_PAGEUP;
+	case XK_KP_Page_Down:	return KEY_PAGEDOWN;
+	case XK_KP_Up:		return KEY_UP;
+	case XK_KP_Down:	return KEY_DOWN;
+	case XK_KP_Left:	return KEY_LEFT;
+	case XK_KP_Right:	return KEY_RIGHT;
+	case XK_KP_Insert:	return KEY_INSERT;
+	case XK_KP_Delete:	return KEY_DELETE;
+
+	/* Redefined keys */
+	case XK_asterisk:	return KEY_KPASTERISK;
+	case XK_plus:		return KEY_KPPLUS;
+
+	/* Unhandled keys */
+	default:		return 0;
+	}
+}
+
+static uint64_t timeLookups(int (*lookup)(rfbKeySym key), const char *name) {
+	const int count = sizeof(typedKeys) / sizeof(typedKeys[0]);
+	uint64_t timeStart, elapsed;
+	volatile int sink = 0;
+	int i;
+
+	timeStart = getMonotonicTime();
+	for (i = 0; i < CHECK_LOOKUPS; i++)
+		sink += lookup(typedKeys[i % count]);
+	elapsed = getMonotonicTime() - timeStart;
+
+	printf(" %s: %.2f ns per lookup (%d lookups, %llu us).\n", name,
+		elapsed * 1000.0 / CHECK_LOOKUPS, CHECK_LOOKUPS, (unsigned long long)elapsed);
+	return elapsed;
+}
+
+int main(void) {
+	uint64_t keysym, checked = 0, mismatches = 0;
+	int expected, actual;
+	size_t i;
+
+	// The built-in US layout, a keymap file is not loaded
+	initKeymap();
+
+	for (i = 0; i < sizeof(checkRanges) / sizeof(checkRanges[0]); i++) {
+		for (keysym = checkRanges[i].first; keysym < checkRanges[i].end; keysym++) {
+			expected = switchKeySym2Scancode(keysym);
+			actual = keySym2Scancode(keysym);
+			checked++;
+			if (expected == actual)
+				continue;
+			if (mismatches++ < CHECK_MAX_REPORTS)
+				printf(" Keysym 0x%llx: switch %d, tables %d.\n", (unsigned long long)keysym, expected, actual);
+		}
+	}
+
+	printf(" %llu keysyms checked, %llu mismatches.\n", (unsigned long long)checked, (unsigned long long)mismatches);
+
+	timeLookups(switchKeySym2Scancode, "Switch");
+	timeLookups(keySym2Scancode, "Tables");
+
+	closeKeymap();
+	return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
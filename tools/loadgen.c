@@ -0,0 +1,640 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// RFB load generator: concurrent sessions with frame rate, latency, bandwidth and server CPU statistics
+
+#include "common.h"
+#include "latency.h"
+
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define LOAD_MAX_CLIENTS 1024
+#define LOAD_MAX_STEPS 32
+#define LOAD_DURATION 10 // Default measuring time of a step in s
+#define LOAD_PORT 5900
+#define LOAD_READ_SIZE (64 * 1024)
+#define LOAD_POLL_TIMEOUT 100 // Receive timeout in ms, the sessions check for the end of the step
+#define LOAD_THROTTLED_BUFFER (64 * 1024) // Receive buffer of bandwidth limited sessions
+#define LOAD_H264_ENCODING 50 // Open H.264 (h264.h)
+
+typedef struct {
+	int index;
+	int sock;
+	pthread_t thread;
+	int failed;
+	int width, height, pixelBytes;
+	uint8_t buffer[LOAD_READ_SIZE];
+	size_t start, end; // Unread part of the buffer
+	uint64_t throttleStart;
+	uint64_t frames;
+	uint64_t bytes;
+	latency_histogram_t latency; // Update request to complete update
+} load_session_t;
+
+static const struct {
+	const char *name;
+	int32_t encoding;
+} encodingNames[] = {
+	{ "raw", rfbEncodingRaw },
+	{ "copyrect", rfbEncodingCopyRect },
+	{ "zlib", rfbEncodingZlib },
+	{ "zrle", rfbEncodingZRLE },
+	{ "h264", LOAD_H264_ENCODING }
+};
+
+static char *serverHost = "127.0.0.1";
+static int serverPort = LOAD_PORT;
+static char *unixPath = NULL;
+static char *password = NULL;
+static int32_t encodings[8];
+static int encodingCount = 0;
+static int pixelDepth = 0; // 0: server format
+static int fullFrames = 0;
+static int requestInterval = 0; // ms between update requests (0: as fast as the updates arrive)
+static int bandwidth = 0; // kbit/s per session (0: unlimited)
+static int duration = LOAD_DURATION;
+static int serverPid = 0;
+static int verbose = 0;
+static int steps[LOAD_MAX_STEPS] = { 1 };
+static int stepCount = 1;
+
+static int running;
+static pthread_barrier_t startBarrier;
+
+static uint32_t get32(const uint8_t *src) {
+	return (uint32_t)src[0] << 24 | src[1] << 16 | src[2] << 8 | src[3];
+}
+
+// Reads are delayed until the session is back within its bandwidth
+static void throttle(load_session_t *session) {
+	uint64_t due, now;
+
+	if (!bandwidth)
+		return;
+
+	due = session->throttleStart + session->bytes * 8000 / bandwidth;
+	now = getMonotonicTime();
+	if (due > now)
+		usleep(due - now);
+}
+
+static int fill(load_session_t *session) {
+	ssize_t n;
+
+	for (;;) {
+		if (!__atomic_load_n(&running, __ATOMIC_RELAXED))
+			return -1;
+		n = recv(session->sock, session->buffer, LOAD_READ_SIZE, 0);
+		if (n > 0)
+			break;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			continue;
+		return -1;
+	}
+
+	session->start = 0;
+	session->end = n;
+	session->bytes += n;
+	throttle(session);
+	return 0;
+}
+
+// Without a destination the data is skipped
+static int readData(load_session_t *session, void *dst, size_t length) {
+	size_t n;
+
+	while (length) {
+		if (session->start == session->end && fill(session) < 0)
+			return -1;
+		n = MIN(length, session->end - session->start);
+		if (dst) {
+			memcpy(dst, session->buffer + session->start, n);
+			dst = (uint8_t *)dst + n;
+		}
+		session->start += n;
+		length -= n;
+	}
+	return 0;
+}
+
+static int writeData(load_session_t *session, const void *data, size_t length) {
+	return send(session->sock, data, length, MSG_NOSIGNAL) == (ssize_t)length ? 0 : -1;
+}
+
+static int openSocket(void) {
+	struct addrinfo hints, *result, *ai;
+	struct sockaddr_un addr;
+	struct timeval timeout = { 0, LOAD_POLL_TIMEOUT * 1000 };
+	int size = LOAD_THROTTLED_BUFFER, one = 1;
+	char port[16];
+	int sock = -1;
+
+	if (unixPath) {
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", unixPath);
+		sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (sock >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			close(sock);
+			sock = -1;
+		}
+	} else {
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		snprintf(port, sizeof(port), "%d", serverPort);
+		if (getaddrinfo(serverHost, port, &hints, &result) != 0)
+			return -1;
+		for (ai = result; ai && sock < 0; ai = ai->ai_next) {
+			sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+			if (sock < 0)
+				continue;
+			// A small window makes the server see the limited bandwidth
+			if (bandwidth)
+				setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+			if (connect(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+				close(sock);
+				sock = -1;
+			}
+		}
+		freeaddrinfo(result);
+		if (sock >= 0)
+			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	if (sock >= 0)
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	return sock;
+}
+
+static int setPixelFormat(load_session_t *session) {
+	uint8_t message[20] = { rfbSetPixelFormat };
+	uint8_t *format = message + 4;
+
+	switch (pixelDepth) {
+	case 32:
+		memcpy(format, "\x20\x18\x00\x01\x00\xff\x00\xff\x00\xff\x10\x08\x00", 13);
+		break;
+	case 16:
+		memcpy(format, "\x10\x10\x00\x01\x00\x1f\x00\x3f\x00\x1f\x0b\x05\x00", 13);
+		break;
+	case 8:
+		memcpy(format, "\x08\x08\x00\x01\x00\x07\x00\x07\x00\x03\x00\x03\x06", 13);
+		break;
+	default:
+		return 0;
+	}
+
+	session->pixelBytes = pixelDepth / CHAR_BIT;
+	return writeData(session, message, sizeof(message));
+}
+
+static int setEncodings(load_session_t *session) {
+	uint8_t message[4 + 4 * (8 + 2)] = { rfbSetEncodings };
+	int32_t list[8 + 2];
+	int i, count = 0;
+
+	for (i = 0; i < encodingCount; i++)
+		list[count++] = encodings[i];
+	list[count++] = rfbEncodingLastRect;
+	list[count++] = rfbEncodingNewFBSize;
+
+	message[3] = count;
+	for (i = 0; i < count; i++) {
+		message[4 + i * 4] = (uint32_t)list[i] >> 24;
+		message[5 + i * 4] = (uint32_t)list[i] >> 16;
+		message[6 + i * 4] = (uint32_t)list[i] >> 8;
+		message[7 + i * 4] = (uint32_t)list[i];
+	}
+	return writeData(session, message, 4 + count * 4);
+}
+
+// Protocol 3.8 with a shared session
+static int connectSession(load_session_t *session) {
+	uint8_t version[12], count, types[255], challenge[CHALLENGESIZE], init[24], type;
+
+	session->sock = openSocket();
+	if (session->sock < 0) {
+		fprintf(stderr, "Session %d: could not connect: %s.\n", session->index, strerror(errno));
+		return -1;
+	}
+
+	if (readData(session, version, sizeof(version)) < 0 || writeData(session, "RFB 003.008\n", 12) < 0 ||
+	    readData(session, &count, 1) < 0 || !count || readData(session, types, count) < 0) {
+		fprintf(stderr, "Session %d: handshake failed.\n", session->index);
+		return -1;
+	}
+
+	if (memchr(types, rfbVncAuth, count) && password) {
+		type = rfbVncAuth;
+		if (writeData(session, &type, 1) < 0 || readData(session, challenge, sizeof(challenge)) < 0)
+			return -1;
+		rfbEncryptBytes(challenge, password);
+		if (writeData(session, challenge, sizeof(challenge)) < 0)
+			return -1;
+	} else if (memchr(types, rfbNoAuth, count)) {
+		type = rfbNoAuth;
+		if (writeData(session, &type, 1) < 0)
+			return -1;
+	} else {
+		fprintf(stderr, "Session %d: no supported security type (password required?).\n", session->index);
+		return -1;
+	}
+
+	type = 1;
+	if (readData(session, init, 4) < 0 || get32(init) != 0 || writeData(session, &type, 1) < 0) {
+		fprintf(stderr, "Session %d: authentication failed.\n", session->index);
+		return -1;
+	}
+
+	if (readData(session, init, sizeof(init)) < 0 || readData(session, NULL, get32(init + 20)) < 0)
+		return -1;
+	session->width = init[0] << 8 | init[1];
+	session->height = init[2] << 8 | init[3];
+	session->pixelBytes = init[4] / CHAR_BIT;
+
+	return setPixelFormat(session) < 0 || setEncodings(session) < 0 ? -1 : 0;
+}
+
+static int requestUpdate(load_session_t *session, int incremental) {
+	uint8_t request[10] = { rfbFramebufferUpdateRequest, incremental };
+
+	request[6] = session->width >> 8;
+	request[7] = session->width;
+	request[8] = session->height >> 8;
+	request[9] = session->height;
+	return writeData(session, request, sizeof(request));
+}
+
+// The rectangle data is skipped, only its length is parsed (1: last rectangle)
+static int readRect(load_session_t *session, const uint8_t *header) {
+	int width = header[4] << 8 | header[5];
+	int height = header[6] << 8 | header[7];
+	int32_t encoding = get32(header + 8);
+	uint8_t length[8];
+
+	switch (encoding) {
+	case rfbEncodingRaw:
+		return readData(session, NULL, (size_t)width * height * session->pixelBytes);
+	case rfbEncodingCopyRect:
+		return readData(session, NULL, 4);
+	case rfbEncodingZlib:
+	case rfbEncodingZRLE:
+		if (readData(session, length, 4) < 0)
+			return -1;
+		return readData(session, NULL, get32(length));
+	case LOAD_H264_ENCODING:
+		if (readData(session, length, 8) < 0)
+			return -1;
+		return readData(session, NULL, get32(length));
+	case (int32_t)rfbEncodingLastRect:
+		return 1;
+	case (int32_t)rfbEncodingNewFBSize:
+		session->width = width;
+		session->height = height;
+		return 0;
+	}
+
+	fprintf(stderr, "Session %d: unexpected encoding %d.\n", session->index, encoding);
+	return -1;
+}
+
+// Messages up to the end of the next framebuffer update
+static int readUpdate(load_session_t *session) {
+	uint8_t header[12], type;
+	int i, rects, result;
+
+	for (;;) {
+		if (readData(session, &type, 1) < 0)
+			return -1;
+
+		switch (type) {
+		case rfbFramebufferUpdate:
+			if (readData(session, header, 3) < 0)
+				return -1;
+			rects = header[1] << 8 | header[2];
+			for (i = 0; i < rects; i++) {
+				if (readData(session, header, 12) < 0)
+					return -1;
+				result = readRect(session, header);
+				if (result < 0)
+					return -1;
+				if (result)
+					break;
+			}
+			return 0;
+		case rfbBell:
+			break;
+		case rfbServerCutText:
+			if (readData(session, header, 7) < 0 || readData(session, NULL, get32(header + 3)) < 0)
+				return -1;
+			break;
+		default:
+			fprintf(stderr, "Session %d: unexpected message %d.\n", session->index, type);
+			return -1;
+		}
+	}
+}
+
+static void addSample(latency_histogram_t *histogram, uint64_t time) {
+	uint64_t bucket = time / 1000;
+
+	histogram->buckets[MIN(bucket, LATENCY_BUCKETS - 1)]++;
+	histogram->count++;
+}
+
+// Upper bound of the bucket in ms, like latencyPercentile()
+static int percentile(const latency_histogram_t *histogram, int percent) {
+	uint64_t target, sum = 0;
+	int i;
+
+	if (!histogram->count)
+		return -1;
+
+	target = (histogram->count * percent + 99) / 100;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		sum += histogram->buckets[i];
+		if (sum >= target)
+			break;
+	}
+	return i + 1;
+}
+
+static void measure(load_session_t *session) {
+	uint64_t requestTime, now;
+	int incremental = 0;
+
+	session->bytes = 0;
+	session->throttleStart = getMonotonicTime();
+
+	while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		requestTime = getMonotonicTime();
+		if (requestUpdate(session, incremental) < 0 || readUpdate(session) < 0)
+			break;
+
+		now = getMonotonicTime();
+		session->frames++;
+		addSample(&session->latency, now - requestTime);
+		incremental = !fullFrames;
+
+		if (requestInterval && requestTime + requestInterval * 1000ULL > now)
+			usleep(requestTime + requestInterval * 1000ULL - now);
+	}
+}
+
+static void *runSession(void *arg) {
+	load_session_t *session = arg;
+
+	if (connectSession(session) < 0)
+		session->failed = 1;
+
+	// The measurement starts once every session is connected
+	pthread_barrier_wait(&startBarrier);
+	if (!session->failed)
+		measure(session);
+
+	if (session->sock >= 0)
+		close(session->sock);
+	return NULL;
+}
+
+// User and system time of the server in s (-1: unknown)
+static double serverCpuTime(void) {
+	unsigned long utime, stime;
+	char path[64], line[1024], *fields;
+	FILE *file;
+	int result;
+
+	if (!serverPid)
+		return -1;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", serverPid);
+	file = fopen(path, "r");
+	if (!file)
+		return -1;
+	fields = fgets(line, sizeof(line), file) ? strrchr(line, ')') : NULL;
+	fclose(file);
+
+	// Fields 14 and 15 follow the command name
+	result = fields ? sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) : 0;
+	if (result != 2)
+		return -1;
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static void runStep(int clients) {
+	load_session_t *sessions;
+	latency_histogram_t latency;
+	uint64_t timeStart, timeStop, frames = 0, bytes = 0;
+	double seconds, cpuStart, cpuStop, fps, minFps = 0;
+	int i, j, connected = 0;
+
+	sessions = calloc(clients, sizeof(load_session_t));
+	if (!sessions) {
+		fprintf(stderr, "Out of memory for %d sessions.\n", clients);
+		exit(EXIT_FAILURE);
+	}
+
+	__atomic_store_n(&running, 1, __ATOMIC_RELAXED);
+	pthread_barrier_init(&startBarrier, NULL, clients + 1);
+	for (i = 0; i < clients; i++) {
+		sessions[i].index = i + 1;
+		sessions[i].sock = -1;
+		if (pthread_create(&sessions[i].thread, NULL, runSession, &sessions[i]) != 0) {
+			fprintf(stderr, "Could not start session %d.\n", i + 1);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_barrier_wait(&startBarrier);
+	timeStart = getMonotonicTime();
+	cpuStart = serverCpuTime();
+
+	sleep(duration);
+
+	__atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+	timeStop = getMonotonicTime();
+	cpuStop = serverCpuTime();
+	for (i = 0; i < clients; i++)
+		pthread_join(sessions[i].thread, NULL);
+	pthread_barrier_destroy(&startBarrier);
+
+	seconds = (timeStop - timeStart) / 1e6;
+	memset(&latency, 0, sizeof(latency));
+	for (i = 0; i < clients; i++) {
+		if (sessions[i].failed)
+			continue;
+		fps = sessions[i].frames / seconds;
+		minFps = connected ? MIN(minFps, fps) : fps;
+		connected++;
+		frames += sessions[i].frames;
+		bytes += sessions[i].bytes;
+		for (j = 0; j < LATENCY_BUCKETS; j++)
+			latency.buckets[j] += sessions[i].latency.buckets[j];
+		latency.count += sessions[i].latency.count;
+
+		if (verbose)
+			printf("  session %d: %.1f fps, latency p50 %d ms p95 %d ms, %.1f KiB/frame, %.2f Mbit/s\n",
+				sessions[i].index, fps, percentile(&sessions[i].latency, 50), percentile(&sessions[i].latency, 95),
+				sessions[i].frames ? sessions[i].bytes / 1024.0 / sessions[i].frames : 0,
+				sessions[i].bytes * 8 / seconds / 1e6);
+	}
+
+	printf("%4d clients (%d connected): %.1f fps per client (min %.1f), latency p50 %d ms p95 %d ms p99 %d ms, "
+		"%.1f KiB/frame, %.2f Mbit/s",
+		clients, connected, connected ? frames / seconds / connected : 0, minFps,
+		percentile(&latency, 50), percentile(&latency, 95), percentile(&latency, 99),
+		frames ? bytes / 1024.0 / frames : 0, bytes * 8 / seconds / 1e6);
+	if (cpuStart >= 0 && cpuStop >= 0)
+		printf(", server CPU %.1f%%", (cpuStop - cpuStart) / seconds * 100);
+	printf("\n");
+	fflush(stdout);
+
+	free(sessions);
+}
+
+static int parseEncodings(char *list) {
+	char *name, *save;
+	size_t i;
+
+	encodingCount = 0;
+	for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < sizeof(encodingNames) / sizeof(encodingNames[0]); i++)
+			if (!strcasecmp(name, encodingNames[i].name))
+				break;
+		if (i == sizeof(encodingNames) / sizeof(encodingNames[0]) || encodingCount == 8)
+			return -1;
+		encodings[encodingCount++] = encodingNames[i].encoding;
+	}
+	return encodingCount ? 0 : -1;
+}
+
+static int parseSteps(char *list) {
+	char *value, *save;
+
+	stepCount = 0;
+	for (value = strtok_r(list, ",", &save); value; value = strtok_r(NULL, ",", &save)) {
+		if (stepCount == LOAD_MAX_STEPS)
+			return -1;
+		steps[stepCount] = atoi(value);
+		if (steps[stepCount] < 1 || steps[stepCount] > LOAD_MAX_CLIENTS)
+			return -1;
+		stepCount++;
+	}
+	return stepCount ? 0 : -1;
+}
+
+static void printUsage(char *str) {
+	fprintf(stderr, "\nUsage: %s [parameters]\n"
+		"-h               - Print this help\n"
+		"-c <host[:port]> - Server address (default: 127.0.0.1:5900)\n"
+		"-u <path>        - Connect to the server's Unix socket instead\n"
+		"-p <password>    - Password of the server\n"
+		"-n <clients>     - Concurrent sessions, a list measures one step per count (e.g. 1,2,4,8; default: 1)\n"
+		"-t <seconds>     - Measuring time of each step (default: 10)\n"
+		"-e <encodings>   - Requested encodings: raw, copyrect, zlib, zrle, h264 (default: zrle,copyrect)\n"
+		"-b <bpp>         - Pixel format: 32, 16 or 8 bits (default: server format)\n"
+		"-f               - Request full frames instead of incremental updates\n"
+		"-i <ms>          - Interval between update requests (default: 0, as fast as updates arrive)\n"
+		"-l <kbps>        - Bandwidth limit of each session (default: 0, unlimited)\n"
+		"-P <pid>         - Server process, its CPU time is reported\n"
+		"-v               - Print the statistics of each session\n", str);
+}
+
+int main(int argc, char **argv) {
+	char defaultEncodings[] = "zrle,copyrect";
+	char *separator;
+	int i;
+
+	parseEncodings(defaultEncodings);
+
+	for (i = 1; i < argc; i++) {
+		if (*argv[i] != '-') {
+			printUsage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		switch (*(argv[i] + 1)) {
+		case 'h':
+		case '?':
+			printUsage(argv[0]);
+			exit(0);
+		case 'f':
+			fullFrames = 1;
+			continue;
+		case 'v':
+			verbose = 1;
+			continue;
+		}
+
+		if (++i >= argc) {
+			fprintf(stderr, "Missing argument for '%s'.\n", argv[i-1]);
+			printUsage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+
+		switch (*(argv[i-1] + 1)) {
+		case 'c':
+			serverHost = argv[i];
+			separator = strchr(serverHost, ':');
+			if (separator) {
+				*separator = '\0';
+				serverPort = atoi(separator + 1);
+				if (serverPort <= 0 || serverPort > 65535) {
+					fprintf(stderr, "Invalid server port: TCP #%s.\n", separator + 1);
+					exit(EXIT_FAILURE);
+				}
+			}
+			break;
+		case 'u':
+			unixPath = argv[i];
+			break;
+		case 'p':
+			password = argv[i];
+			break;
+		case 'n':
+			if (parseSteps(argv[i]) < 0) {
+				fprintf(stderr, "Invalid client counts: 1 to %d.\n", LOAD_MAX_CLIENTS);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 't':
+			duration = atoi(argv[i]);
+			break;
+		case 'e':
+			if (parseEncodings(argv[i]) < 0) {
+				fprintf(stderr, "Invalid encodings: %s.\n", argv[i]);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'b':
+			pixelDepth = atoi(argv[i]);
+			break;
+		case 'i':
+			requestInterval = atoi(argv[i]);
+			break;
+		case 'l':
+			bandwidth = atoi(argv[i]);
+			break;
+		case 'P':
+			serverPid = atoi(argv[i]);
+			break;
+		default:
+			printUsage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (duration < 1 || requestInterval < 0 || bandwidth < 0 ||
+	    (pixelDepth != 0 && pixelDepth != 8 && pixelDepth != 16 && pixelDepth != 32)) {
+		printUsage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < stepCount; i++)
+		runStep(steps[i]);
+
+	return 0;
+}
@@ -0,0 +1,82 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Hot-path tracing into a ring buffer with Chrome trace JSON output
+
+#include "trace.h"
+
+int traceEnabled = 0;
+char *traceFile = NULL;
+
+static trace_event_t *traceEvents = NULL;
+static uint64_t traceHead = 0;
+static __thread uint32_t traceThread = 0;
+
+void initTrace(void) {
+	if (!traceFile)
+		return;
+
+	traceEvents = calloc(TRACE_EVENTS, sizeof(trace_event_t));
+	assert(traceEvents != NULL);
+	traceEnabled = 1;
+
+	LOG(" Tracing enabled, send SIGUSR2 to write the last %d events to '%s'.\n", TRACE_EVENTS, traceFile);
+}
+
+void traceRecord(const char *name, uint64_t start) {
+	trace_event_t *event;
+	uint64_t index;
+
+	if (!traceThread)
+		traceThread = syscall(SYS_gettid);
+
+	// Capture workers record concurrently, so the slot is claimed atomically
+	index = __atomic_fetch_add(&traceHead, 1, __ATOMIC_RELAXED);
+	event = &traceEvents[index & (TRACE_EVENTS - 1)];
+
+	event->name = name;
+	event->start = start;
+	event->duration = getMonotonicTime() - start;
+	event->thread = traceThread;
+}
+
+void dumpTrace(void) {
+	trace_event_t *event;
+	uint64_t index, first;
+	FILE *file;
+	int separator = 0;
+
+	if (!traceEnabled)
+		return;
+
+	file = fopen(traceFile, "w");
+	if (!file) {
+		LOGE(" Could not write trace file '%s': %s.\n", traceFile, strerror(errno));
+		return;
+	}
+
+	// Dumps run on the main thread while the workers are idle
+	first = traceHead > TRACE_EVENTS ? traceHead - TRACE_EVENTS : 0;
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (index = first; index < traceHead; index++) {
+		event = &traceEvents[index & (TRACE_EVENTS - 1)];
+		fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%llu,\"dur\":%u}",
+			separator ? ",\n" : "", event->name, (int)getpid(), event->thread,
+			(unsigned long long)event->start, event->duration);
+		separator = 1;
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+
+	LOG(" %llu trace events have been written to '%s'.\n", (unsigned long long)(traceHead - first), traceFile);
+}
+
+void closeTrace(void) {
+	if (!traceEnabled)
+		return;
+
+	dumpTrace();
+
+	traceEnabled = 0;
+	free(traceEvents);
+	traceEvents = NULL;
+}
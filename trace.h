@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for hot-path tracing
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "common.h"
+
+#include <sys/syscall.h>
+
+#define TRACE_EVENTS 65536 // Ring buffer size (power of two)
+
+typedef struct {
+	const char *name;
+	uint64_t start; // Monotonic time in us
+	uint32_t duration; // us
+	uint32_t thread;
+} trace_event_t;
+
+extern int traceEnabled;
+extern char *traceFile;
+
+// A disabled tracepoint costs one predictable branch
+#define TRACE_START() (traceEnabled ? getMonotonicTime() : 0)
+#define TRACE_STOP(name, start) do { if (traceEnabled) traceRecord(name, start); } while (0)
+
+void initTrace(void);
+void traceRecord(const char *name, uint64_t start);
+void dumpTrace(void);
+void closeTrace(void);
+
+#endif
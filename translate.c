@@ -0,0 +1,376 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Shared translation buffers (one per distinct client pixel format)
+
+#include "translate.h"
+#include "client.h"
+#include "updatescreen.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define TRANSLATE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define TRANSLATE_SSE2
+#endif
+
+static shared_format_t sharedFormats[TRANSLATE_FORMATS];
+
+static int sameFormat(const rfbPixelFormat *a, const rfbPixelFormat *b) {
+	return a->bitsPerPixel == b->bitsPerPixel && a->depth == b->depth &&
+		a->bigEndian == b->bigEndian && a->trueColour == b->trueColour &&
+		a->redMax == b->redMax && a->greenMax == b->greenMax && a->blueMax == b->blueMax &&
+		a->redShift == b->redShift && a->greenShift == b->greenShift && a->blueShift == b->blueShift;
+}
+
+// Clients whose updates are not read from the plain screen buffer keep their own translation
+static int canShare(rfbClientPtr cl) {
+	// Colour map clients have a per-client table, the server format needs no translation
+	if (!cl->format.trueColour || sameFormat(&cl->format, &vncScreen->serverFormat))
+		return 0;
+
+	// libvncserver draws the cursor into the buffer for clients without cursor shape updates
+	if (!cl->enableCursorShapeUpdates)
+		return 0;
+
+	// Clients which asked for server-side scaling read another buffer
+	return cl->scaledScreen == vncScreen;
+}
+
+static int channelBits(uint16_t max) {
+	int bits = 0;
+
+	// Only full bit masks of 1 to 8 bits
+	if (!max || max > 0xff || (max & (max + 1)))
+		return -1;
+	while (max) {
+		bits++;
+		max >>= 1;
+	}
+	return bits;
+}
+
+// The vector converters handle 32-bit servers with 8-bit components and little endian clients
+static int setupVector(shared_format_t *shared) {
+	const rfbPixelFormat *in = &vncScreen->serverFormat;
+	const rfbPixelFormat *out = &shared->format;
+	const uint16_t maxes[3] = { out->redMax, out->greenMax, out->blueMax };
+	const uint8_t inShifts[3] = { in->redShift, in->greenShift, in->blueShift };
+	const uint8_t outShifts[3] = { out->redShift, out->greenShift, out->blueShift };
+	int i, bits;
+
+	if (in->bitsPerPixel != 32 || in->bigEndian || in->redMax != 0xff || in->greenMax != 0xff || in->blueMax != 0xff)
+		return 0;
+	if (out->bitsPerPixel != 8 && out->bitsPerPixel != 16 && out->bitsPerPixel != 32)
+		return 0;
+	if (out->bitsPerPixel != 8 && out->bigEndian)
+		return 0;
+
+	for (i = 0; i < 3; i++) {
+		bits = channelBits(maxes[i]);
+		if (bits < 0)
+			return 0;
+		shared->channels[i].rightShift = inShifts[i] + 8 - bits;
+		shared->channels[i].mask = maxes[i];
+		shared->channels[i].leftShift = outShifts[i];
+	}
+
+	return 1;
+}
+
+static inline uint32_t translatePixel(const translate_channel_t *channels, uint32_t pixel) {
+	return (((pixel >> channels[0].rightShift) & channels[0].mask) << channels[0].leftShift) |
+		(((pixel >> channels[1].rightShift) & channels[1].mask) << channels[1].leftShift) |
+		(((pixel >> channels[2].rightShift) & channels[2].mask) << channels[2].leftShift);
+}
+
+#if defined(TRANSLATE_SSE2)
+static inline __m128i translateVector(const translate_channel_t *channels, __m128i pixels) {
+	__m128i out = _mm_setzero_si128();
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		__m128i c = _mm_srl_epi32(pixels, _mm_cvtsi32_si128(channels[i].rightShift));
+		c = _mm_and_si128(c, _mm_set1_epi32(channels[i].mask));
+		out = _mm_or_si128(out, _mm_sll_epi32(c, _mm_cvtsi32_si128(channels[i].leftShift)));
+	}
+
+	return out;
+}
+#elif defined(TRANSLATE_NEON)
+static inline uint32x4_t translateVector(const translate_channel_t *channels, uint32x4_t pixels) {
+	uint32x4_t out = vdupq_n_u32(0);
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		uint32x4_t c = vshlq_u32(pixels, vdupq_n_s32(-(int32_t)channels[i].rightShift));
+		c = vandq_u32(c, vdupq_n_u32(channels[i].mask));
+		out = vorrq_u32(out, vshlq_u32(c, vdupq_n_s32(channels[i].leftShift)));
+	}
+
+	return out;
+}
+#endif
+
+static void translateLine(const shared_format_t *shared, uint8_t *dst, const uint32_t *src, int count) {
+	const translate_channel_t *channels = shared->channels;
+	uint32_t pixel;
+	int i = 0;
+
+	switch (shared->bytesPerPixel) {
+	case 4:
+#if defined(TRANSLATE_SSE2)
+		for (; i + 4 <= count; i += 4)
+			_mm_storeu_si128((__m128i *)(dst + i * 4), translateVector(channels, _mm_loadu_si128((const __m128i *)(src + i))));
+#elif defined(TRANSLATE_NEON)
+		for (; i + 4 <= count; i += 4)
+			vst1q_u32((uint32_t *)(dst + i * 4), translateVector(channels, vld1q_u32(src + i)));
+#endif
+		for (; i < count; i++) {
+			pixel = translatePixel(channels, src[i]);
+			memcpy(dst + i * 4, &pixel, 4);
+		}
+		break;
+
+	case 2:
+#if defined(TRANSLATE_SSE2)
+		// Signed saturation is avoided by packing biased values
+		for (; i + 8 <= count; i += 8) {
+			const __m128i bias32 = _mm_set1_epi32(0x8000);
+			const __m128i bias16 = _mm_set1_epi16((short)0x8000);
+			__m128i lo = _mm_sub_epi32(translateVector(channels, _mm_loadu_si128((const __m128i *)(src + i))), bias32);
+			__m128i hi = _mm_sub_epi32(translateVector(channels, _mm_loadu_si128((const __m128i *)(src + i + 4))), bias32);
+			_mm_storeu_si128((__m128i *)(dst + i * 2), _mm_add_epi16(_mm_packs_epi32(lo, hi), bias16));
+		}
+#elif defined(TRANSLATE_NEON)
+		for (; i + 8 <= count; i += 8) {
+			uint16x4_t lo = vmovn_u32(translateVector(channels, vld1q_u32(src + i)));
+			uint16x4_t hi = vmovn_u32(translateVector(channels, vld1q_u32(src + i + 4)));
+			vst1q_u16((uint16_t *)(dst + i * 2), vcombine_u16(lo, hi));
+		}
+#endif
+		for (; i < count; i++) {
+			uint16_t value = translatePixel(channels, src[i]);
+			memcpy(dst + i * 2, &value, 2);
+		}
+		break;
+
+	case 1:
+#if defined(TRANSLATE_SSE2)
+		for (; i + 16 <= count; i += 16) {
+			__m128i p0 = translateVector(channels, _mm_loadu_si128((const __m128i *)(src + i)));
+			__m128i p1 = translateVector(channels, _mm_loadu_si128((const __m128i *)(src + i + 4)));
+			__m128i p2 = translateVector(channels, _mm_loadu_si128((const __m128i *)(src + i + 8)));
+			__m128i p3 = translateVector(channels, _mm_loadu_si128((const __m128i *)(src + i + 12)));
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(_mm_packs_epi32(p0, p1), _mm_packs_epi32(p2, p3)));
+		}
+#elif defined(TRANSLATE_NEON)
+		for (; i + 8 <= count; i += 8) {
+			uint16x4_t lo = vmovn_u32(translateVector(channels, vld1q_u32(src + i)));
+			uint16x4_t hi = vmovn_u32(translateVector(channels, vld1q_u32(src + i + 4)));
+			vst1_u8(dst + i, vmovn_u16(vcombine_u16(lo, hi)));
+		}
+#endif
+		for (; i < count; i++)
+			dst[i] = translatePixel(channels, src[i]);
+		break;
+	}
+}
+
+// Translates a rectangle of the screen buffer (x2 and y2 are exclusive)
+static void translateRect(shared_format_t *shared, int x1, int y1, int x2, int y2) {
+	int y;
+
+	for (y = y1; y < y2; y++) {
+		char *src = vncScreen->frameBuffer + (size_t)y * vncScreen->paddedWidthInBytes + x1 * (vncScreen->serverFormat.bitsPerPixel / CHAR_BIT);
+		uint8_t *dst = shared->buffer + (size_t)y * shared->bytesPerLine + x1 * shared->bytesPerPixel;
+
+		if (shared->vector)
+			translateLine(shared, dst, (const uint32_t *)src, x2 - x1);
+		else
+			shared->translateFn(shared->owner->translateLookupTable, &vncScreen->serverFormat, &shared->format,
+				src, (char *)dst, vncScreen->paddedWidthInBytes, x2 - x1, 1);
+	}
+
+	metrics.translatedPixels += (uint64_t)(x2 - x1) * (y2 - y1);
+}
+
+// Replaces the libvncserver translator: screen rectangles are copied from the shared buffer
+static void sharedTranslate(char *table, rfbPixelFormat *in, rfbPixelFormat *out, char *iptr, char *optr,
+	int bytesBetweenInputLines, int width, int height) {
+	// The output format is the format member of the client
+	rfbClientPtr cl = (rfbClientPtr)((char *)out - offsetof(rfbClientRec, format));
+	client_info_t *info = cl->clientData;
+	shared_format_t *shared = info->sharedFormat;
+	char *screenEnd = vncScreen->frameBuffer + (size_t)vncScreen->paddedWidthInBytes * vncScreen->height;
+	int inBytes = in->bitsPerPixel / CHAR_BIT;
+	int lineBytes, x, y;
+	size_t offset;
+	uint8_t *src;
+
+	// Single pixel values (e.g. Tight fill colors) are not part of the screen buffer
+	if (!shared || iptr < vncScreen->frameBuffer || iptr >= screenEnd ||
+	    bytesBetweenInputLines != vncScreen->paddedWidthInBytes) {
+		info->translateFn(table, in, out, iptr, optr, bytesBetweenInputLines, width, height);
+		return;
+	}
+
+	offset = iptr - vncScreen->frameBuffer;
+	y = offset / bytesBetweenInputLines;
+	x = (offset % bytesBetweenInputLines) / inBytes;
+	src = shared->buffer + (size_t)y * shared->bytesPerLine + x * shared->bytesPerPixel;
+	lineBytes = width * shared->bytesPerPixel;
+
+	for (y = 0; y < height; y++) {
+		memcpy(optr, src, lineBytes);
+		optr += lineBytes;
+		src += shared->bytesPerLine;
+	}
+}
+
+static shared_format_t *getSharedFormat(rfbClientPtr cl) {
+	shared_format_t *shared, *slot = NULL;
+	int i;
+
+	for (i = 0; i < TRANSLATE_FORMATS; i++) {
+		shared = &sharedFormats[i];
+		if (!shared->buffer) {
+			if (!slot)
+				slot = shared;
+			continue;
+		}
+		if (sameFormat(&shared->format, &cl->format))
+			return shared;
+	}
+
+	// Without a free slot, the client translates for itself
+	if (!slot)
+		return NULL;
+
+	shared = slot;
+	shared->format = cl->format;
+	shared->owner = cl;
+	shared->translateFn = cl->translateFn;
+	shared->bytesPerPixel = cl->format.bitsPerPixel / CHAR_BIT;
+	shared->bytesPerLine = vncScreen->width * shared->bytesPerPixel;
+	shared->buffer = getPoolBuffer((size_t)shared->bytesPerLine * vncScreen->height);
+	if (!shared->buffer)
+		return NULL;
+	shared->vector = setupVector(shared);
+	shared->dirty = sraRgnCreate();
+	shared->clients = 0;
+
+	LOG(" Shared translation buffer created: %d bpp, depth %d (%s converter).\n",
+		shared->format.bitsPerPixel, shared->format.depth, shared->vector ? "vector" : "table");
+
+	// The buffer starts with the whole screen
+	translateRect(shared, 0, 0, vncScreen->width, vncScreen->height);
+
+	return shared;
+}
+
+void releaseSharedFormat(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+	client_info_t *otherInfo;
+	shared_format_t *shared;
+	rfbClientIteratorPtr iterator;
+	rfbClientPtr other;
+
+	if (!info || !info->sharedFormat)
+		return;
+
+	shared = info->sharedFormat;
+	info->sharedFormat = NULL;
+
+	if (--shared->clients == 0) {
+		putPoolBuffer(shared->buffer);
+		sraRgnDestroy(shared->dirty);
+		memset(shared, 0, sizeof(*shared));
+		return;
+	}
+
+	// The lookup table of a leaving owner is freed with it, another client takes over
+	if (shared->owner == cl) {
+		iterator = rfbGetClientIterator(vncScreen);
+		while ((other = rfbClientIteratorNext(iterator)) != NULL) {
+			otherInfo = other->clientData;
+			if (other != cl && otherInfo && otherInfo->sharedFormat == shared) {
+				shared->owner = other;
+				shared->translateFn = otherInfo->translateFn;
+				break;
+			}
+		}
+		rfbReleaseClientIterator(iterator);
+	}
+}
+
+void syncSharedFormat(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+	shared_format_t *shared;
+
+	if (!info)
+		return;
+
+	// libvncserver installs a new translator whenever the client changes its pixel format
+	if (cl->translateFn == sharedTranslate) {
+		if (info->sharedFormat && canShare(cl) && sameFormat(&info->sharedFormat->format, &cl->format))
+			return;
+		cl->translateFn = info->translateFn;
+	}
+
+	releaseSharedFormat(cl);
+
+	if (!canShare(cl))
+		return;
+
+	shared = getSharedFormat(cl);
+	if (!shared)
+		return;
+
+	info->translateFn = cl->translateFn;
+	info->sharedFormat = shared;
+	shared->clients++;
+	cl->translateFn = sharedTranslate;
+}
+
+// Marks a changed screen rectangle (the bounds are inclusive like the callers of rfbMarkRectAsModified)
+void markTranslationDirty(int x1, int y1, int x2, int y2) {
+	sraRegionPtr rect;
+	int i;
+
+	for (i = 0; i < TRANSLATE_FORMATS; i++) {
+		if (!sharedFormats[i].buffer)
+			continue;
+		rect = sraRgnCreateRect(x1, y1, x2 + 1, y2 + 1);
+		sraRgnOr(sharedFormats[i].dirty, rect);
+		sraRgnDestroy(rect);
+	}
+}
+
+// Called right after the screen update, before the clients encode it
+void updateTranslations(void) {
+	rfbClientIteratorPtr iterator;
+	sraRectangleIterator *rects;
+	rfbClientPtr cl;
+	sraRect rect;
+	uint64_t traceStart = TRACE_START();
+	int i;
+
+	// Format and encoding changes of the clients are applied first (owners may change)
+	iterator = rfbGetClientIterator(vncScreen);
+	while ((cl = rfbClientIteratorNext(iterator)) != NULL)
+		syncSharedFormat(cl);
+	rfbReleaseClientIterator(iterator);
+
+	for (i = 0; i < TRANSLATE_FORMATS; i++) {
+		if (!sharedFormats[i].buffer || sraRgnEmpty(sharedFormats[i].dirty))
+			continue;
+
+		rects = sraRgnGetIterator(sharedFormats[i].dirty);
+		while (sraRgnIteratorNext(rects, &rect))
+			translateRect(&sharedFormats[i], rect.x1, rect.y1, MIN(rect.x2, vncScreen->width), MIN(rect.y2, vncScreen->height));
+		sraRgnReleaseIterator(rects);
+		sraRgnMakeEmpty(sharedFormats[i].dirty);
+	}
+
+	TRACE_STOP("updateTranslations", traceStart);
+}
@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for the shared per-format translation buffers
+
+#ifndef TRANSLATE_H
+#define TRANSLATE_H
+
+#include "common.h"
+
+#define TRANSLATE_FORMATS 4 // Distinct client pixel formats with a shared buffer
+
+typedef struct {
+	uint32_t rightShift; // Server component shift plus the dropped low bits
+	uint32_t mask; // Maximum of the client component
+	uint32_t leftShift; // Client component shift
+} translate_channel_t;
+
+typedef struct {
+	rfbPixelFormat format; // Client pixel format held in the buffer
+	rfbClientPtr owner; // Client whose lookup table is used without the vector converters
+	rfbTranslateFnType translateFn; // libvncserver translator of the owner
+	uint8_t *buffer; // The screen in the client pixel format
+	int bytesPerPixel;
+	int bytesPerLine;
+	int clients;
+	int vector; // Translated by the vector converters
+	translate_channel_t channels[3];
+	sraRegionPtr dirty; // Changed since the last translation
+} shared_format_t;
+
+void syncSharedFormat(rfbClientPtr cl);
+void releaseSharedFormat(rfbClientPtr cl);
+void markTranslationDirty(int x1, int y1, int x2, int y2);
+void updateTranslations(void);
+
+#endif
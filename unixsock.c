@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Unix domain socket listener for local proxies and recorders
+
+#define _GNU_SOURCE // struct ucred, accept4()
+
+#include "unixsock.h"
+#include "updatescreen.h"
+
+char *unixSocketPath = NULL;
+int unixSocket = -1;
+
+// A socket left behind by a previous instance is removed, a live socket or any other file is kept
+static void removeStaleSocket(const struct sockaddr_un *addr) {
+	struct stat st;
+	int probe, result;
+
+	if (lstat(unixSocketPath, &st) < 0)
+		return;
+
+	if (!S_ISSOCK(st.st_mode)) {
+		LOGE(" Unix socket path exists and is not a socket: %s.\n", unixSocketPath);
+		exit(EXIT_FAILURE);
+	}
+
+	probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (probe < 0) {
+		LOGE(" Could not create Unix socket: %s.\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	result = connect(probe, (const struct sockaddr *)addr, sizeof(*addr));
+	close(probe);
+
+	if (result == 0 || errno != ECONNREFUSED) {
+		LOGE(" Unix socket '%s' is in use by another instance.\n", unixSocketPath);
+		exit(EXIT_FAILURE);
+	}
+
+	unlink(unixSocketPath);
+}
+
+void initUnixSocket(void) {
+	struct sockaddr_un addr;
+	mode_t mask;
+	int result;
+
+	if (!unixSocketPath)
+		return;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(unixSocketPath) >= sizeof(addr.sun_path)) {
+		LOGE(" Unix socket path is too long: %s.\n", unixSocketPath);
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, unixSocketPath);
+
+	unixSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (unixSocket < 0) {
+		LOGE(" Could not create Unix socket: %s.\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	removeStaleSocket(&addr);
+
+	// The socket is created with its final mode, there is no window with the umask permissions
+	mask = umask(~UNIX_SOCKET_MODE & 0777);
+	result = bind(unixSocket, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (result < 0 || listen(unixSocket, UNIX_SOCKET_BACKLOG) < 0) {
+		LOGE(" Could not listen on Unix socket '%s': %s.\n", unixSocketPath, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	LOG(" Listening on Unix socket '%s'.\n", unixSocketPath);
+}
+
+// Local connections are served by libvncserver like the accepted TCP ones (non-blocking as well)
+void acceptUnixClients(void) {
+	int sock;
+
+	if (unixSocket < 0)
+		return;
+
+	while ((sock = accept4(unixSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+		rfbNewClient(vncScreen, sock);
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		LOGE(" Could not accept on Unix socket: %s.\n", strerror(errno));
+}
+
+// Names a local client by its credentials and refuses other users (-1: refused, 0: no Unix client)
+int checkUnixPeer(rfbClientPtr cl) {
+	struct sockaddr_un addr;
+	socklen_t length = sizeof(addr);
+	struct ucred cred;
+	char host[64];
+
+	if (getsockname(cl->sock, (struct sockaddr *)&addr, &length) < 0 || addr.sun_family != AF_UNIX)
+		return 0;
+
+	length = sizeof(cred);
+	if (getsockopt(cl->sock, SOL_SOCKET, SO_PEERCRED, &cred, &length) < 0)
+		return -1;
+
+	snprintf(host, sizeof(host), "unix:pid=%d,uid=%d", (int)cred.pid, (int)cred.uid);
+	free(cl->host);
+	cl->host = strdup(host);
+
+	// The same users as the socket mode (a looser mode set by the administrator is still checked)
+	if (cred.uid != 0 && cred.uid != geteuid() && cred.gid != getegid())
+		return -1;
+
+	return 1;
+}
+
+void closeUnixSocket(void) {
+	if (unixSocket < 0)
+		return;
+
+	close(unixSocket);
+	unlink(unixSocketPath);
+	unixSocket = -1;
+}
@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for the Unix domain socket listener
+
+#ifndef UNIXSOCK_H
+#define UNIXSOCK_H
+
+#include "common.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define UNIX_SOCKET_MODE 0660 // Owner and group of the server may connect
+#define UNIX_SOCKET_BACKLOG 8
+
+extern char *unixSocketPath;
+extern int unixSocket;
+
+void initUnixSocket(void);
+void acceptUnixClients(void);
+int checkUnixPeer(rfbClientPtr cl);
+void closeUnixSocket(void);
+
+#endif
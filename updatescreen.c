@@ -6,36 +6,84 @@
 uint32_t *vncBuffer;
 rfbScreenInfoPtr vncScreen;
 int blank;
+int forceRefresh = 0;
+
+// Per-head results of the current update
+typedef struct {
+	int changed;
+	int yMin;
+	int yMax;
+	uint32_t captured; // Pixels examined in this head
+} head_update_t;
+
+static head_update_t headUpdates[MAX_HEADS];
+static int wasBlank;
+static int shiftSeed;
+
+// Compares a served pixel with the captured (and possibly scaled) content
+static inline int pixelChanged(const screen_head_t *head, const uint8_t *vb, const uint8_t *fb,
+	size_t vbOffset, size_t fbOffset, int x, int y, int pixelBytes) {
+	if (head->scale.step != SCALE_ONE)
+		return *(uint32_t *)(vb + vbOffset + x * 4) != scalePixel(head, x, y);
+	if (pixelBytes == 2)
+		return *(uint16_t *)(vb + vbOffset + x * 2) != *(uint16_t *)(fb + fbOffset + x * 2);
+	return *(uint32_t *)(vb + vbOffset + x * 4) != convertPixel(head->info.convert, fb + fbOffset + x * head->info.pixelBytes);
+}
 
-void updateScreen(void) {
-	int x, y, xMin, yMin, xMax, yMax;
-	int slip, step, shift;
-	int vbOffset = 0, fbOffset = 0, pxOffset = 0;
+static void updateHead(int index) {
+	screen_head_t *head = &screenHeads[index];
+	head_update_t *update = &headUpdates[index];
+	int width = head->scale.width, height = head->scale.height;
+	int x, y, yMin, yMax;
+	int slip, step, shift, headIdle;
+	int pxOffset = 0, pixelBytes, lineBytes;
+	size_t vbOffset = 0, fbOffset = 0;
+	uint64_t traceStart;
 
 	// Reset idle state
-	idle = 1;
-
-	// Reset blank frame indicator
-	blank = 0;
+	headIdle = 1;
+	update->changed = 0;
+	update->captured = 0;
 
-	// Bounding box init
-	xMin = 0;
-	xMax = screenInfo.width - 1;
-	yMin = screenInfo.height - 1;
+	// Bounding box init (in served lines, which differ from the captured ones when scaled)
+	yMin = height - 1;
 	yMax = 0;
 
 	// Create buffers
-	uint32_t* fb = readFrameBuffer();
-	uint32_t* vb = vncBuffer;
+	traceStart = TRACE_START();
+	readFrameBuffer(index);
+	TRACE_STOP("readFrameBuffer", traceStart);
+	uint8_t* fb = head->buffer;
+	uint8_t* vb = (uint8_t *)vncBuffer;
+
+	// Server side pixel and line sizes
+	pixelBytes = screenFormat.bitsPerPixel / CHAR_BIT;
+	lineBytes = screenFormat.width * pixelBytes;
+	vb += head->x * pixelBytes;
+
+	// A suspended head is cleared only once
+	if (!fb) {
+		if (!head->blank) {
+			for (y = 0; y < height; y++)
+				memset(vb + (size_t)y * lineBytes, 0, width * pixelBytes);
+			update->yMin = 0;
+			update->yMax = height - 1;
+			update->changed = 1;
+			head->blank = 1;
+			if (videoRate)
+				videoMarkRows(index, 0, height - 1);
+		}
+		return;
+	}
 
 	// Set the pixel grid slip (depends on the resolution)
-	if (screenInfo.height < 540) {
+	if (height < 540) {
 		slip = 2; // Height below 540 pixels
-	} else if (screenInfo.height < 720) {
+	} else if (height < 720) {
 		slip = 3; // Height between 540 and 719 pixels
-	} else if (screenInfo.height < 1080) {
+	} else if (height < 1080) {
 		slip = 4; // Height between 720 and 1079 pixels
-	} else if (screenInfo.height < 1440) {
+	} else if (height < 1440) {
 		slip = 5; // Height between 1080 and 1439 pixels
 	} else {
 		slip = 6; // Height from 1440 pixels and above
@@ -44,50 +92,151 @@ void updateScreen(void) {
 	// Set the inline pixel step
 	step = SQUARE(slip) - 1;
 
-	// Generate a random step shift (It helps to eliminate any remaining dirty zones between each image update.)
-	shift = rand() % step;
-
-	// Compare the buffers and find the differences in every line
-	for (y = 0; y < screenInfo.height; y++) {
-		// Set all offsets
-		vbOffset = y * screenInfo.width;
-		fbOffset = (screenInfo.start + y) * (screenInfo.stride / (BPP / CHAR_BIT));
-		pxOffset = (y * slip + shift) % step;
-
-		// Compare certain pixels in every line with an offset
-		for (x = pxOffset; x < screenInfo.width; x += step) {
-			if (vb[x + vbOffset] != fb[x + fbOffset]) {
-				if (idle) {
-					// The current line reduced by the slip value -> Set as the first different line
-					yMin = MIN(y - slip, yMin);
-					idle = 0;
+	// Apply the random step shift (It helps to eliminate any remaining dirty zones between each image update.)
+	shift = shiftSeed % step;
+
+	if (forceRefresh) {
+		// Full copy without diffing (the previous content is unknown)
+		yMin = 0;
+		yMax = height - 1;
+		headIdle = 0;
+	} else if (head->damage.valid && !wasBlank && !head->blank) {
+		// The backend reported the exact changed lines, no sampling is required
+		if (head->damage.yMin <= head->damage.yMax) {
+			yMin = head->damage.yMin;
+			yMax = head->damage.yMax;
+			if (head->scale.step != SCALE_ONE)
+				scaleDamage(&head->scale, &yMin, &yMax);
+			headIdle = 0;
+		}
+	} else {
+		traceStart = TRACE_START();
+
+		// Compare the buffers and find the differences in every line
+		for (y = 0; y < height; y++) {
+			// Set all offsets
+			vbOffset = (size_t)y * lineBytes;
+			fbOffset = (size_t)(head->info.start + y) * head->info.stride;
+			pxOffset = (y * slip + shift) % step;
+
+			// Compare certain pixels in every line with an offset
+			for (x = pxOffset; x < width; x += step) {
+				if (pixelChanged(head, vb, fb, vbOffset, fbOffset, x, y, pixelBytes)) {
+					if (headIdle) {
+						// The current line reduced by the slip value -> Set as the first different line
+						yMin = MIN(y - slip, yMin);
+						headIdle = 0;
+					}
+					// The current line increased by the slip value -> Set as the last different line
+					yMax = MAX(y + slip, yMax);
+					break; // There is no need to examine this line anymore if it already has a difference
 				}
-				// The current line increased by the slip value -> Set as the last different line
-				yMax = MAX(y + slip, yMax);
-				break; // There is no need to examine this line anymore if it already has a difference
 			}
 		}
+
+		TRACE_STOP("diff", traceStart);
 	}
 
+	head->blank = 0;
+	update->captured = head->info.width * head->info.height;
+
 	// Fill the image buffer with the new content
-	if (!idle) {
+	if (!headIdle) {
 		yMin = MAX(0, yMin);
-		yMax = MIN(screenInfo.height - 1, yMax);
-
-		for (y = yMin; y <= yMax; y++) {
-			vbOffset = y * screenInfo.width;
-			fbOffset = (screenInfo.start + y) * (screenInfo.stride / (BPP / CHAR_BIT));
-			memcpy(vncBuffer + vbOffset, fb + fbOffset, screenInfo.width * BPP / CHAR_BIT);
+		yMax = MIN(height - 1, yMax);
+
+		traceStart = TRACE_START();
+		if (head->scale.step != SCALE_ONE) {
+			// Only the changed lines are rescaled
+			scaleLines(index, vb, lineBytes, yMin, yMax);
+		} else {
+			for (y = yMin; y <= yMax; y++) {
+				vbOffset = (size_t)y * lineBytes;
+				fbOffset = (size_t)(head->info.start + y) * head->info.stride;
+				if (head->info.convert == CONVERT_NONE) {
+					// The tiles which really changed are found before the line is overwritten
+					if (videoRate)
+						videoCompareLine(index, y, vb + vbOffset, fb + fbOffset, pixelBytes);
+					memcpy(vb + vbOffset, fb + fbOffset, width * pixelBytes);
+				} else {
+					convertLine(head->info.convert, (uint32_t *)(vb + vbOffset), fb + fbOffset, width);
+				}
+			}
 		}
 
-		rfbMarkRectAsModified(vncScreen, xMin, yMin, xMax, yMax);
+		if (videoRate && (head->scale.step != SCALE_ONE || head->info.convert != CONVERT_NONE))
+			videoMarkRows(index, yMin, yMax);
+
+		TRACE_STOP(head->scale.step != SCALE_ONE ? "scale" : "copy", traceStart);
+
+		update->yMin = yMin;
+		update->yMax = yMax;
+		update->changed = 1;
 	}
 }
 
+void updateScreen(void) {
+	uint64_t traceStart;
+	int i;
+
+	// Reset idle state
+	idle = 1;
+
+	// Reset blank frame indicator (a blank buffer invalidates backend damage)
+	wasBlank = blank;
+	blank = 0;
+
+	// Generate a random seed for the step shift of every head
+	shiftSeed = rand();
+
+	// Capture and diff every head (in parallel, when there are more of them)
+	runWorkers(updateHead, screenHeadCount);
+
+	traceStart = TRACE_START();
+	for (i = 0; i < screenHeadCount; i++) {
+		metrics.capturedPixels += headUpdates[i].captured;
+		if (headUpdates[i].changed) {
+			// With video detection, the changed tiles are marked after the classification
+			if (!videoRate)
+				rfbMarkRectAsModified(vncScreen, screenHeads[i].x, headUpdates[i].yMin,
+					screenHeads[i].x + screenHeads[i].scale.width - 1, headUpdates[i].yMax);
+			markTranslationDirty(screenHeads[i].x, headUpdates[i].yMin,
+				screenHeads[i].x + screenHeads[i].scale.width - 1, headUpdates[i].yMax);
+			exportMarkDirty(screenHeads[i].x, headUpdates[i].yMin,
+				screenHeads[i].x + screenHeads[i].scale.width - 1, headUpdates[i].yMax);
+#ifdef HAVE_OPENH264
+			h264MarkDirty(headUpdates[i].yMin, headUpdates[i].yMax);
+#endif
+			metrics.dirtyPixels += (uint64_t)screenHeads[i].scale.width * (headUpdates[i].yMax - headUpdates[i].yMin + 1);
+			idle = 0;
+		}
+	}
+
+	if (videoRate)
+		videoUpdate();
+
+	TRACE_STOP("rfbMarkRectAsModified", traceStart);
+
+	forceRefresh = 0;
+
+	metrics.frames++;
+	if (!idle)
+		metrics.changedFrames++;
+
+	// Answer the pending input events of the clients
+	if (!idle)
+		latencyScreenChange();
+}
+
 void clearScreen(void) {
 	if (!blank) {
 		memset(vncBuffer, 0, screenFormat.size);
-		rfbMarkRectAsModified(vncScreen, 0, 0, screenInfo.width - 1, screenInfo.height - 1);
+		rfbMarkRectAsModified(vncScreen, 0, 0, screenFormat.width - 1, screenFormat.height - 1);
+		markTranslationDirty(0, 0, screenFormat.width - 1, screenFormat.height - 1);
+		exportMarkDirty(0, 0, screenFormat.width - 1, screenFormat.height - 1);
+#ifdef HAVE_OPENH264
+		h264MarkDirty(0, screenFormat.height - 1);
+#endif
 		blank = 1; // The buffer is filled with a blank frame only once
 		idle = 1;
 	}
@@ -6,13 +6,21 @@
 
 #include "common.h"
 #include "framebuffer.h"
+#include "latency.h"
+#include "scale.h"
+#include "shmexport.h"
+#include "trace.h"
+#include "translate.h"
+#include "video.h"
+#include "workers.h"
 
-#define MIN(a,b) (((a)<(b))?(a):(b))
-#define MAX(a,b) (((a)>(b))?(a):(b))
-#define SQUARE(x) ((x)*(x))
+#ifdef HAVE_OPENH264
+#include "h264.h"
+#endif
 
 extern uint32_t *vncBuffer;
 extern rfbScreenInfoPtr vncScreen;
+extern int forceRefresh;
 
 void updateScreen(void);
 void clearScreen(void);
@@ -0,0 +1,329 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Video region detection (busy tiles are sent lossy at a capped rate)
+
+#include "video.h"
+#include "client.h"
+#include "updatescreen.h"
+
+// Rate of video updates in Hz (0 disables the detection)
+int videoRate = 0;
+int videoTileCount = 0;
+
+typedef struct {
+	video_tile_t *tiles;
+	int columns;
+	int rows;
+} video_head_t;
+
+static video_head_t videoHeads[MAX_HEADS];
+static sraRegionPtr videoDirty = NULL; // Video tiles changed since the last video update
+static int tileTotal = 0;
+static uint64_t lastFlush = 0;
+
+void initVideo(void) {
+	video_head_t *head;
+	int i;
+
+	if (!videoRate)
+		return;
+
+	closeVideo();
+
+	for (i = 0; i < screenHeadCount; i++) {
+		head = &videoHeads[i];
+		head->columns = (screenHeads[i].scale.width + VIDEO_TILE - 1) / VIDEO_TILE;
+		head->rows = (screenHeads[i].scale.height + VIDEO_TILE - 1) / VIDEO_TILE;
+		head->tiles = calloc((size_t)head->columns * head->rows, sizeof(video_tile_t));
+		assert(head->tiles != NULL);
+		tileTotal += head->columns * head->rows;
+	}
+
+	videoDirty = sraRgnCreate();
+}
+
+void closeVideo(void) {
+	int i;
+
+	for (i = 0; i < MAX_HEADS; i++) {
+		free(videoHeads[i].tiles);
+		memset(&videoHeads[i], 0, sizeof(video_head_t));
+	}
+
+	if (videoDirty)
+		sraRgnDestroy(videoDirty);
+	videoDirty = NULL;
+	videoTileCount = 0;
+	tileTotal = 0;
+}
+
+// Video tiles in % of all tiles
+int videoShare(void) {
+	return tileTotal ? videoTileCount * 100 / tileTotal : 0;
+}
+
+// Called for every copied line (from the workers), before the screen buffer is overwritten
+void videoCompareLine(int index, int y, const uint8_t *vb, const uint8_t *fb, int pixelBytes) {
+	video_head_t *head = &videoHeads[index];
+	video_tile_t *tiles;
+	int width = screenHeads[index].scale.width;
+	int column, offset;
+
+	if (!head->tiles)
+		return;
+
+	tiles = head->tiles + (y / VIDEO_TILE) * head->columns;
+	for (column = 0; column < head->columns; column++) {
+		if (tiles[column].changed)
+			continue;
+		offset = column * VIDEO_TILE;
+		if (memcmp(vb + offset * pixelBytes, fb + offset * pixelBytes, MIN(VIDEO_TILE, width - offset) * pixelBytes))
+			tiles[column].changed = 1;
+	}
+}
+
+// Lines which were not compared (converted, scaled or cleared) count as changed
+void videoMarkRows(int index, int yMin, int yMax) {
+	video_head_t *head = &videoHeads[index];
+	int row, column;
+
+	for (row = yMin / VIDEO_TILE; row <= yMax / VIDEO_TILE && row < head->rows; row++) {
+		for (column = 0; column < head->columns; column++)
+			head->tiles[row * head->columns + column].changed = 1;
+	}
+}
+
+// Distinct colors of a 4x4 sample grid, a cheap entropy estimate
+static int sampleColors(int x, int y, int width, int height) {
+	int pixelBytes = screenFormat.bitsPerPixel / CHAR_BIT;
+	int lineBytes = screenFormat.width * pixelBytes;
+	uint32_t samples[16], pixel;
+	int i, j, k, count = 0;
+
+	for (j = 0; j < 4; j++) {
+		for (i = 0; i < 4; i++) {
+			pixel = 0;
+			memcpy(&pixel, (uint8_t *)vncBuffer + (size_t)(y + (j * 2 + 1) * height / 8) * lineBytes +
+				(x + (i * 2 + 1) * width / 8) * pixelBytes, pixelBytes);
+			for (k = 0; k < count && samples[k] != pixel; k++);
+			if (k == count)
+				samples[count++] = pixel;
+		}
+	}
+
+	return count;
+}
+
+static void addRect(sraRegionPtr region, int x1, int y1, int x2, int y2) {
+	sraRegionPtr rect = sraRgnCreateRect(x1, y1, x2, y2);
+
+	sraRgnOr(region, rect);
+	sraRgnDestroy(rect);
+}
+
+// Classifies the tiles of the last frame and marks the changes (replaces rfbMarkRectAsModified)
+void videoUpdate(void) {
+	rfbClientIteratorPtr iterator;
+	rfbClientPtr cl;
+	video_head_t *head;
+	video_tile_t *tile;
+	sraRegionPtr modified, still;
+	int i, row, column, x, y, width, height;
+	int videoTiles = 0, refresh = 0;
+	int changes, runX;
+
+	modified = sraRgnCreate();
+	still = sraRgnCreate();
+
+	for (i = 0; i < screenHeadCount; i++) {
+		head = &videoHeads[i];
+
+		for (row = 0; row < head->rows; row++) {
+			runX = -1;
+			y = row * VIDEO_TILE;
+			height = MIN(VIDEO_TILE, (int)screenHeads[i].scale.height - y);
+
+			for (column = 0; column < head->columns; column++) {
+				tile = &head->tiles[row * head->columns + column];
+				x = screenHeads[i].x + column * VIDEO_TILE;
+				width = MIN(VIDEO_TILE, (int)screenHeads[i].scale.width - column * VIDEO_TILE);
+
+				tile->history = (tile->history << 1) | tile->changed;
+				if (tile->changed)
+					tile->colors = sampleColors(x, y, width, height);
+
+				changes = __builtin_popcount(tile->history);
+				if (!tile->video && changes >= VIDEO_CHANGED && tile->colors >= VIDEO_COLORS) {
+					tile->video = 1;
+				} else if (tile->video && !(tile->history & VIDEO_STILL)) {
+					// The video stopped: the last frame is sent losslessly
+					tile->video = 0;
+					addRect(still, x, y, x + width, y + height);
+					refresh = 1;
+				}
+
+				// Neighbouring changed tiles are marked as one rectangle
+				if (tile->changed && !tile->video) {
+					if (runX < 0)
+						runX = x;
+				} else if (runX >= 0) {
+					addRect(modified, runX, y, x, y + height);
+					runX = -1;
+				}
+
+				if (tile->changed && tile->video)
+					addRect(videoDirty, x, y, x + width, y + height);
+
+				tile->changed = 0;
+				videoTiles += tile->video;
+			}
+
+			if (runX >= 0)
+				addRect(modified, runX, y, screenHeads[i].x + screenHeads[i].scale.width, y + height);
+		}
+	}
+
+	if (!sraRgnEmpty(modified))
+		rfbMarkRegionAsModified(vncScreen, modified);
+	sraRgnDestroy(modified);
+
+	if (refresh) {
+		sraRgnSubtract(videoDirty, still);
+		rfbMarkRegionAsModified(vncScreen, still);
+
+		iterator = rfbGetClientIterator(vncScreen);
+		while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+			if (cl->clientData)
+				((client_info_t *)cl->clientData)->videoRefresh = 1;
+		}
+		rfbReleaseClientIterator(iterator);
+	}
+
+	sraRgnDestroy(still);
+
+	if (videoTiles && !videoTileCount)
+		LOG(" Video detected, %d tiles are sent at %d Hz.\n", videoTiles, videoRate);
+	else if (!videoTiles && videoTileCount)
+		LOG(" Video stopped.\n");
+	videoTileCount = videoTiles;
+}
+
+// Sends the pending video tiles at the capped rate
+void videoFlush(void) {
+	rfbClientIteratorPtr iterator;
+	rfbClientPtr cl;
+	client_info_t *info;
+	uint64_t timeNow;
+
+	if (!videoDirty || sraRgnEmpty(videoDirty))
+		return;
+
+	timeNow = getMonotonicTime();
+	if (timeNow - lastFlush < 1000000ULL / videoRate)
+		return;
+	lastFlush = timeNow;
+
+	rfbMarkRegionAsModified(vncScreen, videoDirty);
+	metrics.videoUpdates++;
+
+	// The update which carries these tiles is sent lossy
+	iterator = rfbGetClientIterator(vncScreen);
+	while ((cl = rfbClientIteratorNext(iterator)) != NULL) {
+		info = cl->clientData;
+		if (!info)
+			continue;
+		if (!info->videoPending)
+			info->videoPending = sraRgnCreate();
+		sraRgnOr(info->videoPending, videoDirty);
+	}
+	rfbReleaseClientIterator(iterator);
+
+	sraRgnMakeEmpty(videoDirty);
+}
+
+// Lowers the JPEG quality of an update with video tiles, a lossless refresh disables JPEG (display hook)
+void videoPrepareUpdate(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+	sraRegionPtr sent, video;
+	int lossy = 0;
+
+	if (!info)
+		return;
+
+	if (!info->videoRefresh && info->videoPending && !sraRgnEmpty(info->videoPending)) {
+		// The update covers the requested part of the modified region
+		sent = sraRgnCreateRgn(cl->modifiedRegion);
+		sraRgnAnd(sent, cl->requestedRegion);
+		video = sraRgnCreateRgn(sent);
+		sraRgnAnd(video, info->videoPending);
+
+		if (!sraRgnEmpty(video)) {
+			// Other changes go out lossy with the video tiles, they are sent again losslessly
+			lossy = 1;
+			sraRgnSubtract(sent, info->videoPending);
+			if (info->videoRepair) {
+				sraRgnOr(info->videoRepair, sent);
+				sraRgnDestroy(sent);
+			} else {
+				info->videoRepair = sent;
+			}
+		} else {
+			sraRgnDestroy(sent);
+		}
+		sraRgnDestroy(video);
+	}
+
+	if (!lossy && !info->videoRefresh)
+		return;
+
+	info->qualitySaved = 1;
+	info->savedQuality = cl->tightQualityLevel;
+	info->savedTurboQuality = cl->turboQualityLevel;
+
+	if (info->videoRefresh) {
+		cl->tightQualityLevel = -1;
+		cl->turboQualityLevel = -1;
+	} else {
+		// Only clients which enabled JPEG themselves receive it
+		if (cl->tightQualityLevel >= 0)
+			cl->tightQualityLevel = MIN(cl->tightQualityLevel, VIDEO_QUALITY);
+		if (cl->turboQualityLevel >= 0)
+			cl->turboQualityLevel = MIN(cl->turboQualityLevel, VIDEO_TURBO_QUALITY);
+	}
+}
+
+void videoFinishUpdate(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+
+	if (!info || !info->qualitySaved)
+		return;
+
+	cl->tightQualityLevel = info->savedQuality;
+	cl->turboQualityLevel = info->savedTurboQuality;
+	info->qualitySaved = 0;
+	info->videoRefresh = 0;
+
+	// Video tiles outside of the requested region stay pending, modifiedRegion holds the unsent rest
+	if (info->videoPending)
+		sraRgnAnd(info->videoPending, cl->modifiedRegion);
+
+	// The next update repairs the areas which were sent lossy next to the video tiles
+	if (info->videoRepair) {
+		if (!sraRgnEmpty(info->videoRepair)) {
+			sraRgnOr(cl->modifiedRegion, info->videoRepair);
+			info->videoRefresh = 1;
+		}
+		sraRgnDestroy(info->videoRepair);
+		info->videoRepair = NULL;
+	}
+}
+
+void videoCloseClient(rfbClientPtr cl) {
+	client_info_t *info = cl->clientData;
+
+	if (info->videoPending)
+		sraRgnDestroy(info->videoPending);
+	if (info->videoRepair)
+		sraRgnDestroy(info->videoRepair);
+	info->videoPending = NULL;
+	info->videoRepair = NULL;
+}
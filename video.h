@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for video region detection
+
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include "common.h"
+#include "framebuffer.h"
+
+#define VIDEO_TILE 64 // Tile size in served pixels
+#define VIDEO_CHANGED 12 // Changed frames out of the last 16 which make a tile a video candidate
+#define VIDEO_COLORS 10 // Distinct sampled colors (out of 16) of a video tile
+#define VIDEO_STILL 0x00ff // Unchanged recent frames (history mask) which end a video tile
+#define VIDEO_QUALITY 2 // Tight JPEG quality level (0-9) of video updates
+#define VIDEO_TURBO_QUALITY 30 // JPEG quality (1-100) of video updates for TurboVNC clients
+
+typedef struct {
+	uint16_t history; // Changed flag of the last 16 frames (bit 0: latest frame)
+	uint8_t colors; // Distinct colors of the last sample
+	uint8_t changed; // Changed in the current frame
+	uint8_t video; // Sent as a video tile
+} video_tile_t;
+
+extern int videoRate;
+extern int videoTileCount;
+
+void initVideo(void);
+void closeVideo(void);
+void videoCompareLine(int head, int y, const uint8_t *vb, const uint8_t *fb, int pixelBytes);
+void videoMarkRows(int head, int yMin, int yMax);
+void videoUpdate(void);
+void videoFlush(void);
+int videoShare(void);
+void videoPrepareUpdate(rfbClientPtr cl);
+void videoFinishUpdate(rfbClientPtr cl);
+void videoCloseClient(rfbClientPtr cl);
+
+#endif
@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Shared worker pool for per-head capture jobs
+
+#include "workers.h"
+
+static pthread_mutex_t workerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workerWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workerDone = PTHREAD_COND_INITIALIZER;
+static pthread_t workerThreads[WORKER_MAX];
+static int workerCount = 0;
+static int workerExit = 0;
+static unsigned int workerGeneration = 0;
+
+// Current batch (protected by the lock)
+static worker_job_t batchJob;
+static int batchNext, batchCount, batchPending;
+
+static int takeJob(void) {
+	return batchNext < batchCount ? batchNext++ : -1;
+}
+
+static void *workerThread(void *arg) {
+	unsigned int generation = 0;
+	int index;
+
+	pthread_mutex_lock(&workerLock);
+
+	while (!workerExit) {
+		if (generation == workerGeneration) {
+			pthread_cond_wait(&workerWake, &workerLock);
+			continue;
+		}
+
+		generation = workerGeneration;
+
+		while ((index = takeJob()) >= 0) {
+			pthread_mutex_unlock(&workerLock);
+			batchJob(index);
+			pthread_mutex_lock(&workerLock);
+
+			if (--batchPending == 0)
+				pthread_cond_signal(&workerDone);
+		}
+	}
+
+	pthread_mutex_unlock(&workerLock);
+	return NULL;
+}
+
+void runWorkers(worker_job_t job, int count) {
+	int index;
+
+	// A single job runs inline, there is nothing to parallelize
+	if (count <= 1) {
+		if (count == 1)
+			job(0);
+		return;
+	}
+
+	// Threads are started on first use and kept for the lifetime of the process
+	while (workerCount < MIN(count, WORKER_MAX) - 1) {
+		if (pthread_create(&workerThreads[workerCount], NULL, workerThread, NULL) != 0)
+			break;
+		workerCount++;
+	}
+
+	pthread_mutex_lock(&workerLock);
+
+	batchJob = job;
+	batchNext = 0;
+	batchCount = count;
+	batchPending = count;
+	workerGeneration++;
+	pthread_cond_broadcast(&workerWake);
+
+	// The calling thread takes part in the batch as well
+	while ((index = takeJob()) >= 0) {
+		pthread_mutex_unlock(&workerLock);
+		job(index);
+		pthread_mutex_lock(&workerLock);
+		batchPending--;
+	}
+
+	while (batchPending > 0)
+		pthread_cond_wait(&workerDone, &workerLock);
+
+	pthread_mutex_unlock(&workerLock);
+}
+
+void closeWorkers(void) {
+	int i;
+
+	pthread_mutex_lock(&workerLock);
+	workerExit = 1;
+	pthread_cond_broadcast(&workerWake);
+	pthread_mutex_unlock(&workerLock);
+
+	for (i = 0; i < workerCount; i++)
+		pthread_join(workerThreads[i], NULL);
+
+	workerCount = 0;
+	workerExit = 0;
+}
@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: LGPL-3.0-or-later
+// Header file for the shared worker pool
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include "common.h"
+
+#include <pthread.h>
+
+#define WORKER_MAX 4
+
+typedef void (*worker_job_t)(int index);
+
+void runWorkers(worker_job_t job, int count);
+void closeWorkers(void);
+
+#endif